@@ -0,0 +1,374 @@
+#ifndef KT_ARENA_H
+#define KT_ARENA_H
+
+/*
+ * render loop memory.
+ *
+ * - arena_t: bump allocator for data that lives for one frame. reset at
+ *   the start of every frame; if a frame outgrew it, the chunks are merged
+ *   into one big enough block so the next frames no longer allocate.
+ * - pool_t: fixed size blocks carved from slabs, never returned to the
+ *   system. pool_allocator_t puts power of two size classes on top of it
+ *   for long lived objects whose size varies, like ImGui's buffers.
+ * - alloc_counters: every allocation routed through here is counted, and
+ *   alloc_tracker_t turns the counts into per frame numbers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+/*    counters     */
+
+typedef struct
+{
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t bytes;
+} alloc_counters_t;
+
+// updated from any thread, startup allocates on workers
+static alloc_counters_t alloc_counters;
+
+static inline void CountAlloc(size_t bytes)
+{
+  __atomic_fetch_add(&alloc_counters.allocs, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&alloc_counters.bytes, bytes, __ATOMIC_RELAXED);
+}
+
+static inline void CountFree(void)
+{
+  __atomic_fetch_add(&alloc_counters.frees, 1, __ATOMIC_RELAXED);
+}
+
+static inline alloc_counters_t SnapshotAllocCounters(void)
+{
+  alloc_counters_t c;
+  c.allocs = __atomic_load_n(&alloc_counters.allocs, __ATOMIC_RELAXED);
+  c.frees = __atomic_load_n(&alloc_counters.frees, __ATOMIC_RELAXED);
+  c.bytes = __atomic_load_n(&alloc_counters.bytes, __ATOMIC_RELAXED);
+  return c;
+}
+
+/*    arena     */
+
+typedef struct arena_chunk arena_chunk_t;
+
+struct arena_chunk
+{
+  arena_chunk_t *next;
+  size_t size;
+  size_t used;
+  // data follows, 16 byte aligned
+};
+
+#define ARENA_HEADER_SIZE ((sizeof(arena_chunk_t) + 15) & ~(size_t)15)
+
+typedef struct
+{
+  arena_chunk_t *head;        // current chunk, older ones follow
+  size_t frame_bytes;         // allocated since the last reset
+  size_t peak_bytes;
+  unsigned int grows;         // chunks added after the first
+} arena_t;
+
+static arena_chunk_t *arena_new_chunk(size_t size, arena_chunk_t *next)
+{
+  arena_chunk_t *chunk = (arena_chunk_t *)malloc(ARENA_HEADER_SIZE + size);
+  assert(chunk);
+  CountAlloc(ARENA_HEADER_SIZE + size);
+  chunk->next = next;
+  chunk->size = size;
+  chunk->used = 0;
+  return chunk;
+}
+
+static void InitArena(arena_t *arena, size_t size)
+{
+  memset(arena, 0, sizeof(*arena));
+  arena->head = arena_new_chunk(size, NULL);
+}
+
+static void DestroyArena(arena_t *arena)
+{
+  arena_chunk_t *chunk = arena->head;
+  while (chunk) {
+    arena_chunk_t *next = chunk->next;
+    CountFree();
+    free(chunk);
+    chunk = next;
+  }
+  arena->head = NULL;
+}
+
+/* align must be a power of two no larger than 16 */
+static void *ArenaAlloc(arena_t *arena, size_t size, size_t align)
+{
+  arena_chunk_t *chunk = arena->head;
+  size_t offset = (chunk->used + align - 1) & ~(align - 1);
+
+  if (offset + size > chunk->size) {
+    size_t grow = chunk->size * 2;
+    chunk = arena_new_chunk(grow > size ? grow : size, chunk);
+    arena->head = chunk;
+    arena->grows++;
+    offset = 0;
+  }
+
+  chunk->used = offset + size;
+  arena->frame_bytes += size;
+  return (uint8_t *)chunk + ARENA_HEADER_SIZE + offset;
+}
+
+/* drops everything allocated since the last reset */
+static void ResetArena(arena_t *arena)
+{
+  if (arena->frame_bytes > arena->peak_bytes) {
+    arena->peak_bytes = arena->frame_bytes;
+  }
+
+  // outgrown: replace all chunks with one that fits the whole frame
+  if (arena->head->next) {
+    size_t total = 0;
+    for (arena_chunk_t *chunk = arena->head; chunk; chunk = chunk->next) {
+      total += chunk->size;
+    }
+    DestroyArena(arena);
+    arena->head = arena_new_chunk(total, NULL);
+  }
+
+  arena->head->used = 0;
+  arena->frame_bytes = 0;
+}
+
+/*    pool     */
+
+typedef struct pool_block pool_block_t;
+
+struct pool_block
+{
+  pool_block_t *next;
+};
+
+typedef struct
+{
+  size_t block_size;
+  size_t blocks_per_slab;
+  pool_block_t *free_list;
+  void *slabs;                // singly linked through their first word
+  size_t live;
+  size_t capacity;
+} pool_t;
+
+static void InitPool(pool_t *pool, size_t block_size, size_t blocks_per_slab)
+{
+  memset(pool, 0, sizeof(*pool));
+  // at least a pointer, multiple of 16 so blocks stay aligned
+  if (block_size < sizeof(pool_block_t)) {
+    block_size = sizeof(pool_block_t);
+  }
+  pool->block_size = (block_size + 15) & ~(size_t)15;
+  pool->blocks_per_slab = blocks_per_slab;
+}
+
+static void pool_grow(pool_t *pool)
+{
+  size_t header = 16;
+  uint8_t *slab = (uint8_t *)malloc(header + pool->block_size * pool->blocks_per_slab);
+  assert(slab);
+  CountAlloc(header + pool->block_size * pool->blocks_per_slab);
+
+  *(void **)slab = pool->slabs;
+  pool->slabs = slab;
+
+  for (size_t i = pool->blocks_per_slab; i-- > 0;) {
+    pool_block_t *block = (pool_block_t *)(slab + header + i * pool->block_size);
+    block->next = pool->free_list;
+    pool->free_list = block;
+  }
+  pool->capacity += pool->blocks_per_slab;
+}
+
+static void *PoolAlloc(pool_t *pool)
+{
+  if (!pool->free_list) {
+    pool_grow(pool);
+  }
+  pool_block_t *block = pool->free_list;
+  pool->free_list = block->next;
+  pool->live++;
+  return block;
+}
+
+static void PoolFree(pool_t *pool, void *ptr)
+{
+  pool_block_t *block = (pool_block_t *)ptr;
+  block->next = pool->free_list;
+  pool->free_list = block;
+  pool->live--;
+}
+
+static void DestroyPool(pool_t *pool)
+{
+  void *slab = pool->slabs;
+  while (slab) {
+    void *next = *(void **)slab;
+    CountFree();
+    free(slab);
+    slab = next;
+  }
+  memset(pool, 0, sizeof(*pool));
+}
+
+/*    size class allocator     */
+
+#define POOL_MIN_SHIFT 4          // 16 bytes
+#define POOL_MAX_SHIFT 16         // 64 KiB, larger goes to malloc
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_LARGE_CLASS 0xff
+
+typedef struct
+{
+  pool_t classes[POOL_CLASSES];
+  uint64_t requests;          // every PooledAlloc, served from a pool or not
+  uint64_t large;             // went to malloc
+} pool_allocator_t;
+
+// each block starts with its size class, the user data follows 16 bytes later
+#define POOL_PREFIX 16
+
+static void InitPoolAllocator(pool_allocator_t *allocator)
+{
+  memset(allocator, 0, sizeof(*allocator));
+  for (int i = 0; i < POOL_CLASSES; ++i) {
+    size_t size = (size_t)1 << (POOL_MIN_SHIFT + i);
+    // about 64 KiB per slab, at least 4 blocks
+    size_t per_slab = (64 * 1024) / size;
+    InitPool(&allocator->classes[i], size + POOL_PREFIX, per_slab < 4 ? 4 : per_slab);
+  }
+}
+
+static void DestroyPoolAllocator(pool_allocator_t *allocator)
+{
+  for (int i = 0; i < POOL_CLASSES; ++i) {
+    DestroyPool(&allocator->classes[i]);
+  }
+}
+
+static void *PooledAlloc(pool_allocator_t *allocator, size_t size)
+{
+  allocator->requests++;
+
+  int cls = 0;
+  while (cls < POOL_CLASSES && ((size_t)1 << (POOL_MIN_SHIFT + cls)) < size) {
+    ++cls;
+  }
+
+  uint8_t *block;
+  if (cls == POOL_CLASSES) {
+    block = (uint8_t *)malloc(size + POOL_PREFIX);
+    if (!block) {
+      return NULL;
+    }
+    CountAlloc(size + POOL_PREFIX);
+    allocator->large++;
+    block[0] = POOL_LARGE_CLASS;
+  } else {
+    block = (uint8_t *)PoolAlloc(&allocator->classes[cls]);
+    block[0] = (uint8_t)cls;
+  }
+  return block + POOL_PREFIX;
+}
+
+static void PooledFree(pool_allocator_t *allocator, void *ptr)
+{
+  if (!ptr) {
+    return;
+  }
+  uint8_t *block = (uint8_t *)ptr - POOL_PREFIX;
+  if (block[0] == POOL_LARGE_CLASS) {
+    CountFree();
+    free(block);
+  } else {
+    PoolFree(&allocator->classes[block[0]], block);
+  }
+}
+
+/*    per frame tracking     */
+
+#define ALLOC_REPORT_FRAMES 600
+
+typedef struct
+{
+  alloc_counters_t frame_start;
+  uint64_t frames;
+  uint64_t quiet_frames;      // frames without a single counted allocation
+  uint64_t window_allocs;     // since the last report
+  uint64_t window_bytes;
+  uint64_t window_max_allocs;
+  uint64_t last_allocs;       // previous frame
+  uint64_t last_bytes;
+} alloc_tracker_t;
+
+static void InitAllocTracker(alloc_tracker_t *tracker)
+{
+  memset(tracker, 0, sizeof(*tracker));
+  tracker->frame_start = SnapshotAllocCounters();
+}
+
+static size_t heap_in_use(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  return mallinfo2().uordblks;
+#else
+  return 0;
+#endif
+}
+
+static void PrintAllocStats(const alloc_tracker_t *tracker, const arena_t *arena)
+{
+  uint64_t frames = tracker->frames % ALLOC_REPORT_FRAMES ? tracker->frames % ALLOC_REPORT_FRAMES : ALLOC_REPORT_FRAMES;
+  printf("alloc: frame %llu, %.2f allocs/frame (max %llu), %.0f bytes/frame, %llu/%llu frames without allocation\n",
+         (unsigned long long)tracker->frames, (double)tracker->window_allocs / frames,
+         (unsigned long long)tracker->window_max_allocs, (double)tracker->window_bytes / frames,
+         (unsigned long long)tracker->quiet_frames, (unsigned long long)tracker->frames);
+  if (arena) {
+    printf("alloc: frame arena %zu bytes, peak %zu, grew %u times, heap in use %zu\n",
+           arena->head ? arena->head->size : 0, arena->peak_bytes, arena->grows, heap_in_use());
+  }
+}
+
+/* call once per frame, at the same point of the loop */
+static void EndAllocFrame(alloc_tracker_t *tracker, const arena_t *arena)
+{
+  alloc_counters_t now = SnapshotAllocCounters();
+  tracker->last_allocs = now.allocs - tracker->frame_start.allocs;
+  tracker->last_bytes = now.bytes - tracker->frame_start.bytes;
+  tracker->frame_start = now;
+
+  tracker->frames++;
+  tracker->window_allocs += tracker->last_allocs;
+  tracker->window_bytes += tracker->last_bytes;
+  if (tracker->last_allocs > tracker->window_max_allocs) {
+    tracker->window_max_allocs = tracker->last_allocs;
+  }
+  if (!tracker->last_allocs) {
+    tracker->quiet_frames++;
+  }
+
+  if (tracker->frames % ALLOC_REPORT_FRAMES == 0) {
+    PrintAllocStats(tracker, arena);
+    tracker->window_allocs = 0;
+    tracker->window_bytes = 0;
+    tracker->window_max_allocs = 0;
+  }
+}
+
+#endif
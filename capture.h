@@ -0,0 +1,615 @@
+#ifndef KT_CAPTURE_H
+#define KT_CAPTURE_H
+
+/*
+ * asynchronous screen capture.
+ *
+ * frames are read back through a ring of pixel pack buffers: glReadPixels
+ * into a PBO only queues a copy on the GPU, a fence tells when it landed,
+ * and the buffer is mapped a few frames later without waiting. the mapped
+ * memory goes straight to a writer thread, which converts and writes it
+ * while the render loop carries on; the render thread only unmaps it once
+ * the writer is done. without PBOs (GLES2) the linear scanout BO is mapped
+ * through gbm after the swap and copied instead, which costs a copy on the
+ * render thread.
+ *
+ * recordings go to one raw rgb24 or y4m stream, or a png per frame;
+ * screenshots are always png. when every slot is busy a frame is dropped,
+ * capture never blocks rendering. a new output size stops the recording
+ * and starts a new stream, a stream holds one size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <gbm.h>
+#include <epoxy/gl.h>
+
+#include "pixels.h"
+#include "stb/stb_image_write.h"
+
+// frames in flight between glReadPixels and the writer
+#define CAPTURE_SLOTS 4
+
+typedef enum
+{
+  CAPTURE_FORMAT_RAW = 0,     // one rgb24 stream, capture-WxH.rgb
+  CAPTURE_FORMAT_Y4M,         // one 4:4:4 full range stream, capture.y4m
+  CAPTURE_FORMAT_PNG,         // frame-NNNNNN.png
+} capture_format_t;
+
+typedef enum
+{
+  CAPTURE_SLOT_FREE = 0,
+  CAPTURE_SLOT_READING,       // copy queued on the GPU, fence pending
+  CAPTURE_SLOT_MAPPED,        // handed to the writer
+  CAPTURE_SLOT_DONE,          // written, to be unmapped by the render thread
+} capture_slot_state_t;
+
+typedef struct
+{
+  capture_slot_state_t state;
+  GLuint pbo;
+  GLsync fence;
+  uint8_t *copy;              // gbm path: copy of the scanout BO
+
+  const uint8_t *pixels;
+  size_t stride;
+  pixel_format_t format;
+  bool bottom_up;
+  uint64_t frame;
+  bool screenshot;
+  bool record;
+} capture_slot_t;
+
+typedef struct
+{
+  char dir[PATH_MAX];
+  capture_format_t format;
+  int width;
+  int height;
+  int fps;
+  bool use_pbo;
+
+  capture_slot_t slots[CAPTURE_SLOTS];
+  unsigned int submit;        // next slot to read into
+  unsigned int collect;       // next slot waiting on its fence
+  unsigned int release;       // next slot to unmap
+  unsigned int writer_start;  // first slot of a writer thread, all slots are free when it starts
+
+  int record_frames;          // frames left to record
+  bool screenshot_pending;
+  bool want_scanout;          // gbm path: capture the frame being swapped
+  uint64_t frame;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool quit;
+  FILE *stream;
+  int stream_index;           // streams after the first get a -N suffix
+  uint64_t stream_frames;     // recorded into the current stream
+  uint8_t *rgb;               // writer scratch, tightly packed rgb24
+
+  uint64_t captured;
+  uint64_t dropped;
+  uint64_t written;
+  uint64_t screenshots;
+  double render_ms;           // time spent in capture calls on the render thread
+  double render_ms_max;
+  double interval_ms;         // between captured frames while capturing
+  struct timespec last_frame;
+} capture_t;
+
+static double capture_ms(const struct timespec *since, const struct timespec *now)
+{
+  return (now->tv_sec - since->tv_sec) * 1e3 + (now->tv_nsec - since->tv_nsec) * 1e-6;
+}
+
+static const char *capture_format_names[] = { "raw", "y4m", "png" };
+
+/* returns -1 for an unknown name */
+static int ParseCaptureFormat(const char *name)
+{
+  for (int i = 0; i < (int)(sizeof(capture_format_names) / sizeof(capture_format_names[0])); ++i) {
+    if (strcmp(name, capture_format_names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* BT.601 full range, planar 4:4:4 */
+static void capture_write_y4m(FILE *stream, const uint8_t *rgb, int width, int height, uint8_t *plane)
+{
+  size_t count = (size_t)width * height;
+
+  fputs("FRAME\n", stream);
+  for (int c = 0; c < 3; ++c) {
+    for (size_t i = 0; i < count; ++i) {
+      int r = rgb[i * 3 + 0], g = rgb[i * 3 + 1], b = rgb[i * 3 + 2];
+      int v;
+      if (c == 0) {
+        v = (77 * r + 150 * g + 29 * b + 128) >> 8;
+      } else if (c == 1) {
+        v = ((-43 * r - 85 * g + 128 * b + 128) >> 8) + 128;
+      } else {
+        v = ((128 * r - 107 * g - 21 * b + 128) >> 8) + 128;
+      }
+      plane[i] = (uint8_t)(v < 0 ? 0 : v > 255 ? 255 : v);
+    }
+    fwrite(plane, 1, count, stream);
+  }
+}
+
+static void capture_write_slot(capture_t *capture, capture_slot_t *slot)
+{
+  int width = capture->width;
+  int height = capture->height;
+  size_t rgb_stride = (size_t)width * 3;
+
+  // to top down rgb24
+  for (int y = 0; y < height; ++y) {
+    int src_y = slot->bottom_up ? height - 1 - y : y;
+    ConvertPixels(capture->rgb + y * rgb_stride, 0, PIXEL_FORMAT_RGB888,
+                  slot->pixels + src_y * slot->stride, 0, slot->format, width, 1, PIXEL_CONVERT_NONE);
+  }
+
+  char path[PATH_MAX + 32];
+  if (slot->screenshot) {
+    snprintf(path, sizeof(path), "%s/screenshot-%06llu.png", capture->dir, (unsigned long long)slot->frame);
+    if (stbi_write_png(path, width, height, 3, capture->rgb, (int)rgb_stride)) {
+      printf("capture: saved %s\n", path);
+    } else {
+      printf("write %s FAILED!\n", path);
+    }
+  }
+  if (!slot->record) {
+    return;
+  }
+
+  switch (capture->format) {
+  case CAPTURE_FORMAT_RAW:
+    fwrite(capture->rgb, rgb_stride, height, capture->stream);
+    break;
+  case CAPTURE_FORMAT_Y4M:
+    // the second half of the scratch buffer is free for a plane
+    capture_write_y4m(capture->stream, capture->rgb, width, height, capture->rgb + rgb_stride * height);
+    break;
+  case CAPTURE_FORMAT_PNG:
+    snprintf(path, sizeof(path), "%s/frame-%06llu.png", capture->dir, (unsigned long long)slot->frame);
+    stbi_write_png(path, width, height, 3, capture->rgb, (int)rgb_stride);
+    break;
+  }
+}
+
+static void *capture_writer(void *arg)
+{
+  capture_t *capture = (capture_t *)arg;
+  unsigned int next = capture->writer_start;
+
+  pthread_mutex_lock(&capture->lock);
+  for (;;) {
+    capture_slot_t *slot = &capture->slots[next % CAPTURE_SLOTS];
+    while (slot->state != CAPTURE_SLOT_MAPPED && !capture->quit) {
+      pthread_cond_wait(&capture->cond, &capture->lock);
+    }
+    if (slot->state != CAPTURE_SLOT_MAPPED) {
+      break;
+    }
+    pthread_mutex_unlock(&capture->lock);
+
+    capture_write_slot(capture, slot);
+
+    pthread_mutex_lock(&capture->lock);
+    slot->state = CAPTURE_SLOT_DONE;
+    capture->written++;
+    next++;
+  }
+  pthread_mutex_unlock(&capture->lock);
+  return NULL;
+}
+
+static bool capture_open_stream(capture_t *capture)
+{
+  char path[PATH_MAX + 48];
+  char suffix[16] = "";
+
+  if (capture->stream_index > 0) {
+    snprintf(suffix, sizeof(suffix), "-%d", capture->stream_index);
+  }
+  if (capture->format == CAPTURE_FORMAT_RAW) {
+    snprintf(path, sizeof(path), "%s/capture-%dx%d%s.rgb", capture->dir, capture->width, capture->height, suffix);
+  } else if (capture->format == CAPTURE_FORMAT_Y4M) {
+    snprintf(path, sizeof(path), "%s/capture%s.y4m", capture->dir, suffix);
+  } else {
+    return true;
+  }
+
+  capture->stream = fopen(path, "wb");
+  if (!capture->stream) {
+    printf("open %s FAILED!\n", path);
+    return false;
+  }
+  if (capture->format == CAPTURE_FORMAT_Y4M) {
+    fprintf(capture->stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444 XCOLORRANGE=FULL\n",
+            capture->width, capture->height, capture->fps);
+  }
+  return true;
+}
+
+/* sized for capture->width and height, PBOs are created once and resized */
+static void capture_alloc_buffers(capture_t *capture)
+{
+  size_t frame_size = (size_t)capture->width * capture->height * 4;
+  // rgb24 frame plus one y4m plane
+  capture->rgb = (uint8_t *)malloc(frame_size);
+  assert(capture->rgb);
+
+  for (int i = 0; i < CAPTURE_SLOTS; ++i) {
+    capture_slot_t *slot = &capture->slots[i];
+    if (capture->use_pbo) {
+      if (!slot->pbo) {
+        glGenBuffers(1, &slot->pbo);
+      }
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+      glBufferData(GL_PIXEL_PACK_BUFFER, frame_size, NULL, GL_STREAM_READ);
+    } else {
+      slot->copy = (uint8_t *)malloc(frame_size);
+      assert(slot->copy);
+    }
+  }
+  if (capture->use_pbo) {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  }
+}
+
+static void capture_start_writer(capture_t *capture)
+{
+  capture->quit = false;
+  capture->writer_start = capture->submit;
+  int ret = pthread_create(&capture->thread, NULL, capture_writer, capture);
+  assert(ret == 0);
+  (void)ret;
+}
+
+/*
+ * needs a current context, as the PBOs are created here. fps only goes
+ * into the y4m header.
+ */
+static bool InitCapture(capture_t *capture, const char *dir, capture_format_t format,
+                        int width, int height, int fps)
+{
+  memset(capture, 0, sizeof(*capture));
+  snprintf(capture->dir, sizeof(capture->dir), "%s", dir);
+  capture->format = format;
+  capture->width = width;
+  capture->height = height;
+  capture->fps = fps > 0 ? fps : 60;
+  capture->use_pbo = epoxy_gl_version() >= 30;
+
+  if (mkdir(capture->dir, 0755) != 0 && errno != EEXIST) {
+    printf("create capture dir %s FAILED!\n", capture->dir);
+    return false;
+  }
+  if (!capture_open_stream(capture)) {
+    return false;
+  }
+
+  capture_alloc_buffers(capture);
+  pthread_mutex_init(&capture->lock, NULL);
+  pthread_cond_init(&capture->cond, NULL);
+  capture_start_writer(capture);
+
+  printf("capture: %dx%d %s to %s, reading back through %s\n", width, height,
+         capture_format_names[format], capture->dir, capture->use_pbo ? "pbo" : "gbm");
+  return true;
+}
+
+/* the next frame is saved as a png */
+static void RequestScreenshot(capture_t *capture)
+{
+  capture->screenshot_pending = true;
+}
+
+static void StartRecording(capture_t *capture, int frames)
+{
+  capture->record_frames = frames;
+}
+
+// the writer waits on slot states, so they only change under the lock
+static void capture_set_state(capture_t *capture, capture_slot_t *slot, capture_slot_state_t state)
+{
+  pthread_mutex_lock(&capture->lock);
+  slot->state = state;
+  pthread_cond_signal(&capture->cond);
+  pthread_mutex_unlock(&capture->lock);
+}
+
+/* unmaps what the writer finished with, maps what the GPU finished copying */
+static void capture_poll(capture_t *capture, GLuint64 timeout_ns)
+{
+  for (;;) {
+    capture_slot_t *slot = &capture->slots[capture->release % CAPTURE_SLOTS];
+    pthread_mutex_lock(&capture->lock);
+    bool done = capture->release != capture->collect && slot->state == CAPTURE_SLOT_DONE;
+    pthread_mutex_unlock(&capture->lock);
+    if (!done) {
+      break;
+    }
+    if (capture->use_pbo) {
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    capture_set_state(capture, slot, CAPTURE_SLOT_FREE);
+    capture->release++;
+  }
+
+  while (capture->use_pbo && capture->collect != capture->submit) {
+    capture_slot_t *slot = &capture->slots[capture->collect % CAPTURE_SLOTS];
+    GLenum status = glClientWaitSync(slot->fence, 0, timeout_ns);
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+      break;
+    }
+    glDeleteSync(slot->fence);
+    slot->fence = 0;
+
+    size_t size = (size_t)capture->width * capture->height * 4;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+    slot->pixels = (const uint8_t *)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+    assert(slot->pixels);
+    capture->collect++;
+    capture_set_state(capture, slot, CAPTURE_SLOT_MAPPED);
+  }
+
+  if (capture->use_pbo) {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  }
+}
+
+/* the slot for this frame, NULL when nothing wants it or no slot is free */
+static capture_slot_t *capture_next_slot(capture_t *capture)
+{
+  if (!capture->screenshot_pending && capture->record_frames <= 0) {
+    return NULL;
+  }
+
+  capture_slot_t *slot = &capture->slots[capture->submit % CAPTURE_SLOTS];
+  pthread_mutex_lock(&capture->lock);
+  bool busy = capture->submit - capture->release >= CAPTURE_SLOTS || slot->state != CAPTURE_SLOT_FREE;
+  pthread_mutex_unlock(&capture->lock);
+  if (busy) {
+    capture->dropped++;
+    return NULL;
+  }
+  return slot;
+}
+
+/* takes the pending screenshot and a recorded frame, once the frame is sure to be read */
+static void capture_claim(capture_t *capture, capture_slot_t *slot)
+{
+  bool screenshot = capture->screenshot_pending;
+  bool record = capture->record_frames > 0;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (capture->captured > 0) {
+    capture->interval_ms += capture_ms(&capture->last_frame, &now);
+  }
+  capture->last_frame = now;
+
+  capture->screenshot_pending = false;
+  if (record && --capture->record_frames == 0) {
+    printf("capture: recording finished at frame %llu\n", (unsigned long long)capture->frame);
+  }
+  slot->screenshot = screenshot;
+  slot->record = record;
+  slot->frame = capture->frame;
+  capture->stream_frames += record;
+  capture->captured++;
+  capture->screenshots += screenshot;
+}
+
+static void capture_account(capture_t *capture, const struct timespec *start)
+{
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double ms = capture_ms(start, &end);
+  capture->render_ms += ms;
+  if (ms > capture->render_ms_max) {
+    capture->render_ms_max = ms;
+  }
+}
+
+/*
+ * call once per frame after rendering, before SwapBuffer, with the default
+ * framebuffer bound.
+ */
+static void CaptureFrame(capture_t *capture)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  capture->frame++;
+  capture_poll(capture, 0);
+
+  capture->want_scanout = false;
+  capture_slot_t *slot = capture_next_slot(capture);
+  if (!slot) {
+    capture_account(capture, &start);
+    return;
+  }
+
+  if (!capture->use_pbo) {
+    // picked up by CaptureScanout after the swap, claimed once the BO maps
+    capture->want_scanout = true;
+    capture_account(capture, &start);
+    return;
+  }
+
+  slot->format = PIXEL_FORMAT_RGBA8888;
+  slot->stride = (size_t)capture->width * 4;
+  slot->bottom_up = true;
+
+  capture_claim(capture, slot);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+  glPixelStorei(GL_PACK_ALIGNMENT, 4);
+  glReadPixels(0, 0, capture->width, capture->height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  capture_set_state(capture, slot, CAPTURE_SLOT_READING);
+  capture->submit++;
+
+  capture_account(capture, &start);
+}
+
+/* call after SwapBuffer with the BO now on screen, only does work without PBOs */
+static void CaptureScanout(capture_t *capture, struct gbm_bo *bo)
+{
+  if (!capture->want_scanout) {
+    return;
+  }
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  capture->want_scanout = false;
+
+  capture_slot_t *slot = &capture->slots[capture->submit % CAPTURE_SLOTS];
+  uint32_t stride = 0;
+  void *map_data = NULL;
+  const uint8_t *map = NULL;
+  if (bo) {
+    map = (const uint8_t *)gbm_bo_map(bo, 0, 0, capture->width, capture->height,
+                                      GBM_BO_TRANSFER_READ, &stride, &map_data);
+  }
+  if (!map) {
+    // nothing was claimed, the screenshot or recording goes to the next frame
+    capture->dropped++;
+    capture_account(capture, &start);
+    return;
+  }
+  // the slot stays free: only this thread frees or fills slots
+  capture_claim(capture, slot);
+
+  // scanout memory is uncached, read it once and in order
+  size_t row = (size_t)capture->width * 4;
+  for (int y = 0; y < capture->height; ++y) {
+    memcpy(slot->copy + y * row, map + (size_t)y * stride, row);
+  }
+  gbm_bo_unmap(bo, map_data);
+
+  slot->pixels = slot->copy;
+  slot->stride = row;
+  slot->format = PIXEL_FORMAT_BGRA8888;   // GBM_BO_FORMAT_ARGB8888
+  slot->bottom_up = false;
+  capture->submit++;
+  capture->collect++;
+  capture_set_state(capture, slot, CAPTURE_SLOT_MAPPED);
+
+  capture_account(capture, &start);
+}
+
+static void PrintCaptureStats(const capture_t *capture)
+{
+  double frames = capture->frame > 0 ? (double)capture->frame : 1.0;
+  printf("capture: %llu frames captured, %llu written, %llu dropped, %llu screenshots\n",
+         (unsigned long long)capture->captured, (unsigned long long)capture->written,
+         (unsigned long long)capture->dropped, (unsigned long long)capture->screenshots);
+  printf("capture: render thread %.3f ms/frame avg, %.3f ms max; %.2f ms between captured frames\n",
+         capture->render_ms / frames, capture->render_ms_max,
+         capture->captured > 1 ? capture->interval_ms / (capture->captured - 1) : 0.0);
+}
+
+/* the writer finishes every mapped frame before it quits, all slots end up free */
+static void capture_drain(capture_t *capture)
+{
+  while (capture->collect != capture->submit) {
+    capture_poll(capture, 100000000);
+  }
+
+  pthread_mutex_lock(&capture->lock);
+  capture->quit = true;
+  pthread_cond_signal(&capture->cond);
+  pthread_mutex_unlock(&capture->lock);
+  pthread_join(capture->thread, NULL);
+
+  capture_poll(capture, 0);
+}
+
+/*
+ * after the output changed size, on the render thread with the context
+ * current. frames in flight are written at the old size; a recording is
+ * stopped, and the next one goes to a new stream unless nothing was
+ * recorded into the current one. returns false when the stream cannot be
+ * opened, capture is then off and only DestroyCapture may be called.
+ */
+static bool ResizeCapture(capture_t *capture, int width, int height, int fps)
+{
+  if (width == capture->width && height == capture->height) {
+    return true;
+  }
+  capture_drain(capture);
+
+  if (capture->record_frames > 0) {
+    printf("capture: recording stopped at frame %llu, output is now %dx%d\n",
+           (unsigned long long)capture->frame, width, height);
+  }
+  capture->record_frames = 0;
+  capture->screenshot_pending = false;
+  capture->want_scanout = false;
+
+  for (int i = 0; i < CAPTURE_SLOTS; ++i) {
+    free(capture->slots[i].copy);
+    capture->slots[i].copy = NULL;
+  }
+  free(capture->rgb);
+  if (capture->stream) {
+    fclose(capture->stream);
+    capture->stream = NULL;
+  }
+
+  capture->width = width;
+  capture->height = height;
+  capture->fps = fps > 0 ? fps : 60;
+  if (capture->stream_frames > 0) {
+    capture->stream_index++;
+    capture->stream_frames = 0;
+  }
+  capture_alloc_buffers(capture);
+  capture_start_writer(capture);
+  if (!capture_open_stream(capture)) {
+    return false;
+  }
+  printf("capture: resized to %dx%d\n", width, height);
+  return true;
+}
+
+/* waits for every frame in flight to be written. needs the context current */
+static void DestroyCapture(capture_t *capture)
+{
+  capture_drain(capture);
+  PrintCaptureStats(capture);
+
+  for (int i = 0; i < CAPTURE_SLOTS; ++i) {
+    if (capture->slots[i].pbo) {
+      glDeleteBuffers(1, &capture->slots[i].pbo);
+    }
+    free(capture->slots[i].copy);
+  }
+  if (capture->stream) {
+    fclose(capture->stream);
+  }
+  free(capture->rgb);
+  pthread_mutex_destroy(&capture->lock);
+  pthread_cond_destroy(&capture->cond);
+}
+
+#endif
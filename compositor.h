@@ -0,0 +1,531 @@
+#ifndef KT_COMPOSITOR_H
+#define KT_COMPOSITOR_H
+
+/*
+ * layered scene graph and composition pass.
+ *
+ * layers form a tree; siblings are ordered by z, higher z in front. each
+ * layer may carry a textured surface with an opaque region in surface
+ * pixels. transforms are limited to translation and scale, so that screen
+ * footprints stay axis aligned rects and occlusion can be computed exactly.
+ *
+ * composition walks the flattened list front to back and subtracts every
+ * opaque footprint from what is behind it. surfaces with nothing left are
+ * skipped, opaque parts are drawn front to back with blending off and the
+ * translucent rest is blended back to front.
+ *
+ * a surface is either a GL texture owned by the caller or an image of the
+ * texture manager, resolved (and loaded if needed) when the frame is
+ * composed. atlas images share textures, so consecutive draws from the
+ * same page skip the rebind. a YUV surface is drawn with its own program,
+ * converting to RGB in the fragment shader, see yuv.h.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include <epoxy/gl.h>
+
+#include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+#include "glm/gtc/type_ptr.hpp"
+
+#include "arena.h"
+#include "textures.h"
+#include "yuv.h"
+
+/* half open pixel rect, origin top-left, y down */
+typedef struct
+{
+  int x0, y0, x1, y1;
+} rect_t;
+
+typedef std::vector<rect_t> region_t;
+
+typedef struct layer layer_t;
+
+struct layer
+{
+  const char *name;
+  int z;
+  bool visible;
+
+  glm::vec2 position;         // top-left, in parent space
+  glm::vec2 scale;
+  float opacity;
+
+  // surface content, no texture, image or yuv for pure grouping layers
+  GLuint texture;
+  int image;                  // texture manager image, -1 for none
+  const yuv_surface_t *yuv;   // drawn while it holds a frame
+  int width;
+  int height;
+  bool flip_y;                // texture rows are stored top-down (image data)
+  region_t opaque;            // in surface pixels
+
+  layer_t *parent;
+  std::vector<layer_t *> children;
+};
+
+typedef struct
+{
+  uint64_t surfaces;          // surfaces with content
+  uint64_t culled;            // fully occluded or offscreen
+  uint64_t pixels_opaque;     // drawn with blending off
+  uint64_t pixels_blended;
+  uint64_t pixels_naive;      // painter's algorithm without culling
+  uint64_t screen_pixels;
+  uint64_t binds;             // texture binds issued
+} compositor_stats_t;
+
+typedef struct
+{
+  const layer_t *layer;
+  texture_view_t view;        // texture and texcoord rect of the surface
+  rect_t bounds;
+  glm::vec2 origin;           // screen position of surface pixel (0, 0)
+  glm::vec2 scale;
+  float opacity;
+  region_t opaque_visible;
+  region_t blended_visible;
+} draw_item_t;
+
+typedef struct
+{
+  GLuint program;
+  int width;
+  int height;
+  arena_t *frame_arena;       // vertex data, reset by the caller every frame
+  texture_manager_t *textures; // resolves layer images, may be NULL
+  yuv_renderer_t *yuv;        // draws yuv layers, may be NULL
+  GLuint bound_texture;
+  glm::mat4 projection;
+
+  compositor_stats_t frame;   // last composed frame
+  compositor_stats_t total;   // sum over all frames
+  uint64_t frames;
+
+  // kept across frames so steady state composition does not allocate
+  std::vector<draw_item_t> items;
+  region_t covered;
+  region_t opaque;
+  region_t scratch;
+} compositor_t;
+
+/*    region     */
+
+static inline bool rect_empty(const rect_t &r)
+{
+  return r.x0 >= r.x1 || r.y0 >= r.y1;
+}
+
+static inline rect_t rect_intersect(const rect_t &a, const rect_t &b)
+{
+  rect_t r = { std::max(a.x0, b.x0), std::max(a.y0, b.y0), std::min(a.x1, b.x1), std::min(a.y1, b.y1) };
+  return r;
+}
+
+static inline uint64_t rect_area(const rect_t &r)
+{
+  return rect_empty(r) ? 0 : (uint64_t)(r.x1 - r.x0) * (uint64_t)(r.y1 - r.y0);
+}
+
+static uint64_t region_area(const region_t &region)
+{
+  uint64_t area = 0;
+  for (const rect_t &r : region) {
+    area += rect_area(r);
+  }
+  return area;
+}
+
+/* appends a - b as at most four disjoint rects */
+static void rect_subtract(const rect_t &a, const rect_t &b, region_t *out)
+{
+  rect_t i = rect_intersect(a, b);
+  if (rect_empty(i)) {
+    out->push_back(a);
+    return;
+  }
+  if (a.y0 < i.y0) {
+    out->push_back({ a.x0, a.y0, a.x1, i.y0 });
+  }
+  if (i.y1 < a.y1) {
+    out->push_back({ a.x0, i.y1, a.x1, a.y1 });
+  }
+  if (a.x0 < i.x0) {
+    out->push_back({ a.x0, i.y0, i.x0, i.y1 });
+  }
+  if (i.x1 < a.x1) {
+    out->push_back({ i.x1, i.y0, a.x1, i.y1 });
+  }
+}
+
+/* region -= each rect of cut, scratch is reused storage */
+static void region_subtract(region_t *region, const region_t &cut, region_t *scratch)
+{
+  for (const rect_t &c : cut) {
+    if (region->empty()) {
+      return;
+    }
+    scratch->clear();
+    for (const rect_t &r : *region) {
+      rect_subtract(r, c, scratch);
+    }
+    region->swap(*scratch);
+  }
+}
+
+/* out = region & cut, with cut disjoint */
+static void region_intersect(const region_t &region, const region_t &cut, region_t *out)
+{
+  out->clear();
+  for (const rect_t &r : region) {
+    for (const rect_t &c : cut) {
+      rect_t i = rect_intersect(r, c);
+      if (!rect_empty(i)) {
+        out->push_back(i);
+      }
+    }
+  }
+}
+
+/*    layers     */
+
+static layer_t *CreateLayer(const char *name, layer_t *parent, int z)
+{
+  layer_t *layer = new layer_t();
+  layer->name = name;
+  layer->z = z;
+  layer->visible = true;
+  layer->position = glm::vec2(0.f, 0.f);
+  layer->scale = glm::vec2(1.f, 1.f);
+  layer->opacity = 1.f;
+  layer->texture = 0;
+  layer->image = -1;
+  layer->yuv = NULL;
+  layer->width = 0;
+  layer->height = 0;
+  layer->flip_y = false;
+  layer->parent = parent;
+
+  if (parent) {
+    // keep siblings sorted by z, stable for equal z
+    auto it = std::upper_bound(parent->children.begin(), parent->children.end(), z,
+                               [](int value, const layer_t *l) { return value < l->z; });
+    parent->children.insert(it, layer);
+  }
+  return layer;
+}
+
+static void DestroyLayer(layer_t *layer)
+{
+  for (layer_t *child : layer->children) {
+    child->parent = NULL;
+    DestroyLayer(child);
+  }
+  if (layer->parent) {
+    std::vector<layer_t *> &siblings = layer->parent->children;
+    siblings.erase(std::find(siblings.begin(), siblings.end(), layer));
+  }
+  delete layer;
+}
+
+static void SetLayerSurface(layer_t *layer, GLuint texture, int width, int height, bool flip_y)
+{
+  layer->texture = texture;
+  layer->image = -1;
+  layer->yuv = NULL;
+  layer->width = width;
+  layer->height = height;
+  layer->flip_y = flip_y;
+}
+
+/* surface from a texture manager image, see textures.h */
+static void SetLayerImage(layer_t *layer, int image, int width, int height, bool flip_y)
+{
+  layer->texture = 0;
+  layer->image = image;
+  layer->yuv = NULL;
+  layer->width = width;
+  layer->height = height;
+  layer->flip_y = flip_y;
+}
+
+/* a YUV surface, converted when drawn. it has no alpha, so the layer is opaque */
+static void SetLayerYUV(layer_t *layer, const yuv_surface_t *surface)
+{
+  layer->texture = 0;
+  layer->image = -1;
+  layer->yuv = surface;
+  layer->width = surface->width;
+  layer->height = surface->height;
+  layer->flip_y = true;
+  layer->opaque.clear();
+  layer->opaque.push_back({ 0, 0, layer->width, layer->height });
+}
+
+/* marks the whole surface opaque, or clears the opaque region */
+static void SetLayerOpaque(layer_t *layer, bool opaque)
+{
+  layer->opaque.clear();
+  if (opaque) {
+    layer->opaque.push_back({ 0, 0, layer->width, layer->height });
+  }
+}
+
+static void AddLayerOpaqueRect(layer_t *layer, rect_t rect)
+{
+  layer->opaque.push_back(rect);
+}
+
+/*    composition     */
+
+static void CreateCompositor(compositor_t *compositor, GLuint program, int width, int height,
+                             arena_t *frame_arena, texture_manager_t *textures, yuv_renderer_t *yuv)
+{
+  compositor->program = program;
+  compositor->frame_arena = frame_arena;
+  compositor->textures = textures;
+  compositor->yuv = yuv;
+  compositor->bound_texture = 0;
+  compositor->width = width;
+  compositor->height = height;
+  compositor->frame = compositor_stats_t();
+  compositor->total = compositor_stats_t();
+  compositor->frames = 0;
+}
+
+static void flatten_layers(compositor_t *compositor, const layer_t *layer,
+                           glm::vec2 origin, glm::vec2 scale, float opacity, size_t *count)
+{
+  origin += layer->position * scale;
+  scale *= layer->scale;
+  opacity *= layer->opacity;
+
+  if (!layer->visible || opacity <= 0.f) {
+    return;
+  }
+
+  texture_view_t view = { layer->texture, 0.f, 0.f, 1.f, 1.f };
+  bool has_surface = layer->texture != 0;
+  if (layer->image >= 0 && compositor->textures) {
+    has_surface = AcquireImage(compositor->textures, layer->image, &view);
+  }
+  if (layer->yuv) {
+    has_surface = compositor->yuv && layer->yuv->count > 0;
+  }
+
+  if (has_surface && layer->width > 0 && layer->height > 0) {
+    if (*count == compositor->items.size()) {
+      compositor->items.emplace_back();
+    }
+    draw_item_t &item = compositor->items[(*count)++];
+    item.layer = layer;
+    item.view = view;
+    item.origin = origin;
+    item.scale = scale;
+    item.opacity = opacity;
+
+    // outward rounding, partially covered pixels still need drawing
+    float x0 = origin.x, x1 = origin.x + layer->width * scale.x;
+    float y0 = origin.y, y1 = origin.y + layer->height * scale.y;
+    rect_t bounds = { (int)floorf(std::min(x0, x1)), (int)floorf(std::min(y0, y1)),
+                      (int)ceilf(std::max(x0, x1)), (int)ceilf(std::max(y0, y1)) };
+    rect_t screen = { 0, 0, compositor->width, compositor->height };
+    item.bounds = rect_intersect(bounds, screen);
+  }
+
+  for (const layer_t *child : layer->children) {
+    flatten_layers(compositor, child, origin, scale, opacity, count);
+  }
+}
+
+/* opaque region of an item in screen pixels, rounded inward */
+static void item_opaque_region(const draw_item_t &item, region_t *out)
+{
+  out->clear();
+  if (item.opacity < 1.f) {
+    return;
+  }
+  for (const rect_t &r : item.layer->opaque) {
+    float x0 = item.origin.x + r.x0 * item.scale.x, x1 = item.origin.x + r.x1 * item.scale.x;
+    float y0 = item.origin.y + r.y0 * item.scale.y, y1 = item.origin.y + r.y1 * item.scale.y;
+    rect_t s = { (int)ceilf(std::min(x0, x1)), (int)ceilf(std::min(y0, y1)),
+                 (int)floorf(std::max(x0, x1)), (int)floorf(std::max(y0, y1)) };
+    s = rect_intersect(s, item.bounds);
+    if (!rect_empty(s)) {
+      out->push_back(s);
+    }
+  }
+}
+
+/* yuv layers bring their own program, the compositor's is made current again after */
+static void draw_yuv(compositor_t *compositor, const draw_item_t &item, const GLfloat *v, int count)
+{
+  const yuv_surface_t *surface = item.layer->yuv;
+  const yuv_program_t *p = BindYUV(compositor->yuv, surface, glm::value_ptr(compositor->projection), item.opacity);
+  if (p) {
+    DrawYUVArrays(p, GL_TRIANGLES, v, 5, 3, count);
+    compositor->total.binds += surface->count;
+  }
+  glUseProgram(compositor->program);
+  compositor->bound_texture = 0;
+}
+
+static void draw_region(compositor_t *compositor, const draw_item_t &item, const region_t &region)
+{
+  if (region.empty()) {
+    return;
+  }
+
+  const layer_t *layer = item.layer;
+  GLfloat *v = (GLfloat *)ArenaAlloc(compositor->frame_arena, region.size() * 6 * 5 * sizeof(GLfloat), 16);
+  GLfloat *out = v;
+
+  for (const rect_t &r : region) {
+    // screen pixels back to surface texcoords
+    float u0 = (r.x0 - item.origin.x) / (item.scale.x * layer->width);
+    float u1 = (r.x1 - item.origin.x) / (item.scale.x * layer->width);
+    float t0 = (r.y0 - item.origin.y) / (item.scale.y * layer->height);
+    float t1 = (r.y1 - item.origin.y) / (item.scale.y * layer->height);
+    // gl textures have their first row at the bottom
+    float v0 = layer->flip_y ? t0 : 1.f - t0;
+    float v1 = layer->flip_y ? t1 : 1.f - t1;
+    // into the image's rect of the (atlas) texture
+    const texture_view_t &view = item.view;
+    u0 = view.u0 + u0 * (view.u1 - view.u0);
+    u1 = view.u0 + u1 * (view.u1 - view.u0);
+    v0 = view.v0 + v0 * (view.v1 - view.v0);
+    v1 = view.v0 + v1 * (view.v1 - view.v0);
+    float y0 = (float)(compositor->height - r.y0);
+    float y1 = (float)(compositor->height - r.y1);
+
+    const GLfloat quad[6][5] = {
+      { (float)r.x0, y1, 0.f, u0, v1 },
+      { (float)r.x1, y1, 0.f, u1, v1 },
+      { (float)r.x0, y0, 0.f, u0, v0 },
+      { (float)r.x0, y0, 0.f, u0, v0 },
+      { (float)r.x1, y1, 0.f, u1, v1 },
+      { (float)r.x1, y0, 0.f, u1, v0 },
+    };
+    memcpy(out, quad, sizeof(quad));
+    out += 6 * 5;
+  }
+
+  if (layer->yuv) {
+    draw_yuv(compositor, item, v, (int)(region.size() * 6));
+    return;
+  }
+
+  GLuint program = compositor->program;
+  glUniform1f(glGetUniformLocation(program, "u_opacity"), item.opacity);
+
+  GLint position = glGetAttribLocation(program, "a_position");
+  glEnableVertexAttribArray(position);
+  glVertexAttribPointer(position, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), v);
+
+  GLint texcoord = glGetAttribLocation(program, "a_texcoord");
+  glEnableVertexAttribArray(texcoord);
+  glVertexAttribPointer(texcoord, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), v + 3);
+
+  if (item.view.texture != compositor->bound_texture) {
+    glBindTexture(GL_TEXTURE_2D, item.view.texture);
+    compositor->bound_texture = item.view.texture;
+    compositor->total.binds++;
+  }
+  glDrawArrays(GL_TRIANGLES, 0, (GLsizei)(region.size() * 6));
+}
+
+static void ComposeLayers(compositor_t *compositor, const layer_t *root)
+{
+  compositor_stats_t stats = compositor_stats_t();
+  stats.screen_pixels = (uint64_t)compositor->width * compositor->height;
+
+  if (compositor->textures) {
+    BeginTextureFrame(compositor->textures);
+  }
+  size_t count = 0;
+  flatten_layers(compositor, root, glm::vec2(0.f, 0.f), glm::vec2(1.f, 1.f), 1.f, &count);
+  stats.surfaces = count;
+  // loading images and everyone else binds textures too
+  compositor->bound_texture = 0;
+  uint64_t binds = compositor->total.binds;
+
+  // front to back: what is left after everything opaque in front
+  region_t &covered = compositor->covered;
+  region_t &opaque = compositor->opaque;
+  region_t &scratch = compositor->scratch;
+  covered.clear();
+  for (size_t i = count; i-- > 0;) {
+    draw_item_t &item = compositor->items[i];
+    stats.pixels_naive += rect_area(item.bounds);
+
+    region_t &visible = item.blended_visible;
+    visible.clear();
+    if (!rect_empty(item.bounds)) {
+      visible.push_back(item.bounds);
+    }
+    region_subtract(&visible, covered, &scratch);
+
+    item_opaque_region(item, &opaque);
+    region_intersect(visible, opaque, &item.opaque_visible);
+    region_subtract(&visible, opaque, &scratch);
+    covered.insert(covered.end(), opaque.begin(), opaque.end());
+
+    if (visible.empty() && item.opaque_visible.empty()) {
+      stats.culled++;
+    }
+    stats.pixels_opaque += region_area(item.opaque_visible);
+    stats.pixels_blended += region_area(visible);
+  }
+
+  compositor->projection = glm::ortho(0.f, 1.f*compositor->width, 0.f, 1.f*compositor->height, -1.f, 1.f);
+  glUseProgram(compositor->program);
+  glUniformMatrix4fv(glGetUniformLocation(compositor->program, "mvp"), 1, GL_FALSE,
+                     glm::value_ptr(compositor->projection));
+  glActiveTexture(GL_TEXTURE0);
+  glUniform1i(glGetUniformLocation(compositor->program, "s_texture"), 0);
+
+  glDisable(GL_BLEND);
+  for (size_t i = count; i-- > 0;) {
+    draw_region(compositor, compositor->items[i], compositor->items[i].opaque_visible);
+  }
+
+  glEnable(GL_BLEND);
+  for (size_t i = 0; i < count; ++i) {
+    draw_region(compositor, compositor->items[i], compositor->items[i].blended_visible);
+  }
+
+  stats.binds = compositor->total.binds - binds;
+  compositor->frame = stats;
+  compositor->total.surfaces += stats.surfaces;
+  compositor->total.culled += stats.culled;
+  compositor->total.pixels_opaque += stats.pixels_opaque;
+  compositor->total.pixels_blended += stats.pixels_blended;
+  compositor->total.pixels_naive += stats.pixels_naive;
+  compositor->total.screen_pixels += stats.screen_pixels;
+  compositor->frames++;
+}
+
+/* overdraw is pixels written per screen pixel; naive is without culling */
+static void PrintCompositorStats(const compositor_t *compositor)
+{
+  const compositor_stats_t &t = compositor->total;
+  if (!compositor->frames || !t.screen_pixels) {
+    return;
+  }
+  double drawn = (double)(t.pixels_opaque + t.pixels_blended);
+  printf("compositor: %llu frames, %.1f surfaces/frame, %.1f culled/frame, %.1f binds/frame\n",
+         (unsigned long long)compositor->frames, (double)t.surfaces / compositor->frames,
+         (double)t.culled / compositor->frames, (double)t.binds / compositor->frames);
+  printf("compositor: overdraw %.2f (naive %.2f), %.0f%% of drawn pixels blended\n",
+         drawn / t.screen_pixels, (double)t.pixels_naive / t.screen_pixels,
+         drawn > 0 ? 100.0 * t.pixels_blended / drawn : 0.0);
+}
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <assert.h>
 
 #include <fcntl.h>
@@ -18,6 +19,8 @@
 
 #define ARRAY_LENGTH(a) (sizeof(a) / sizeof(a)[0])
 
+#define KT_GBM_SURFACE_FLAGS (GBM_BO_USE_LINEAR|GBM_BO_USE_SCANOUT|GBM_BO_USE_RENDERING)
+
 
 typedef struct
 {
@@ -34,6 +37,8 @@ typedef struct
 
   int default_fb_width;
   int default_fb_height;
+
+  bool connected;             // false while no connector is plugged in
 } device_t;
 
 typedef struct
@@ -41,6 +46,7 @@ typedef struct
   EGLDisplay display;
   EGLSurface surface;
   EGLContext context;
+  EGLConfig config;           // for surfaces created after a hotplug
 
   GLuint program;
   GLuint texture_id;
@@ -85,6 +91,7 @@ static void create_drm_device(device_t *device)
   device->drm_fd = fd;
   device->default_fb_width = device->default_fb_p->width;
   device->default_fb_height = device->default_fb_p->height;
+  device->connected = true;
 
   drmFree(encoder);
   drmFree(res);
@@ -101,7 +108,7 @@ static void create_gbm_device(device_t *device)
                                           device->default_fb_width,
                                           device->default_fb_height,
                                           GBM_BO_FORMAT_ARGB8888,
-                                          GBM_BO_USE_LINEAR|GBM_BO_USE_SCANOUT|GBM_BO_USE_RENDERING);
+                                          KT_GBM_SURFACE_FLAGS);
   assert(device->gbmsurface);
 
 }
@@ -126,7 +133,6 @@ static EGLConfig get_egl_config(canvas_t *canvas)
 			 &num_configs) == EGL_TRUE);
 
   assert(num_configs);
-  printf("num config %d\n", num_configs);
 
   /* find a config whose native visual ID is the desired GBM format. */
   for (int i = 0; i < num_configs; ++i){
@@ -135,9 +141,8 @@ static EGLConfig get_egl_config(canvas_t *canvas)
     assert(eglGetConfigAttrib(canvas->display, configs[i], EGL_NATIVE_VISUAL_ID,
 			      &gbm_format) == EGL_TRUE);
 
-    printf("gbm format %x\n", gbm_format);
-
     if (gbm_format == GBM_FORMAT_ARGB8888){
+      printf("egl config %d of %d\n", i, num_configs);
       EGLConfig ret = configs[i];
       free(configs);
       return ret;
@@ -173,6 +178,7 @@ void CreateRenderContext(device_t *device, canvas_t *canvas)
   printf("EGL major version: %d, minor version: %d\n", major_version, minor_version);
 
   EGLConfig config = get_egl_config(canvas);
+  canvas->config = config;
 
   canvas->surface = eglCreatePlatformWindowSurfaceEXT(canvas->display, config, device->gbmsurface, NULL);
   assert(canvas->surface != EGL_NO_SURFACE);
@@ -221,8 +227,12 @@ void SwapBuffer(device_t *device, canvas_t *canvas)
 
 void RestoreDefaultFramebuffer(device_t *device)
 {
-  // restore previous fb
-  assert(!drmModeSetCrtc(device->drm_fd, device->crtc_p->crtc_id, device->default_fb_p->fb_id, 0, 0, &device->connector_p->connector_id, 1, &device->crtc_p->mode));
+  // restore previous fb, it only fits the mode it was shown with
+  if (device->connected &&
+      device->default_fb_p->width == device->crtc_p->mode.hdisplay &&
+      device->default_fb_p->height == device->crtc_p->mode.vdisplay) {
+    assert(!drmModeSetCrtc(device->drm_fd, device->crtc_p->crtc_id, device->default_fb_p->fb_id, 0, 0, &device->connector_p->connector_id, 1, &device->crtc_p->mode));
+  }
 
   if (device->previous_bo) {
     drmModeRmFB(device->drm_fd, device->previous_fb);
@@ -260,4 +270,175 @@ void OutputDisplay(device_t *device)
 
 }
 
+/*    hotplug     */
+
+typedef enum
+{
+  OUTPUT_UNCHANGED = 0,
+  OUTPUT_CHANGED,             // new connector or mode, surfaces were rebuilt
+  OUTPUT_DISCONNECTED,        // nothing to show on, stop swapping
+} output_change_t;
+
+/* prefers the connector in use, otherwise the first connected one */
+static drmModeConnectorPtr find_connected_connector(int fd, drmModeResPtr res, uint32_t prefer_id)
+{
+  drmModeConnectorPtr found = NULL;
+
+  for (int i = 0; i < res->count_connectors; ++i) {
+    drmModeConnectorPtr connector = drmModeGetConnector(fd, res->connectors[i]);
+    if (!connector) {
+      continue;
+    }
+    if (connector->connection != DRM_MODE_CONNECTED || connector->count_modes == 0) {
+      drmModeFreeConnector(connector);
+      continue;
+    }
+    if (connector->connector_id == prefer_id) {
+      if (found) {
+        drmModeFreeConnector(found);
+      }
+      return connector;
+    }
+    if (!found) {
+      found = connector;
+    } else {
+      drmModeFreeConnector(connector);
+    }
+  }
+  return found;
+}
+
+/* the crtc the connector's encoder drives, or any crtc it can drive */
+static drmModeCrtcPtr find_crtc(int fd, drmModeResPtr res, drmModeConnectorPtr connector)
+{
+  if (connector->encoder_id) {
+    drmModeEncoderPtr encoder = drmModeGetEncoder(fd, connector->encoder_id);
+    uint32_t crtc_id = encoder ? encoder->crtc_id : 0;
+    drmModeFreeEncoder(encoder);
+    if (crtc_id) {
+      return drmModeGetCrtc(fd, crtc_id);
+    }
+  }
+
+  for (int i = 0; i < connector->count_encoders; ++i) {
+    drmModeEncoderPtr encoder = drmModeGetEncoder(fd, connector->encoders[i]);
+    if (!encoder) {
+      continue;
+    }
+    uint32_t possible = encoder->possible_crtcs;
+    drmModeFreeEncoder(encoder);
+    for (int j = 0; j < res->count_crtcs; ++j) {
+      if (possible & (1u << j)) {
+        return drmModeGetCrtc(fd, res->crtcs[j]);
+      }
+    }
+  }
+  return NULL;
+}
+
+static bool has_mode(drmModeConnectorPtr connector, const drmModeModeInfo *mode)
+{
+  for (int i = 0; i < connector->count_modes; ++i) {
+    const drmModeModeInfo *m = &connector->modes[i];
+    if (m->hdisplay == mode->hdisplay && m->vdisplay == mode->vdisplay && m->vrefresh == mode->vrefresh) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static const drmModeModeInfo *preferred_mode(drmModeConnectorPtr connector)
+{
+  for (int i = 0; i < connector->count_modes; ++i) {
+    if (connector->modes[i].type & DRM_MODE_TYPE_PREFERRED) {
+      return &connector->modes[i];
+    }
+  }
+  return &connector->modes[0];
+}
+
+/*
+ * call when udev reports a drm hotplug. looks the connectors up again and,
+ * if the output changed, rebuilds only the gbm and egl surfaces; the
+ * context, and with it every texture, program and buffer, is kept. the new
+ * surface is current on return, but nothing was scanned out from it yet.
+ */
+output_change_t ReconfigureOutput(device_t *device, canvas_t *canvas)
+{
+  int fd = device->drm_fd;
+  drmModeResPtr res = drmModeGetResources(fd);
+  if (!res) {
+    return OUTPUT_UNCHANGED;
+  }
+
+  uint32_t current_id = device->connector_p ? device->connector_p->connector_id : 0;
+  drmModeConnectorPtr connector = find_connected_connector(fd, res, current_id);
+  if (!connector) {
+    drmModeFreeResources(res);
+    if (!device->connected) {
+      return OUTPUT_UNCHANGED;
+    }
+    device->connected = false;
+    return OUTPUT_DISCONNECTED;
+  }
+
+  bool same_connector = connector->connector_id == current_id;
+  if (device->connected && same_connector && has_mode(connector, &device->crtc_p->mode)) {
+    drmModeFreeConnector(connector);
+    drmModeFreeResources(res);
+    return OUTPUT_UNCHANGED;
+  }
+
+  drmModeCrtcPtr crtc = find_crtc(fd, res, connector);
+  drmModeFreeResources(res);
+  if (!crtc) {
+    printf("no crtc for connector %u\n", connector->connector_id);
+    drmModeFreeConnector(connector);
+    device->connected = false;
+    return OUTPUT_DISCONNECTED;
+  }
+  // a connector coming back keeps its mode when it still offers it
+  crtc->mode = same_connector && has_mode(connector, &device->crtc_p->mode) ?
+    device->crtc_p->mode : *preferred_mode(connector);
+  int width = crtc->mode.hdisplay;
+  int height = crtc->mode.vdisplay;
+
+  // new surfaces first, so the context always has one to be current on
+  struct gbm_surface *gbmsurface = gbm_surface_create(device->gbmdevice, width, height,
+                                                      GBM_BO_FORMAT_ARGB8888, KT_GBM_SURFACE_FLAGS);
+  assert(gbmsurface);
+  EGLSurface surface = eglCreatePlatformWindowSurfaceEXT(canvas->display, canvas->config, gbmsurface, NULL);
+  assert(surface != EGL_NO_SURFACE);
+  EGLBoolean current = eglMakeCurrent(canvas->display, surface, surface, canvas->context);
+  assert(current == EGL_TRUE);
+  (void)current;
+
+  if (device->previous_bo) {
+    drmModeRmFB(fd, device->previous_fb);
+    gbm_surface_release_buffer(device->gbmsurface, device->previous_bo);
+    device->previous_bo = NULL;
+    device->previous_fb = 0;
+  }
+  eglDestroySurface(canvas->display, canvas->surface);
+  gbm_surface_destroy(device->gbmsurface);
+
+  drmModeFreeConnector(device->connector_p);
+  drmModeFreeCrtc(device->crtc_p);
+  device->connector_p = connector;
+  device->crtc_p = crtc;
+  device->gbmsurface = gbmsurface;
+  device->default_fb_width = width;
+  device->default_fb_height = height;
+  device->connected = true;
+
+  canvas->surface = surface;
+  canvas->width = width;
+  canvas->height = height;
+  glViewport(0, 0, width, height);
+
+  printf("output: connector %u, %dx%d@%u on crtc %u\n", connector->connector_id, width, height,
+         crtc->mode.vrefresh, crtc->crtc_id);
+  return OUTPUT_CHANGED;
+}
+
 #endif
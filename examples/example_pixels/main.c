@@ -0,0 +1,130 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "pixels.h"
+
+/* 1920x1080, about the size of a fullscreen background */
+#define WIDTH 1920
+#define HEIGHT 1080
+#define ROUNDS 20
+
+typedef enum
+{
+  KERNEL_SWAP_RB = 0,
+  KERNEL_RGB_TO_RGBA,
+  KERNEL_BGRA_TO_RGB,
+  KERNEL_RGBA_TO_RGB,
+  KERNEL_PREMULTIPLY,
+  KERNEL_UNPREMULTIPLY,
+  KERNEL_COUNT,
+} kernel_t;
+
+static const char *kernel_names[KERNEL_COUNT] = {
+  "swap_rb", "rgb_to_rgba", "bgra_to_rgb", "rgba_to_rgb", "premultiply", "unpremultiply",
+};
+
+static double Now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void RunKernel(const pixel_kernels_t *k, kernel_t kernel, uint8_t *dst, const uint8_t *src, size_t count)
+{
+  switch (kernel) {
+  case KERNEL_SWAP_RB:
+    k->swap_rb(dst, src, count);
+    break;
+  case KERNEL_RGB_TO_RGBA:
+    k->rgb_to_rgba(dst, src, count);
+    break;
+  case KERNEL_BGRA_TO_RGB:
+    k->bgra_to_rgb(dst, src, count);
+    break;
+  case KERNEL_RGBA_TO_RGB:
+    k->rgba_to_rgb(dst, src, count);
+    break;
+  case KERNEL_PREMULTIPLY:
+    memcpy(dst, src, count * 4);
+    k->premultiply(dst, count);
+    break;
+  case KERNEL_UNPREMULTIPLY:
+    memcpy(dst, src, count * 4);
+    k->unpremultiply(dst, count);
+    break;
+  default:
+    break;
+  }
+}
+
+static size_t OutputBytes(kernel_t kernel, size_t count)
+{
+  return (kernel == KERNEL_BGRA_TO_RGB || kernel == KERNEL_RGBA_TO_RGB) ? count * 3 : count * 4;
+}
+
+int main(void)
+{
+  size_t count = (size_t)WIDTH * HEIGHT;
+  uint8_t *src = (uint8_t *)malloc(count * 4);
+  uint8_t *expect = (uint8_t *)malloc(count * 4);
+  uint8_t *dst = (uint8_t *)malloc(count * 4);
+  assert(src && expect && dst);
+
+  /* random bytes, with a third of the pixels opaque or transparent like real art */
+  srand(1);
+  for (size_t i = 0; i < count * 4; ++i) {
+    src[i] = (uint8_t)rand();
+  }
+  for (size_t i = 0; i < count; i += 3) {
+    src[i * 4 + 3] = (i & 1) ? 255 : 0;
+  }
+
+  const pixel_kernels_t *scalar = GetPixelKernels(PIXEL_ISA_SCALAR);
+  int failed = 0;
+
+  printf("%-14s %-8s %10s\n", "kernel", "isa", "MPix/s");
+  for (int kernel = 0; kernel < KERNEL_COUNT; ++kernel) {
+    RunKernel(scalar, (kernel_t)kernel, expect, src, count);
+
+    for (int isa = 0; isa < PIXEL_ISA_COUNT; ++isa) {
+      const pixel_kernels_t *k = GetPixelKernels((pixel_isa_t)isa);
+      if (!k) {
+        continue;
+      }
+
+      /* odd lengths exercise the scalar tails */
+      for (size_t n = 0; n < 67; ++n) {
+        RunKernel(k, (kernel_t)kernel, dst, src, n);
+        if (memcmp(dst, expect, OutputBytes((kernel_t)kernel, n))) {
+          printf("%s/%s mismatch at length %zu\n", kernel_names[kernel], k->name, n);
+          failed = 1;
+          break;
+        }
+      }
+
+      double start = Now();
+      for (int r = 0; r < ROUNDS; ++r) {
+        RunKernel(k, (kernel_t)kernel, dst, src, count);
+      }
+      double elapsed = Now() - start;
+
+      if (memcmp(dst, expect, OutputBytes((kernel_t)kernel, count))) {
+        printf("%s/%s mismatch\n", kernel_names[kernel], k->name);
+        failed = 1;
+      }
+      printf("%-14s %-8s %10.1f\n", kernel_names[kernel], k->name, count * ROUNDS / elapsed * 1e-6);
+    }
+  }
+
+  printf("selected: %s\n", SelectPixelKernels()->name);
+
+  free(src);
+  free(expect);
+  free(dst);
+  return failed;
+}
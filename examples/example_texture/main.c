@@ -7,12 +7,49 @@
 #include <epoxy/egl.h>
 
 #include "devices.h"
+#include "shaders.h"
+#include "pixels.h"
+#include "ktx.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "external/stb/stb_image.h"
 
-static void CreateTexture(GLuint *texture_id)
+// KTX rows usually run top down, stb_image is asked for bottom up
+static bool texture_top_down = false;
+
+/* compressed mip chain straight from a .ktx/.ktx2 file */
+static bool CreateCompressedTexture(GLuint *texture_id, const char *path)
 {
+  ktx_t ktx;
+  if (!OpenKTX(&ktx, path)) {
+    return false;
+  }
+
+  glGenTextures(1, texture_id);
+  glBindTexture(GL_TEXTURE_2D, *texture_id);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+  bool ok = UploadKTX(&ktx, NULL);
+  texture_top_down = ktx.origin_top;
+  CloseKTX(&ktx);
+  if (!ok) {
+    glDeleteTextures(1, texture_id);
+    *texture_id = 0;
+  }
+  return ok;
+}
+
+static void CreateTexture(GLuint *texture_id, const char *path)
+{
+  size_t length = path ? strlen(path) : 0;
+  if ((length > 4 && strcmp(path + length - 4, ".ktx") == 0) ||
+      (length > 5 && strcmp(path + length - 5, ".ktx2") == 0)) {
+    if (CreateCompressedTexture(texture_id, path)) {
+      return;
+    }
+    printf("failed to load %s. use container.jpg\n", path);
+  }
 
   glGenTextures(1, texture_id);
 
@@ -30,58 +67,37 @@ static void CreateTexture(GLuint *texture_id)
   stbi_set_flip_vertically_on_load(true);
   GLint width, height, channels;
   GLubyte *data = stbi_load("container.jpg", &width, &height, &channels, 0);
-  if (!data) {
+  GLubyte *rgba = NULL;
+  if (data && (channels == 3 || channels == 4)) {
+    // RGBA rows are 4 byte aligned, so the default unpack alignment applies
+    rgba = ConvertToRGBA(data, 0, channels == 3 ? PIXEL_FORMAT_RGB888 : PIXEL_FORMAT_RGBA8888,
+                         width, height, channels == 4 ? PIXEL_CONVERT_PREMULTIPLY : PIXEL_CONVERT_NONE);
+  }
+  stbi_image_free(data);
+
+  if (!rgba) {
 
     printf("failed to load image. use pixels replace\n");
 
-    GLubyte pixels[4 * 3] = {
-      255,    0,    0, // red
-      0,    255,    0, // green
-      0,      0,  255, // blue
-      255,  255,    0, // yellow
+    GLubyte pixels[4 * 4] = {
+      255,    0,    0,  255, // red
+      0,    255,    0,  255, // green
+      0,      0,  255,  255, // blue
+      255,  255,    0,  255, // yellow
     };
 
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-
-    data = pixels;
-    width = 2;
-    height = 2;
-
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 2, 2, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    glGenerateMipmap(GL_TEXTURE_2D);
+    return;
   }
   // upload texture data
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
   glGenerateMipmap(GL_TEXTURE_2D);
 
-  stbi_image_free(data);
+  free(rgba);
 }
 
 
-static GLuint LoadShader(const char *source, GLenum type)
-{
-  GLuint shader;
-  GLint compiled;
-
-  shader = glCreateShader(type);
-  glShaderSource(shader, 1, &source, NULL);
-  glCompileShader(shader);
-
-  glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
-  if (!compiled) {
-    GLint infolen = 0;
-    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &infolen);
-    if (infolen > 1) {
-      char *infolog = malloc(infolen);
-      glGetShaderInfoLog(shader, infolen, NULL, infolog);
-      fprintf(stderr, "Error compiling shader:\n %s \n", infolog);
-      free(infolog);
-    }
-    glDeleteShader(shader);
-    return 0;
-  }
-
-  return shader;
-}
-
 static const char VERTEX_SHADER[] =
   "attribute vec3 a_position;"
   "attribute vec2 a_texcoord;"
@@ -99,7 +115,7 @@ static const char FRAGMENT_SHADER[] =
   "    gl_FragColor = texture2D(s_texture, v_texcoord);"
   "}";
 
-static void InitGLES(canvas_t *canvas)
+static void InitGLES(canvas_t *canvas, const char *texture_path)
 {
   GLint major = 0;
   GLint minor = 0;
@@ -112,33 +128,14 @@ static void InitGLES(canvas_t *canvas)
   }
   printf("opengl version: %d, %d\n", major, minor);
 
-  GLint linked;
-  GLuint vertex_shader;
-  GLuint fragment_shader;
-  assert((vertex_shader = LoadShader(VERTEX_SHADER, GL_VERTEX_SHADER)) != 0);
-  assert((fragment_shader = LoadShader(FRAGMENT_SHADER, GL_FRAGMENT_SHADER)) != 0);
-  assert((canvas->program = glCreateProgram()) != 0);
-  glAttachShader(canvas->program, vertex_shader);
-  glAttachShader(canvas->program, fragment_shader);
-  glLinkProgram(canvas->program);
-  glGetProgramiv(canvas->program, GL_LINK_STATUS, &linked);
-
-  glDeleteShader(vertex_shader);
-  glDeleteShader(fragment_shader);
-
-  if (!linked) {
-    GLint infolen = 0;
-    glGetProgramiv(canvas->program, GL_INFO_LOG_LENGTH, &infolen);
-    if (infolen > 1){
-      char *infolog = malloc(infolen);
-      glGetProgramInfoLog(canvas->program, infolen, NULL, infolog);
-      fprintf(stderr, "Error linking program:\n %s \n", infolog);
-      free(infolog);
-    }
-    glDeleteProgram(canvas->program);
+  shader_cache_t shader_cache;
+  InitShaderCache(&shader_cache, NULL);
+  canvas->program = CreateProgramCached(&shader_cache, VERTEX_SHADER, FRAGMENT_SHADER);
+  if (!canvas->program) {
     exit(1);
   }
-  CreateTexture(&canvas->texture_id);
+  PrintShaderCacheStats(&shader_cache);
+  CreateTexture(&canvas->texture_id, texture_path);
   glClearColor(1.f, 0.3f, 0.3f, 1.f);
   glViewport(0, 0, canvas->width, canvas->height);
 
@@ -152,6 +149,11 @@ static void Render(canvas_t *canvas)
     1, 1, 0,   1, 1,
     1, -1, 0,  1, 0,
   };
+  if (texture_top_down) {
+    for (int i = 0; i < 4; ++i) {
+      vertex[i * 5 + 4] = 1.f - vertex[i * 5 + 4];
+    }
+  }
 
   GLint position = glGetAttribLocation(canvas->program, "a_position");
   glEnableVertexAttribArray(position);
@@ -172,7 +174,8 @@ static void Render(canvas_t *canvas)
 
 }
 
-int main(void)
+/* usage: example_texture [image.ktx|image.ktx2], container.jpg otherwise */
+int main(int argc, char **argv)
 {
   device_t render_device;
   CreateRenderDevice(&render_device);
@@ -180,7 +183,7 @@ int main(void)
   canvas_t render_context;
   CreateRenderContext(&render_device, &render_context);
 
-  InitGLES(&render_context);
+  InitGLES(&render_context, argc > 1 ? argv[1] : NULL);
 
   Render(&render_context);
 
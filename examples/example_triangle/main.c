@@ -7,34 +7,9 @@
 #include <epoxy/egl.h>
 
 #include "devices.h"
+#include "shaders.h"
 
 
-static GLuint LoadShader(const char *source, GLenum type)
-{
-  GLuint shader;
-  GLint compiled;
-
-  shader = glCreateShader(type);
-  glShaderSource(shader, 1, &source, NULL);
-  glCompileShader(shader);
-
-  glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
-  if (!compiled) {
-    GLint infolen = 0;
-    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &infolen);
-    if (infolen > 1) {
-      char *infolog = malloc(infolen);
-      glGetShaderInfoLog(shader, infolen, NULL, infolog);
-      fprintf(stderr, "Error compiling shader:\n %s \n", infolog);
-      free(infolog);
-    }
-    glDeleteShader(shader);
-    return 0;
-  }
-
-  return shader;
-}
-
 static const char VERTEX_SHADER[] =
   "attribute vec3 positionIn;"
   "void main(){"
@@ -60,32 +35,13 @@ static void InitGLES(canvas_t *canvas)
   }
   printf("opengl version: %d, %d\n", major, minor);
 
-  GLint linked;
-  GLuint vertex_shader;
-  GLuint fragment_shader;
-  assert((vertex_shader = LoadShader(VERTEX_SHADER, GL_VERTEX_SHADER)) != 0);
-  assert((fragment_shader = LoadShader(FRAGMENT_SHADER, GL_FRAGMENT_SHADER)) != 0);
-  assert((canvas->program = glCreateProgram()) != 0);
-  glAttachShader(canvas->program, vertex_shader);
-  glAttachShader(canvas->program, fragment_shader);
-  glLinkProgram(canvas->program);
-  glGetProgramiv(canvas->program, GL_LINK_STATUS, &linked);
-
-  glDeleteShader(vertex_shader);
-  glDeleteShader(fragment_shader);
-
-  if (!linked) {
-    GLint infolen = 0;
-    glGetProgramiv(canvas->program, GL_INFO_LOG_LENGTH, &infolen);
-    if (infolen > 1){
-      char *infolog = malloc(infolen);
-      glGetProgramInfoLog(canvas->program, infolen, NULL, infolog);
-      fprintf(stderr, "Error linking program:\n %s \n", infolog);
-      free(infolog);
-    }
-    glDeleteProgram(canvas->program);
+  shader_cache_t shader_cache;
+  InitShaderCache(&shader_cache, NULL);
+  canvas->program = CreateProgramCached(&shader_cache, VERTEX_SHADER, FRAGMENT_SHADER);
+  if (!canvas->program) {
     exit(1);
   }
+  PrintShaderCacheStats(&shader_cache);
 
   glClearColor(1.f, 0.3f, 0.3f, 1.f);
   glViewport(0, 0, canvas->width, canvas->height);
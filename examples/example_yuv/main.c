@@ -0,0 +1,335 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/udmabuf.h>
+
+#include <epoxy/gl.h>
+#include <epoxy/egl.h>
+
+#include "devices.h"
+#include "shaders.h"
+#include "yuv.h"
+
+/* 1080p camera frames, rows padded like most capture drivers do */
+#define WIDTH 1920
+#define HEIGHT 1080
+#define ROW_ALIGN 256
+#define FRAMES 4
+#define ROUNDS 60
+
+static const char VERTEX_SHADER[] =
+  "attribute vec2 a_position;"
+  "attribute vec2 a_texcoord;"
+  "varying vec2 v_texcoord;"
+  "void main(){"
+  "    gl_Position = vec4(a_position, 0, 1);"
+  "    v_texcoord = a_texcoord;"
+  "}";
+
+static const char FRAGMENT_SHADER[] =
+  "precision mediump float;"
+  "varying vec2 v_texcoord;"
+  "uniform sampler2D s_texture;"
+  "void main(){"
+  "    gl_FragColor = texture2D(s_texture, v_texcoord);"
+  "}";
+
+typedef struct
+{
+  uint8_t *memory;
+  size_t size;
+  yuv_image_t image;
+} frame_t;
+
+static double Now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static size_t AlignRow(size_t bytes)
+{
+  return (bytes + ROW_ALIGN - 1) & ~(size_t)(ROW_ALIGN - 1);
+}
+
+/* lays the planes out back to back in memory, which may be NULL to only size them */
+static size_t LayoutFrame(yuv_image_t *image, uint8_t *memory, yuv_format_t format)
+{
+  size_t size = 0;
+  memset(image, 0, sizeof(*image));
+  image->format = format;
+  image->width = WIDTH;
+  image->height = HEIGHT;
+  for (int i = 0; i < YUVPlaneCount(format); ++i) {
+    int w, h, texel;
+    yuv_plane_size(format, i, WIDTH, HEIGHT, &w, &h, &texel);
+    image->strides[i] = AlignRow((size_t)w * texel);
+    image->planes[i] = memory ? memory + size : NULL;
+    size += image->strides[i] * h;
+  }
+  return size;
+}
+
+/* moving gradients with some noise, the chroma varies slowly like real footage */
+static void FillFrame(frame_t *frame, int index)
+{
+  yuv_image_t *image = &frame->image;
+  for (int y = 0; y < HEIGHT; ++y) {
+    uint8_t *row = (uint8_t *)image->planes[0] + y * image->strides[0];
+    for (int x = 0; x < WIDTH; ++x) {
+      row[x] = (uint8_t)(16 + ((x + y + index * 40) % 220) + (rand() & 3));
+    }
+  }
+  bool nv12 = image->format == YUV_FORMAT_NV12;
+  for (int y = 0; y < (HEIGHT + 1) / 2; ++y) {
+    uint8_t *u = (uint8_t *)image->planes[1] + y * image->strides[1];
+    uint8_t *v = nv12 ? u + 1 : (uint8_t *)image->planes[2] + y * image->strides[2];
+    for (int x = 0; x < (WIDTH + 1) / 2; ++x) {
+      u[x * (nv12 ? 2 : 1)] = (uint8_t)(16 + (x * 224 / WIDTH * 2 + index * 16) % 225);
+      v[x * (nv12 ? 2 : 1)] = (uint8_t)(16 + (y * 224 / HEIGHT * 2) % 225);
+    }
+  }
+}
+
+/* the frame copied into a memfd and handed out as a dmabuf, -1 without /dev/udmabuf */
+static int CreateUdmabuf(const frame_t *frame, yuv_dmabuf_t *buffer)
+{
+  int dev = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+  if (dev < 0) {
+    return -1;
+  }
+  size_t size = (frame->size + 4095) & ~(size_t)4095;
+  int memfd = memfd_create("keytoy-yuv", MFD_ALLOW_SEALING | MFD_CLOEXEC);
+  int fd = -1;
+  if (memfd >= 0 && ftruncate(memfd, size) == 0 && fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) == 0) {
+    void *map = mmap(NULL, size, PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (map != MAP_FAILED) {
+      memcpy(map, frame->memory, frame->size);
+      munmap(map, size);
+      struct udmabuf_create create = { .memfd = (uint32_t)memfd, .flags = UDMABUF_FLAGS_CLOEXEC, .offset = 0, .size = size };
+      fd = ioctl(dev, UDMABUF_CREATE, &create);
+    }
+  }
+  if (memfd >= 0) {
+    close(memfd);
+  }
+  close(dev);
+  if (fd < 0) {
+    return -1;
+  }
+
+  memset(buffer, 0, sizeof(*buffer));
+  buffer->format = frame->image.format;
+  buffer->width = WIDTH;
+  buffer->height = HEIGHT;
+  buffer->modifier = DRM_FORMAT_MOD_LINEAR;
+  for (int i = 0; i < YUVPlaneCount(buffer->format); ++i) {
+    buffer->fds[i] = fd;
+    buffer->offsets[i] = (uint32_t)(frame->image.planes[i] - frame->memory);
+    buffer->strides[i] = (uint32_t)frame->image.strides[i];
+  }
+  return fd;
+}
+
+static void DrawRGBA(GLuint program, GLuint texture)
+{
+  static const GLfloat vertex[] = {
+    -1,  1,  0, 0,
+    -1, -1,  0, 1,
+     1,  1,  1, 0,
+     1, -1,  1, 1,
+  };
+  glUseProgram(program);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  GLint position = glGetAttribLocation(program, "a_position");
+  glEnableVertexAttribArray(position);
+  glVertexAttribPointer(position, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), &vertex[0]);
+  GLint texcoord = glGetAttribLocation(program, "a_texcoord");
+  glEnableVertexAttribArray(texcoord);
+  glVertexAttribPointer(texcoord, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), &vertex[2]);
+  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+}
+
+/* the shader output against the CPU reference, chroma filtering accounts for small differences */
+static void CompareOutput(const uint8_t *expect, const char *name)
+{
+  uint8_t *pixels = (uint8_t *)malloc((size_t)WIDTH * HEIGHT * 4);
+  assert(pixels);
+  glReadPixels(0, 0, WIDTH, HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+
+  int max_diff = 0;
+  uint64_t sum = 0;
+  for (int y = 0; y < HEIGHT; ++y) {
+    // the framebuffer is bottom up
+    const uint8_t *got = pixels + (size_t)(HEIGHT - 1 - y) * WIDTH * 4;
+    const uint8_t *want = expect + (size_t)y * WIDTH * 4;
+    for (int i = 0; i < WIDTH * 4; ++i) {
+      int d = abs((int)got[i] - (int)want[i]);
+      max_diff = d > max_diff ? d : max_diff;
+      sum += d;
+    }
+  }
+  printf("%-8s vs cpu: max difference %d, mean %.3f\n", name, max_diff, (double)sum / ((double)WIDTH * HEIGHT * 4));
+  free(pixels);
+}
+
+static void PrintResult(const char *name, double seconds, double convert_seconds, size_t upload_bytes)
+{
+  printf("%-8s %8.3f ms/frame (convert %.3f ms), %6.2f MiB uploaded/frame\n", name,
+         seconds * 1e3 / ROUNDS, convert_seconds * 1e3 / ROUNDS, upload_bytes / (1024.0 * 1024.0));
+}
+
+/* usage: example_yuv [nv12|i420] [bt601|bt709] [limited|full] */
+int main(int argc, char **argv)
+{
+  yuv_format_t format = YUV_FORMAT_NV12;
+  yuv_matrix_t matrix = YUV_MATRIX_BT601;
+  yuv_range_t range = YUV_RANGE_LIMITED;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "i420") == 0) {
+      format = YUV_FORMAT_I420;
+    } else if (strcmp(argv[i], "bt709") == 0) {
+      matrix = YUV_MATRIX_BT709;
+    } else if (strcmp(argv[i], "full") == 0) {
+      range = YUV_RANGE_FULL;
+    }
+  }
+
+  device_t render_device;
+  CreateRenderDevice(&render_device);
+
+  canvas_t render_context;
+  CreateRenderContext(&render_device, &render_context);
+
+  shader_cache_t shader_cache;
+  InitShaderCache(&shader_cache, NULL);
+  GLuint rgba_program = CreateProgramCached(&shader_cache, VERTEX_SHADER, FRAGMENT_SHADER);
+  if (!rgba_program) {
+    exit(1);
+  }
+  glUseProgram(rgba_program);
+  glUniform1i(glGetUniformLocation(rgba_program, "s_texture"), 0);
+
+  yuv_renderer_t renderer;
+  InitYUVRenderer(&renderer, &shader_cache);
+
+  frame_t frames[FRAMES];
+  srand(1);
+  for (int i = 0; i < FRAMES; ++i) {
+    frames[i].size = LayoutFrame(&frames[i].image, NULL, format);
+    frames[i].memory = (uint8_t *)malloc(frames[i].size);
+    assert(frames[i].memory);
+    LayoutFrame(&frames[i].image, frames[i].memory, format);
+    FillFrame(&frames[i], i);
+  }
+
+  // everything renders offscreen at the frame size, whatever the display is
+  GLuint target;
+  GLuint fbo;
+  glGenTextures(1, &target);
+  glBindTexture(GL_TEXTURE_2D, target);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, WIDTH, HEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+  glGenFramebuffers(1, &fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target, 0);
+  assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+  glViewport(0, 0, WIDTH, HEIGHT);
+
+  uint8_t *rgba = (uint8_t *)malloc((size_t)WIDTH * HEIGHT * 4);
+  assert(rgba);
+
+  // cpu: convert to RGBA, upload 4 bytes per pixel
+  GLuint rgba_texture;
+  glGenTextures(1, &rgba_texture);
+  glBindTexture(GL_TEXTURE_2D, rgba_texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, WIDTH, HEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+  glFinish();
+  double convert = 0.0;
+  double start = Now();
+  for (int r = 0; r < ROUNDS; ++r) {
+    double convert_start = Now();
+    ConvertYUVToRGBA(rgba, 0, &frames[r % FRAMES].image, matrix, range);
+    convert += Now() - convert_start;
+    glBindTexture(GL_TEXTURE_2D, rgba_texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WIDTH, HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+    DrawRGBA(rgba_program, rgba_texture);
+    glFinish();
+  }
+  PrintResult("cpu", Now() - start, convert, (size_t)WIDTH * HEIGHT * 4);
+
+  // shader: upload the planes, convert while drawing
+  yuv_surface_t surface;
+  InitYUVSurface(&surface, format, WIDTH, HEIGHT, matrix, range);
+  UploadYUV(&surface, &frames[0].image);
+  DrawYUV(&renderer, &surface);
+  glFinish();
+
+  start = Now();
+  for (int r = 0; r < ROUNDS; ++r) {
+    UploadYUV(&surface, &frames[r % FRAMES].image);
+    DrawYUV(&renderer, &surface);
+    glFinish();
+  }
+  PrintResult("shader", Now() - start, 0.0, YUVFrameBytes(format, WIDTH, HEIGHT));
+  PrintYUVStats(&surface);
+
+  ConvertYUVToRGBA(rgba, 0, &frames[(ROUNDS - 1) % FRAMES].image, matrix, range);
+  CompareOutput(rgba, "shader");
+
+  // dmabuf: no copy at all, imported every frame like a new camera buffer
+  yuv_dmabuf_t buffer;
+  int fd = CreateUdmabuf(&frames[0], &buffer);
+  if (fd >= 0 && ImportYUVDmabuf(&surface, render_context.display, &buffer)) {
+    start = Now();
+    for (int r = 0; r < ROUNDS; ++r) {
+      ImportYUVDmabuf(&surface, render_context.display, &buffer);
+      DrawYUV(&renderer, &surface);
+      glFinish();
+    }
+    PrintResult("dmabuf", Now() - start, 0.0, 0);
+    PrintYUVStats(&surface);
+
+    ConvertYUVToRGBA(rgba, 0, &frames[0].image, matrix, range);
+    CompareOutput(rgba, "dmabuf");
+  } else {
+    printf("dmabuf   skipped (%s)\n", fd < 0 ? "no /dev/udmabuf" : "import failed");
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  // show the last frame
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glViewport(0, 0, render_context.width, render_context.height);
+  glClear(GL_COLOR_BUFFER_BIT);
+  DrawYUV(&renderer, &surface);
+  eglSwapBuffers(render_context.display, render_context.surface);
+  PrintShaderCacheStats(&shader_cache);
+
+  DestroyYUVSurface(&surface);
+  DestroyYUVRenderer(&renderer);
+  glDeleteTextures(1, &rgba_texture);
+  glDeleteFramebuffers(1, &fbo);
+  glDeleteTextures(1, &target);
+  free(rgba);
+  for (int i = 0; i < FRAMES; ++i) {
+    free(frames[i].memory);
+  }
+
+  OutputDisplay(&render_device);
+  return 0;
+}
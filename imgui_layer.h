@@ -0,0 +1,475 @@
+#ifndef KT_IMGUI_LAYER_H
+#define KT_IMGUI_LAYER_H
+
+/*
+ * retained imgui layer.
+ *
+ * imgui output is rendered into an offscreen texture and only redrawn when
+ * the draw data changes. when no input reached imgui and the last frames
+ * were identical, the imgui frame is not even built; the cached texture is
+ * composited as a single quad.
+ *
+ * deciding (BeginUILayerFrame, UILayerChanged) only touches imgui and the
+ * bookkeeping fields; drawing (RedrawUILayer, ResizeUILayer) only touches
+ * GL. with a render thread the two halves run on different threads and the
+ * draw data travels between them as a copy, see CopyDrawData.
+ *
+ * imgui 1.92 and later leave texture creation and updates to the renderer,
+ * through ImDrawData::Textures. the main thread answers those requests the
+ * way the backend would and ships the pixels with the frame; the render
+ * thread uploads them into textures of its own, see CopyTextureUpdates.
+ * the backend only ever sees those, and the render thread never allocates
+ * through imgui.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include <epoxy/gl.h>
+
+#include "imgui/imgui.h"
+#include "imgui/backends/imgui_impl_opengl3.h"
+
+#if IMGUI_VERSION_NUM >= 19200
+#define UI_LAYER_TEXTURES 1
+#endif
+
+// identical frames in a row before building stops until the next input
+#define UI_LAYER_SETTLE_FRAMES 3
+// rebuild at least this often while idle, so timers (caret blink, tooltips) still fire
+#define UI_LAYER_IDLE_REFRESH_MS 250
+
+typedef struct
+{
+  GLuint fbo;
+  GLuint texture;
+  int width;
+  int height;
+
+  bool valid;                 // texture holds the last built frame
+  bool input_pending;         // input was fed to imgui since the last build
+  int identical_frames;
+  uint64_t draw_hash;
+  struct timespec last_build;
+
+  uint64_t frames;
+  uint64_t builds;
+  uint64_t redraws;
+} ui_layer_t;
+
+#ifdef UI_LAYER_TEXTURES
+/* one texture request with the pixels it needs */
+typedef struct
+{
+  ImTextureData *texture;     // what the copied commands point at, TexID written by the render thread
+  ImTextureStatus status;
+  int width;
+  int height;
+  std::vector<ImTextureRect> rects;   // the whole texture when created
+  std::vector<uint8_t> pixels;        // rects, tightly packed RGBA one after another
+} ui_texture_update_t;
+#endif
+
+/* kept in the frame packet, entries keep their buffers between frames */
+typedef struct
+{
+#ifdef UI_LAYER_TEXTURES
+  std::vector<ui_texture_update_t> updates;
+#endif
+  int count;
+} ui_texture_updates_t;
+
+static double ui_layer_elapsed(const struct timespec *since, const struct timespec *now)
+{
+  return (now->tv_sec - since->tv_sec) + (now->tv_nsec - since->tv_nsec) * 1e-9;
+}
+
+static void CreateUILayer(ui_layer_t *layer, int width, int height)
+{
+  memset(layer, 0, sizeof(*layer));
+  layer->width = width;
+  layer->height = height;
+
+  glGenTextures(1, &layer->texture);
+  glBindTexture(GL_TEXTURE_2D, layer->texture);
+  // always drawn 1:1 over the screen
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+  glGenFramebuffers(1, &layer->fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, layer->fbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, layer->texture, 0);
+  assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  clock_gettime(CLOCK_MONOTONIC, &layer->last_build);
+}
+
+static void DestroyUILayer(ui_layer_t *layer)
+{
+  glDeleteFramebuffers(1, &layer->fbo);
+  glDeleteTextures(1, &layer->texture);
+  layer->fbo = 0;
+  layer->texture = 0;
+  layer->valid = false;
+}
+
+// call whenever an event is handed to ImGuiIO
+static void MarkUILayerInput(ui_layer_t *layer)
+{
+  layer->input_pending = true;
+}
+
+static void InvalidateUILayer(ui_layer_t *layer)
+{
+  layer->valid = false;
+  layer->identical_frames = 0;
+}
+
+/*
+ * decides whether the imgui frame has to be built this frame. on true,
+ * io.DeltaTime is set to the real time since the previous build so skipped
+ * frames do not stall imgui's clock.
+ */
+static bool BeginUILayerFrame(ui_layer_t *layer)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = ui_layer_elapsed(&layer->last_build, &now);
+
+  layer->frames++;
+
+  bool settled = layer->identical_frames >= UI_LAYER_SETTLE_FRAMES;
+  if (layer->valid && settled && !layer->input_pending && elapsed * 1000.0 < UI_LAYER_IDLE_REFRESH_MS) {
+    return false;
+  }
+
+  ImGuiIO &io = ImGui::GetIO();
+  io.DeltaTime = elapsed > 0.0 ? (float)elapsed : 1.f / 60.f;
+
+  layer->last_build = now;
+  layer->input_pending = false;
+  layer->builds++;
+  return true;
+}
+
+// 64 bit multiply/xor hash, 8 bytes a step
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t size)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  for (; size >= 8; size -= 8, p += 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    h = (h ^ word) * 0x100000001b3ull;
+    h ^= h >> 29;
+  }
+  for (; size; --size, ++p) {
+    h = (h ^ *p) * 0x100000001b3ull;
+  }
+  return h;
+}
+
+static uint64_t HashDrawData(const ImDrawData *draw_data)
+{
+  uint64_t h = 0xcbf29ce484222325ull;
+  h = hash_bytes(h, &draw_data->DisplayPos, sizeof(draw_data->DisplayPos));
+  h = hash_bytes(h, &draw_data->DisplaySize, sizeof(draw_data->DisplaySize));
+  for (int i = 0; i < draw_data->CmdListsCount; ++i) {
+    const ImDrawList *list = draw_data->CmdLists[i];
+    h = hash_bytes(h, list->VtxBuffer.Data, list->VtxBuffer.size_in_bytes());
+    h = hash_bytes(h, list->IdxBuffer.Data, list->IdxBuffer.size_in_bytes());
+    h = hash_bytes(h, list->CmdBuffer.Data, list->CmdBuffer.size_in_bytes());
+  }
+  return h;
+}
+
+/*
+ * true when the draw data differs from what the texture holds, that is
+ * when RedrawUILayer has to run with it. touches no GL.
+ */
+static bool UILayerChanged(ui_layer_t *layer, const ImDrawData *draw_data)
+{
+  uint64_t hash = HashDrawData(draw_data);
+  if (layer->valid && hash == layer->draw_hash) {
+    layer->identical_frames++;
+    return false;
+  }
+
+  layer->identical_frames = 0;
+  layer->draw_hash = hash;
+  layer->valid = true;
+  return true;
+}
+
+static void RedrawUILayer(ui_layer_t *layer, ImDrawData *draw_data)
+{
+  layer->redraws++;
+
+  GLint viewport[4];
+  GLfloat clear_color[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  glGetFloatv(GL_COLOR_CLEAR_VALUE, clear_color);
+
+  // the backend blends color with SRC_ALPHA and alpha with ONE, so the
+  // texture ends up premultiplied, matching the compositing blend func
+  glBindFramebuffer(GL_FRAMEBUFFER, layer->fbo);
+  glViewport(0, 0, layer->width, layer->height);
+  glClearColor(0.f, 0.f, 0.f, 0.f);
+  glClear(GL_COLOR_BUFFER_BIT);
+  if (draw_data) {
+    ImGui_ImplOpenGL3_RenderDrawData(draw_data);
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+  glClearColor(clear_color[0], clear_color[1], clear_color[2], clear_color[3]);
+}
+
+/* new texture storage for a new output size, the texture name is kept */
+static void ResizeUILayer(ui_layer_t *layer, int width, int height)
+{
+  layer->width = width;
+  layer->height = height;
+  glBindTexture(GL_TEXTURE_2D, layer->texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+  // transparent until the next redraw
+  RedrawUILayer(layer, NULL);
+  layer->redraws--;
+}
+
+#ifdef UI_LAYER_TEXTURES
+// a main thread texture's TexID names the render thread's stand-in
+static ImTextureData *ui_texture_shadow(const ImTextureData *tex)
+{
+  return (ImTextureData *)(intptr_t)tex->TexID;
+}
+
+static void ui_texture_copy_rect(ui_texture_update_t *update, ImTextureData *tex, const ImTextureRect &rect)
+{
+  size_t row = (size_t)rect.w * tex->BytesPerPixel;
+  for (int y = 0; y < rect.h; ++y) {
+    const uint8_t *src = tex->GetPixelsAt(rect.x, rect.y + y);
+    update->pixels.insert(update->pixels.end(), src, src + row);
+  }
+  update->rects.push_back(rect);
+}
+#endif
+
+/*
+ * deep copy of draw data for another thread. dst keeps its lists and their
+ * buffers between copies, so a steady ui stops allocating. only the parts
+ * ImGui_ImplOpenGL3_RenderDrawData reads are copied. with imgui 1.92 call
+ * CopyTextureUpdates first, the commands refer to the textures it set up.
+ */
+static void CopyDrawData(ImDrawData *dst, const ImDrawData *src)
+{
+  for (int i = src->CmdListsCount; i < dst->CmdLists.Size; ++i) {
+    IM_DELETE(dst->CmdLists[i]);
+  }
+  int old_count = dst->CmdLists.Size;
+  dst->CmdLists.resize(src->CmdListsCount);
+  for (int i = old_count; i < src->CmdListsCount; ++i) {
+    dst->CmdLists[i] = IM_NEW(ImDrawList)(ImGui::GetDrawListSharedData());
+  }
+
+  for (int i = 0; i < src->CmdListsCount; ++i) {
+    const ImDrawList *from = src->CmdLists[i];
+    ImDrawList *to = dst->CmdLists[i];
+    // resize + memcpy keeps capacity, ImVector's operator= frees first
+    to->CmdBuffer.resize(from->CmdBuffer.Size);
+    to->IdxBuffer.resize(from->IdxBuffer.Size);
+    to->VtxBuffer.resize(from->VtxBuffer.Size);
+    memcpy(to->CmdBuffer.Data, from->CmdBuffer.Data, from->CmdBuffer.size_in_bytes());
+    memcpy(to->IdxBuffer.Data, from->IdxBuffer.Data, from->IdxBuffer.size_in_bytes());
+    memcpy(to->VtxBuffer.Data, from->VtxBuffer.Data, from->VtxBuffer.size_in_bytes());
+    to->Flags = from->Flags;
+#ifdef UI_LAYER_TEXTURES
+    // imgui owned textures resolve to the render thread's stand-ins, see CopyTextureUpdates
+    for (ImDrawCmd &cmd : to->CmdBuffer) {
+      if (cmd.TexRef._TexData) {
+        cmd.TexRef._TexData = ui_texture_shadow(cmd.TexRef._TexData);
+      }
+    }
+#endif
+  }
+
+  dst->Valid = src->Valid;
+  dst->CmdListsCount = src->CmdListsCount;
+  dst->TotalIdxCount = src->TotalIdxCount;
+  dst->TotalVtxCount = src->TotalVtxCount;
+  dst->DisplayPos = src->DisplayPos;
+  dst->DisplaySize = src->DisplaySize;
+  dst->FramebufferScale = src->FramebufferScale;
+#ifdef UI_LAYER_TEXTURES
+  // requests travel separately, see CopyTextureUpdates
+  dst->Textures = NULL;
+#endif
+}
+
+/*
+ * takes the texture requests of a frame on the main thread, call after
+ * ImGui::Render and before CopyDrawData. each texture is marked done the
+ * way the backend marks it, so imgui moves on. returns true when a texture
+ * was created or updated, the ui then has to be redrawn.
+ */
+static bool CopyTextureUpdates(ui_texture_updates_t *dst, const ImDrawData *draw_data)
+{
+  bool changed = false;
+#ifdef UI_LAYER_TEXTURES
+  if (!draw_data->Textures) {
+    return false;
+  }
+  for (ImTextureData *tex : *draw_data->Textures) {
+    // the backend keeps a texture it is asked to destroy until a frame went by without it
+    if (tex->Status == ImTextureStatus_OK || tex->Status == ImTextureStatus_Destroyed ||
+        (tex->Status == ImTextureStatus_WantDestroy && tex->UnusedFrames == 0)) {
+      continue;
+    }
+    assert(tex->Format == ImTextureFormat_RGBA32);
+    if (dst->count == (int)dst->updates.size()) {
+      dst->updates.emplace_back();
+    }
+    ui_texture_update_t *update = &dst->updates[dst->count++];
+    update->status = tex->Status;
+    update->width = tex->Width;
+    update->height = tex->Height;
+    update->rects.clear();
+    update->pixels.clear();
+
+    switch (tex->Status) {
+    case ImTextureStatus_WantCreate: {
+      update->texture = IM_NEW(ImTextureData)();
+      ImTextureRect all = { 0, 0, (unsigned short)tex->Width, (unsigned short)tex->Height };
+      ui_texture_copy_rect(update, tex, all);
+      tex->SetTexID((ImTextureID)(intptr_t)update->texture);
+      tex->SetStatus(ImTextureStatus_OK);
+      changed = true;
+      break;
+    }
+    case ImTextureStatus_WantUpdates:
+      update->texture = ui_texture_shadow(tex);
+      for (const ImTextureRect &rect : tex->Updates) {
+        ui_texture_copy_rect(update, tex, rect);
+      }
+      tex->SetStatus(ImTextureStatus_OK);
+      changed = true;
+      break;
+    default:
+      // freed by ReleaseTextureUpdates once the render thread deleted its texture
+      update->texture = ui_texture_shadow(tex);
+      tex->SetTexID(ImTextureID_Invalid);
+      tex->SetStatus(ImTextureStatus_Destroyed);
+      break;
+    }
+  }
+#endif
+  return changed;
+}
+
+/*
+ * carries the requests out on the render thread, before RedrawUILayer. the
+ * GL calls are made here rather than by the backend, which may allocate
+ * through imgui while updating a texture.
+ */
+static void ApplyTextureUpdates(const ui_texture_updates_t *src)
+{
+#ifdef UI_LAYER_TEXTURES
+  if (src->count == 0) {
+    return;
+  }
+  GLint last_texture;
+  glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_texture);
+  for (int i = 0; i < src->count; ++i) {
+    const ui_texture_update_t *update = &src->updates[i];
+    GLuint texture = (GLuint)(intptr_t)update->texture->TexID;
+    const uint8_t *pixels = update->pixels.data();
+    switch (update->status) {
+    case ImTextureStatus_WantCreate:
+      glGenTextures(1, &texture);
+      glBindTexture(GL_TEXTURE_2D, texture);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, update->width, update->height, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+                   pixels);
+      update->texture->SetTexID((ImTextureID)(intptr_t)texture);
+      break;
+    case ImTextureStatus_WantUpdates:
+      glBindTexture(GL_TEXTURE_2D, texture);
+      for (const ImTextureRect &rect : update->rects) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x, rect.y, rect.w, rect.h, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        pixels += (size_t)rect.w * rect.h * 4;
+      }
+      break;
+    default:
+      glDeleteTextures(1, &texture);
+      update->texture->SetTexID(ImTextureID_Invalid);
+      break;
+    }
+  }
+  glBindTexture(GL_TEXTURE_2D, (GLuint)last_texture);
+#endif
+}
+
+/* the packet came back from the render thread: frees what it destroyed */
+static void ReleaseTextureUpdates(ui_texture_updates_t *updates)
+{
+#ifdef UI_LAYER_TEXTURES
+  for (int i = 0; i < updates->count; ++i) {
+    ui_texture_update_t *update = &updates->updates[i];
+    if (update->status == ImTextureStatus_WantDestroy) {
+      IM_DELETE(update->texture);
+    }
+  }
+#endif
+  updates->count = 0;
+}
+
+/*
+ * deletes every texture still alive. call with the context current once
+ * the pipeline is finished and its packets released, before
+ * ImGui_ImplOpenGL3_Shutdown: it would take the main thread TexIDs for GL
+ * names.
+ */
+static void DestroyUITextures(void)
+{
+#ifdef UI_LAYER_TEXTURES
+  for (ImTextureData *tex : ImGui::GetPlatformIO().Textures) {
+    if (tex->TexID == ImTextureID_Invalid) {
+      continue;
+    }
+    ImTextureData *shadow = ui_texture_shadow(tex);
+    GLuint texture = (GLuint)(intptr_t)shadow->TexID;
+    glDeleteTextures(1, &texture);
+    IM_DELETE(shadow);
+    tex->SetTexID(ImTextureID_Invalid);
+    tex->SetStatus(ImTextureStatus_Destroyed);
+  }
+#endif
+}
+
+static void FreeDrawDataCopy(ImDrawData *copy)
+{
+  for (int i = 0; i < copy->CmdLists.Size; ++i) {
+    IM_DELETE(copy->CmdLists[i]);
+  }
+  copy->CmdLists.clear();
+  copy->CmdListsCount = 0;
+}
+
+static void PrintUILayerStats(const ui_layer_t *layer)
+{
+  printf("ui layer: %llu frames, %llu built, %llu redrawn\n",
+         (unsigned long long)layer->frames, (unsigned long long)layer->builds,
+         (unsigned long long)layer->redraws);
+}
+
+#endif
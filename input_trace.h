@@ -0,0 +1,329 @@
+#ifndef KT_INPUT_TRACE_H
+#define KT_INPUT_TRACE_H
+
+/*
+ * input event traces.
+ *
+ * the main loop turns libinput events into input_event_t before handling
+ * them. a recorder appends those, plus a marker per rendered frame, to a
+ * compact binary trace; a replayer reads a trace back and feeds the same
+ * handler, so a session can be reproduced without any input device.
+ *
+ * file layout, host byte order:
+ *   header   "KTINPUT1", u32 version, u32 screen width, u32 screen height
+ *   records  u8 type, varint usec since previous record, payload
+ *            key/button  varint code, u8 pressed
+ *            motion      f64 dx, f64 dy
+ *            absolute    f64 x, f64 y (already in screen pixels)
+ *            frame       nothing
+ *
+ * replay speed 1 follows the recorded timestamps, 2 runs twice as fast,
+ * 0 ignores time and hands out exactly one recorded frame per call site
+ * frame, which is the mode to benchmark with.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#define INPUT_TRACE_MAGIC "KTINPUT1"
+#define INPUT_TRACE_VERSION 1
+
+typedef enum
+{
+  INPUT_EVENT_FRAME = 0,
+  INPUT_EVENT_KEY,
+  INPUT_EVENT_MOTION,
+  INPUT_EVENT_MOTION_ABSOLUTE,
+  INPUT_EVENT_BUTTON,
+  INPUT_EVENT_COUNT,
+} input_event_type_t;
+
+typedef struct
+{
+  input_event_type_t type;
+  uint64_t time_usec;         // CLOCK_MONOTONIC, like libinput
+  uint32_t code;              // key or button
+  bool pressed;
+  double dx, dy;              // motion
+  double x, y;                // absolute, screen pixels
+} input_event_t;
+
+typedef struct
+{
+  FILE *file;
+  uint64_t last_usec;
+  uint64_t events;
+  uint64_t frames;
+} input_recorder_t;
+
+typedef struct
+{
+  FILE *file;
+  uint32_t screen_width;
+  uint32_t screen_height;
+  double speed;
+
+  uint64_t trace_usec;        // timestamp of the last record read
+  uint64_t trace_start_usec;
+  uint64_t clock_start_usec;
+  bool started;
+
+  input_event_t pending;      // read ahead, not yet due
+  bool has_pending;
+  bool finished;
+
+  uint64_t events;
+  uint64_t frames;
+} input_replay_t;
+
+static uint64_t InputTraceNow(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
+
+static void write_varint(FILE *file, uint64_t v)
+{
+  do {
+    uint8_t byte = v & 0x7f;
+    v >>= 7;
+    if (v) {
+      byte |= 0x80;
+    }
+    fputc(byte, file);
+  } while (v);
+}
+
+static bool read_varint(FILE *file, uint64_t *v)
+{
+  *v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = fgetc(file);
+    if (c == EOF) {
+      return false;
+    }
+    *v |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*    recording     */
+
+static bool OpenInputRecorder(input_recorder_t *recorder, const char *path,
+                              uint32_t screen_width, uint32_t screen_height)
+{
+  memset(recorder, 0, sizeof(*recorder));
+  recorder->file = fopen(path, "wb");
+  if (!recorder->file) {
+    printf("open input trace %s FAILED!\n", path);
+    return false;
+  }
+
+  uint32_t header[3] = { INPUT_TRACE_VERSION, screen_width, screen_height };
+  fwrite(INPUT_TRACE_MAGIC, 8, 1, recorder->file);
+  fwrite(header, sizeof(header), 1, recorder->file);
+  recorder->last_usec = InputTraceNow();
+  return true;
+}
+
+static void RecordInputEvent(input_recorder_t *recorder, const input_event_t *event)
+{
+  if (!recorder->file) {
+    return;
+  }
+
+  // libinput and frame timestamps share a clock but may arrive out of order
+  uint64_t delta = event->time_usec > recorder->last_usec ? event->time_usec - recorder->last_usec : 0;
+  recorder->last_usec += delta;
+
+  fputc(event->type, recorder->file);
+  write_varint(recorder->file, delta);
+
+  switch (event->type) {
+  case INPUT_EVENT_KEY:
+  case INPUT_EVENT_BUTTON:
+    write_varint(recorder->file, event->code);
+    fputc(event->pressed ? 1 : 0, recorder->file);
+    break;
+  case INPUT_EVENT_MOTION:
+    fwrite(&event->dx, sizeof(double), 1, recorder->file);
+    fwrite(&event->dy, sizeof(double), 1, recorder->file);
+    break;
+  case INPUT_EVENT_MOTION_ABSOLUTE:
+    fwrite(&event->x, sizeof(double), 1, recorder->file);
+    fwrite(&event->y, sizeof(double), 1, recorder->file);
+    break;
+  default:
+    break;
+  }
+
+  if (event->type == INPUT_EVENT_FRAME) {
+    recorder->frames++;
+  } else {
+    recorder->events++;
+  }
+}
+
+/* marks the end of a rendered frame */
+static void RecordInputFrame(input_recorder_t *recorder)
+{
+  input_event_t frame;
+  memset(&frame, 0, sizeof(frame));
+  frame.type = INPUT_EVENT_FRAME;
+  frame.time_usec = InputTraceNow();
+  RecordInputEvent(recorder, &frame);
+}
+
+static void CloseInputRecorder(input_recorder_t *recorder)
+{
+  if (!recorder->file) {
+    return;
+  }
+  fclose(recorder->file);
+  recorder->file = NULL;
+  printf("input trace: recorded %llu events over %llu frames\n",
+         (unsigned long long)recorder->events, (unsigned long long)recorder->frames);
+}
+
+/*    replay     */
+
+static bool OpenInputReplay(input_replay_t *replay, const char *path, double speed)
+{
+  memset(replay, 0, sizeof(*replay));
+  replay->speed = speed;
+  replay->file = fopen(path, "rb");
+  if (!replay->file) {
+    printf("open input trace %s FAILED!\n", path);
+    return false;
+  }
+
+  char magic[8];
+  uint32_t header[3];
+  if (fread(magic, 8, 1, replay->file) != 1 || memcmp(magic, INPUT_TRACE_MAGIC, 8) != 0 ||
+      fread(header, sizeof(header), 1, replay->file) != 1 || header[0] != INPUT_TRACE_VERSION) {
+    printf("input trace %s is not a version %d trace\n", path, INPUT_TRACE_VERSION);
+    fclose(replay->file);
+    replay->file = NULL;
+    return false;
+  }
+  replay->screen_width = header[1];
+  replay->screen_height = header[2];
+  return true;
+}
+
+static bool read_input_event(input_replay_t *replay, input_event_t *event)
+{
+  FILE *file = replay->file;
+  memset(event, 0, sizeof(*event));
+
+  int type = fgetc(file);
+  uint64_t delta, code;
+  if (type == EOF || type >= INPUT_EVENT_COUNT || !read_varint(file, &delta)) {
+    return false;
+  }
+  event->type = (input_event_type_t)type;
+  replay->trace_usec += delta;
+  event->time_usec = replay->trace_usec;
+
+  switch (event->type) {
+  case INPUT_EVENT_KEY:
+  case INPUT_EVENT_BUTTON: {
+    if (!read_varint(file, &code)) {
+      return false;
+    }
+    int pressed = fgetc(file);
+    if (pressed == EOF) {
+      return false;
+    }
+    event->code = (uint32_t)code;
+    event->pressed = pressed != 0;
+  }
+    break;
+  case INPUT_EVENT_MOTION:
+    if (fread(&event->dx, sizeof(double), 1, file) != 1 || fread(&event->dy, sizeof(double), 1, file) != 1) {
+      return false;
+    }
+    break;
+  case INPUT_EVENT_MOTION_ABSOLUTE:
+    if (fread(&event->x, sizeof(double), 1, file) != 1 || fread(&event->y, sizeof(double), 1, file) != 1) {
+      return false;
+    }
+    break;
+  default:
+    break;
+  }
+  return true;
+}
+
+/*
+ * hands out the next event due this frame; returns false when there is
+ * none left for this frame. frame markers are consumed, not returned.
+ * replay->finished is set once the trace is exhausted.
+ */
+static bool PollInputReplay(input_replay_t *replay, input_event_t *event)
+{
+  if (replay->finished) {
+    return false;
+  }
+
+  uint64_t now = InputTraceNow();
+  if (!replay->started) {
+    replay->started = true;
+    replay->clock_start_usec = now;
+    replay->trace_start_usec = replay->trace_usec;
+  }
+
+  for (;;) {
+    if (!replay->has_pending) {
+      if (!read_input_event(replay, &replay->pending)) {
+        replay->finished = true;
+        return false;
+      }
+      replay->has_pending = true;
+    }
+
+    input_event_t *next = &replay->pending;
+    if (replay->speed > 0.0) {
+      double due = (next->time_usec - replay->trace_start_usec) / replay->speed;
+      if (due > (double)(now - replay->clock_start_usec)) {
+        return false;
+      }
+    }
+
+    replay->has_pending = false;
+    if (next->type == INPUT_EVENT_FRAME) {
+      replay->frames++;
+      // as fast as possible: one recorded frame per rendered frame
+      if (replay->speed <= 0.0) {
+        return false;
+      }
+      continue;
+    }
+
+    *event = *next;
+    replay->events++;
+    return true;
+  }
+}
+
+static void CloseInputReplay(input_replay_t *replay)
+{
+  if (!replay->file) {
+    return;
+  }
+  fclose(replay->file);
+  replay->file = NULL;
+
+  double seconds = (InputTraceNow() - replay->clock_start_usec) * 1e-6;
+  printf("input replay: %llu events, %llu recorded frames in %.3f s\n",
+         (unsigned long long)replay->events, (unsigned long long)replay->frames, seconds);
+}
+
+#endif
@@ -0,0 +1,759 @@
+#ifndef KT_KTX_H
+#define KT_KTX_H
+
+/*
+ * compressed textures from KTX containers.
+ *
+ * OpenKTX maps a KTX 1.1 or KTX 2.0 file and points every mip level at its
+ * bytes in the mapping; nothing is copied or decoded up front. UploadKTX
+ * hands the levels straight to glCompressedTexImage2D when the GL supports
+ * the block format. ETC2/EAC is core in GLES 3.0, ASTC needs one of the
+ * ASTC extensions.
+ *
+ * when the format is not supported (or KEYTOY_KTX_DECODE is set), ETC1,
+ * ETC2 and unsigned EAC levels are decoded on the cpu into RGBA8 and
+ * uploaded uncompressed. ASTC has no cpu fallback; the caller gets false
+ * and loads an uncompressed source instead.
+ *
+ * only single 2D images are handled: no arrays, cube maps, 3D textures or
+ * KTX2 supercompression. payloads are uploaded as authored, so textures
+ * the compositor blends must be encoded with premultiplied alpha. KTX rows
+ * usually start at the top of the image, see ktx_t.origin_top.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <epoxy/gl.h>
+
+#define KTX_MAX_LEVELS 16
+
+typedef enum
+{
+  KTX_CODEC_ETC1 = 0,
+  KTX_CODEC_ETC2_RGB,
+  KTX_CODEC_ETC2_RGB_A1,      // punchthrough alpha
+  KTX_CODEC_ETC2_RGBA,        // ETC2 color + EAC alpha
+  KTX_CODEC_EAC_R11,
+  KTX_CODEC_EAC_RG11,
+  KTX_CODEC_EAC_SIGNED,       // signed R11/RG11, no cpu fallback
+  KTX_CODEC_ASTC,             // no cpu fallback
+} ktx_codec_t;
+
+typedef struct
+{
+  GLenum gl_format;           // glInternalFormat, KTX 1
+  uint32_t vk_format;         // VkFormat, KTX 2
+  ktx_codec_t codec;
+  uint8_t block_width;
+  uint8_t block_height;
+  uint8_t block_bytes;
+  bool srgb;
+  const char *name;
+} ktx_format_t;
+
+typedef struct
+{
+  const uint8_t *data;        // inside the mapping
+  size_t size;
+  uint32_t width;
+  uint32_t height;
+} ktx_level_t;
+
+typedef struct
+{
+  void *map;
+  size_t map_size;
+
+  int version;                // 1 or 2
+  const ktx_format_t *format;
+  uint32_t width;
+  uint32_t height;
+  int levels;
+  ktx_level_t level[KTX_MAX_LEVELS];
+  bool origin_top;            // first row is the top of the image (KTXorientation)
+} ktx_t;
+
+typedef struct
+{
+  bool compressed;            // false: decoded on the cpu
+  size_t gpu_bytes;           // texture storage of all levels
+  double upload_ms;
+} ktx_upload_t;
+
+static const ktx_format_t ktx_formats[] = {
+  { GL_ETC1_RGB8_OES,                            0,   KTX_CODEC_ETC1,        4,  4,  8, false, "ETC1" },
+  { GL_COMPRESSED_RGB8_ETC2,                     147, KTX_CODEC_ETC2_RGB,    4,  4,  8, false, "ETC2 RGB8" },
+  { GL_COMPRESSED_SRGB8_ETC2,                    148, KTX_CODEC_ETC2_RGB,    4,  4,  8, true,  "ETC2 SRGB8" },
+  { GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2, 149, KTX_CODEC_ETC2_RGB_A1, 4,  4,  8, false, "ETC2 RGB8A1" },
+  { GL_COMPRESSED_SRGB8_PUNCHTHROUGH_ALPHA1_ETC2,150, KTX_CODEC_ETC2_RGB_A1, 4,  4,  8, true,  "ETC2 SRGB8A1" },
+  { GL_COMPRESSED_RGBA8_ETC2_EAC,                151, KTX_CODEC_ETC2_RGBA,   4,  4, 16, false, "ETC2 RGBA8" },
+  { GL_COMPRESSED_SRGB8_ALPHA8_ETC2_EAC,         152, KTX_CODEC_ETC2_RGBA,   4,  4, 16, true,  "ETC2 SRGB8_ALPHA8" },
+  { GL_COMPRESSED_R11_EAC,                       153, KTX_CODEC_EAC_R11,     4,  4,  8, false, "EAC R11" },
+  { GL_COMPRESSED_SIGNED_R11_EAC,                154, KTX_CODEC_EAC_SIGNED,  4,  4,  8, false, "EAC R11 signed" },
+  { GL_COMPRESSED_RG11_EAC,                      155, KTX_CODEC_EAC_RG11,    4,  4, 16, false, "EAC RG11" },
+  { GL_COMPRESSED_SIGNED_RG11_EAC,               156, KTX_CODEC_EAC_SIGNED,  4,  4, 16, false, "EAC RG11 signed" },
+  { GL_COMPRESSED_RGBA_ASTC_4x4_KHR,             157, KTX_CODEC_ASTC,        4,  4, 16, false, "ASTC 4x4" },
+  { GL_COMPRESSED_SRGB8_ALPHA8_ASTC_4x4_KHR,     158, KTX_CODEC_ASTC,        4,  4, 16, true,  "ASTC 4x4 sRGB" },
+  { GL_COMPRESSED_RGBA_ASTC_5x4_KHR,             159, KTX_CODEC_ASTC,        5,  4, 16, false, "ASTC 5x4" },
+  { GL_COMPRESSED_SRGB8_ALPHA8_ASTC_5x4_KHR,     160, KTX_CODEC_ASTC,        5,  4, 16, true,  "ASTC 5x4 sRGB" },
+  { GL_COMPRESSED_RGBA_ASTC_5x5_KHR,             161, KTX_CODEC_ASTC,        5,  5, 16, false, "ASTC 5x5" },
+  { GL_COMPRESSED_SRGB8_ALPHA8_ASTC_5x5_KHR,     162, KTX_CODEC_ASTC,        5,  5, 16, true,  "ASTC 5x5 sRGB" },
+  { GL_COMPRESSED_RGBA_ASTC_6x5_KHR,             163, KTX_CODEC_ASTC,        6,  5, 16, false, "ASTC 6x5" },
+  { GL_COMPRESSED_SRGB8_ALPHA8_ASTC_6x5_KHR,     164, KTX_CODEC_ASTC,        6,  5, 16, true,  "ASTC 6x5 sRGB" },
+  { GL_COMPRESSED_RGBA_ASTC_6x6_KHR,             165, KTX_CODEC_ASTC,        6,  6, 16, false, "ASTC 6x6" },
+  { GL_COMPRESSED_SRGB8_ALPHA8_ASTC_6x6_KHR,     166, KTX_CODEC_ASTC,        6,  6, 16, true,  "ASTC 6x6 sRGB" },
+  { GL_COMPRESSED_RGBA_ASTC_8x5_KHR,             167, KTX_CODEC_ASTC,        8,  5, 16, false, "ASTC 8x5" },
+  { GL_COMPRESSED_SRGB8_ALPHA8_ASTC_8x5_KHR,     168, KTX_CODEC_ASTC,        8,  5, 16, true,  "ASTC 8x5 sRGB" },
+  { GL_COMPRESSED_RGBA_ASTC_8x6_KHR,             169, KTX_CODEC_ASTC,        8,  6, 16, false, "ASTC 8x6" },
+  { GL_COMPRESSED_SRGB8_ALPHA8_ASTC_8x6_KHR,     170, KTX_CODEC_ASTC,        8,  6, 16, true,  "ASTC 8x6 sRGB" },
+  { GL_COMPRESSED_RGBA_ASTC_8x8_KHR,             171, KTX_CODEC_ASTC,        8,  8, 16, false, "ASTC 8x8" },
+  { GL_COMPRESSED_SRGB8_ALPHA8_ASTC_8x8_KHR,     172, KTX_CODEC_ASTC,        8,  8, 16, true,  "ASTC 8x8 sRGB" },
+  { GL_COMPRESSED_RGBA_ASTC_10x5_KHR,            173, KTX_CODEC_ASTC,       10,  5, 16, false, "ASTC 10x5" },
+  { GL_COMPRESSED_SRGB8_ALPHA8_ASTC_10x5_KHR,    174, KTX_CODEC_ASTC,       10,  5, 16, true,  "ASTC 10x5 sRGB" },
+  { GL_COMPRESSED_RGBA_ASTC_10x6_KHR,            175, KTX_CODEC_ASTC,       10,  6, 16, false, "ASTC 10x6" },
+  { GL_COMPRESSED_SRGB8_ALPHA8_ASTC_10x6_KHR,    176, KTX_CODEC_ASTC,       10,  6, 16, true,  "ASTC 10x6 sRGB" },
+  { GL_COMPRESSED_RGBA_ASTC_10x8_KHR,            177, KTX_CODEC_ASTC,       10,  8, 16, false, "ASTC 10x8" },
+  { GL_COMPRESSED_SRGB8_ALPHA8_ASTC_10x8_KHR,    178, KTX_CODEC_ASTC,       10,  8, 16, true,  "ASTC 10x8 sRGB" },
+  { GL_COMPRESSED_RGBA_ASTC_10x10_KHR,           179, KTX_CODEC_ASTC,       10, 10, 16, false, "ASTC 10x10" },
+  { GL_COMPRESSED_SRGB8_ALPHA8_ASTC_10x10_KHR,   180, KTX_CODEC_ASTC,       10, 10, 16, true,  "ASTC 10x10 sRGB" },
+  { GL_COMPRESSED_RGBA_ASTC_12x10_KHR,           181, KTX_CODEC_ASTC,       12, 10, 16, false, "ASTC 12x10" },
+  { GL_COMPRESSED_SRGB8_ALPHA8_ASTC_12x10_KHR,   182, KTX_CODEC_ASTC,       12, 10, 16, true,  "ASTC 12x10 sRGB" },
+  { GL_COMPRESSED_RGBA_ASTC_12x12_KHR,           183, KTX_CODEC_ASTC,       12, 12, 16, false, "ASTC 12x12" },
+  { GL_COMPRESSED_SRGB8_ALPHA8_ASTC_12x12_KHR,   184, KTX_CODEC_ASTC,       12, 12, 16, true,  "ASTC 12x12 sRGB" },
+};
+
+#define KTX_FORMAT_COUNT (sizeof(ktx_formats) / sizeof(ktx_formats[0]))
+
+static const uint8_t ktx1_identifier[12] = { 0xab, 'K', 'T', 'X', ' ', '1', '1', 0xbb, '\r', '\n', 0x1a, '\n' };
+static const uint8_t ktx2_identifier[12] = { 0xab, 'K', 'T', 'X', ' ', '2', '0', 0xbb, '\r', '\n', 0x1a, '\n' };
+
+static const ktx_format_t *ktx_find_gl_format(GLenum gl_format)
+{
+  for (size_t i = 0; i < KTX_FORMAT_COUNT; ++i) {
+    if (ktx_formats[i].gl_format == gl_format) {
+      return &ktx_formats[i];
+    }
+  }
+  return NULL;
+}
+
+static const ktx_format_t *ktx_find_vk_format(uint32_t vk_format)
+{
+  for (size_t i = 0; i < KTX_FORMAT_COUNT; ++i) {
+    if (vk_format != 0 && ktx_formats[i].vk_format == vk_format) {
+      return &ktx_formats[i];
+    }
+  }
+  return NULL;
+}
+
+static uint32_t ktx_read32(const uint8_t *p, bool swap)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return swap ? __builtin_bswap32(v) : v;
+}
+
+static uint64_t ktx_read64(const uint8_t *p)
+{
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+/* bytes of one level, from the block grid */
+static size_t ktx_level_size(const ktx_format_t *format, uint32_t width, uint32_t height)
+{
+  size_t blocks_x = (width + format->block_width - 1) / format->block_width;
+  size_t blocks_y = (height + format->block_height - 1) / format->block_height;
+  return blocks_x * blocks_y * format->block_bytes;
+}
+
+/* KTXorientation is "S=r,T=d" in KTX 1 and "rd" in KTX 2; up means bottom first */
+static void ktx_parse_metadata(ktx_t *ktx, const uint8_t *p, size_t size, bool swap)
+{
+  size_t offset = 0;
+  while (offset + 4 <= size) {
+    uint32_t length = ktx_read32(p + offset, swap);
+    offset += 4;
+    if (length > size - offset) {
+      return;
+    }
+    const char *key = (const char *)(p + offset);
+    size_t key_length = strnlen(key, length);
+    if (key_length < length && strcmp(key, "KTXorientation") == 0) {
+      const char *value = key + key_length + 1;
+      size_t value_length = length - key_length - 1;
+      for (size_t i = 0; i < value_length && value[i]; ++i) {
+        if (value[i] == 'u') {
+          ktx->origin_top = false;
+        }
+      }
+    }
+    offset += (length + 3) & ~3u;
+  }
+}
+
+static bool ktx_parse_v1(ktx_t *ktx, const uint8_t *p, size_t size)
+{
+  if (size < 64) {
+    return false;
+  }
+  uint32_t endianness = ktx_read32(p + 12, false);
+  if (endianness != 0x04030201 && endianness != 0x01020304) {
+    return false;
+  }
+  bool swap = endianness == 0x01020304;
+
+  uint32_t gl_type = ktx_read32(p + 16, swap);
+  uint32_t gl_internal_format = ktx_read32(p + 28, swap);
+  uint32_t depth = ktx_read32(p + 44, swap);
+  uint32_t array_elements = ktx_read32(p + 48, swap);
+  uint32_t faces = ktx_read32(p + 52, swap);
+  uint32_t levels = ktx_read32(p + 56, swap);
+  uint32_t kv_bytes = ktx_read32(p + 60, swap);
+
+  ktx->format = ktx_find_gl_format(gl_internal_format);
+  if (gl_type != 0 || !ktx->format) {
+    printf("ktx: glInternalFormat 0x%04x is not a supported compressed format\n", gl_internal_format);
+    return false;
+  }
+  if (depth > 1 || array_elements > 0 || faces != 1) {
+    printf("ktx: only single 2D images are supported\n");
+    return false;
+  }
+  ktx->width = ktx_read32(p + 36, swap);
+  ktx->height = ktx_read32(p + 40, swap);
+  ktx->levels = levels ? (int)levels : 1;
+  if (ktx->levels > KTX_MAX_LEVELS) {
+    return false;
+  }
+
+  size_t offset = 64;
+  if (kv_bytes > size - offset) {
+    return false;
+  }
+  ktx_parse_metadata(ktx, p + offset, kv_bytes, swap);
+  offset += kv_bytes;
+
+  for (int i = 0; i < ktx->levels; ++i) {
+    if (offset + 4 > size) {
+      return false;
+    }
+    uint32_t image_size = ktx_read32(p + offset, swap);
+    offset += 4;
+    if (image_size > size - offset) {
+      return false;
+    }
+    ktx->level[i].data = p + offset;
+    ktx->level[i].size = image_size;
+    offset += (image_size + 3) & ~3u;
+  }
+  return true;
+}
+
+static bool ktx_parse_v2(ktx_t *ktx, const uint8_t *p, size_t size)
+{
+  if (size < 80) {
+    return false;
+  }
+  uint32_t vk_format = ktx_read32(p + 12, false);
+  uint32_t depth = ktx_read32(p + 28, false);
+  uint32_t layers = ktx_read32(p + 32, false);
+  uint32_t faces = ktx_read32(p + 36, false);
+  uint32_t levels = ktx_read32(p + 40, false);
+  uint32_t supercompression = ktx_read32(p + 44, false);
+  uint32_t kv_offset = ktx_read32(p + 56, false);
+  uint32_t kv_bytes = ktx_read32(p + 60, false);
+
+  ktx->format = ktx_find_vk_format(vk_format);
+  if (!ktx->format) {
+    printf("ktx2: vkFormat %u is not a supported compressed format\n", vk_format);
+    return false;
+  }
+  if (supercompression != 0) {
+    printf("ktx2: supercompression scheme %u is not supported\n", supercompression);
+    return false;
+  }
+  if (depth > 0 || layers > 0 || faces != 1) {
+    printf("ktx2: only single 2D images are supported\n");
+    return false;
+  }
+  ktx->width = ktx_read32(p + 20, false);
+  ktx->height = ktx_read32(p + 24, false);
+  ktx->levels = levels ? (int)levels : 1;
+  if (ktx->levels > KTX_MAX_LEVELS || 80 + (size_t)ktx->levels * 24 > size) {
+    return false;
+  }
+
+  if (kv_offset <= size && kv_bytes <= size - kv_offset) {
+    ktx_parse_metadata(ktx, p + kv_offset, kv_bytes, false);
+  }
+
+  // the level index starts with level 0, the data itself is stored smallest first
+  for (int i = 0; i < ktx->levels; ++i) {
+    uint64_t offset = ktx_read64(p + 80 + i * 24);
+    uint64_t length = ktx_read64(p + 80 + i * 24 + 8);
+    if (offset > size || length > size - offset) {
+      return false;
+    }
+    ktx->level[i].data = p + offset;
+    ktx->level[i].size = (size_t)length;
+  }
+  return true;
+}
+
+static void CloseKTX(ktx_t *ktx)
+{
+  if (ktx->map) {
+    munmap(ktx->map, ktx->map_size);
+  }
+  memset(ktx, 0, sizeof(*ktx));
+}
+
+static bool OpenKTX(ktx_t *ktx, const char *path)
+{
+  memset(ktx, 0, sizeof(*ktx));
+  ktx->origin_top = true;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    printf("open %s FAILED!\n", path);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < 12) {
+    close(fd);
+    printf("%s is not a ktx file\n", path);
+    return false;
+  }
+  void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    printf("mmap %s FAILED!\n", path);
+    return false;
+  }
+  ktx->map = map;
+  ktx->map_size = (size_t)st.st_size;
+
+  const uint8_t *p = (const uint8_t *)map;
+  bool ok = false;
+  if (memcmp(p, ktx1_identifier, 12) == 0) {
+    ktx->version = 1;
+    ok = ktx_parse_v1(ktx, p, ktx->map_size);
+  } else if (memcmp(p, ktx2_identifier, 12) == 0) {
+    ktx->version = 2;
+    ok = ktx_parse_v2(ktx, p, ktx->map_size);
+  }
+  // beyond any GL_MAX_TEXTURE_SIZE, and keeps the level sizes from overflowing
+  ok = ok && ktx->width > 0 && ktx->height > 0 && ktx->width <= 65536 && ktx->height <= 65536;
+
+  for (int i = 0; ok && i < ktx->levels; ++i) {
+    ktx_level_t *level = &ktx->level[i];
+    level->width = ktx->width >> i ? ktx->width >> i : 1;
+    level->height = ktx->height >> i ? ktx->height >> i : 1;
+    size_t expected = ktx_level_size(ktx->format, level->width, level->height);
+    if (level->size < expected) {
+      printf("ktx: level %d holds %zu bytes, %ux%u %s needs %zu\n", i, level->size,
+             level->width, level->height, ktx->format->name, expected);
+      ok = false;
+    }
+    level->size = expected;
+  }
+
+  if (!ok) {
+    printf("load ktx %s FAILED!\n", path);
+    CloseKTX(ktx);
+    return false;
+  }
+  return true;
+}
+
+/*    etc2 / eac cpu decoder     */
+
+static const int etc_modifiers[8][4] = {
+  { 2, 8, -2, -8 }, { 5, 17, -5, -17 }, { 9, 29, -9, -29 }, { 13, 42, -13, -42 },
+  { 18, 60, -18, -60 }, { 24, 80, -24, -80 }, { 33, 106, -33, -106 }, { 47, 183, -47, -183 },
+};
+
+static const int etc_distances[8] = { 3, 6, 11, 16, 23, 32, 41, 64 };
+
+static const int eac_modifiers[16][8] = {
+  { -3, -6, -9, -15, 2, 5, 8, 14 }, { -3, -7, -10, -13, 2, 6, 9, 12 },
+  { -2, -5, -8, -13, 1, 4, 7, 12 }, { -2, -4, -6, -13, 1, 3, 5, 12 },
+  { -3, -6, -8, -12, 2, 5, 7, 11 }, { -3, -7, -9, -11, 2, 6, 8, 10 },
+  { -4, -7, -8, -11, 3, 6, 7, 10 }, { -3, -5, -8, -11, 2, 4, 7, 10 },
+  { -2, -6, -8, -10, 1, 5, 7, 9 }, { -2, -5, -8, -10, 1, 4, 7, 9 },
+  { -2, -4, -8, -10, 1, 3, 7, 9 }, { -2, -5, -7, -10, 1, 4, 6, 9 },
+  { -3, -4, -7, -10, 2, 3, 6, 9 }, { -1, -2, -3, -10, 0, 1, 2, 9 },
+  { -4, -6, -8, -9, 3, 5, 7, 8 }, { -3, -5, -7, -9, 2, 4, 6, 8 },
+};
+
+static inline uint8_t etc_clamp(int v)
+{
+  return (uint8_t)(v < 0 ? 0 : v > 255 ? 255 : v);
+}
+
+static inline int etc_extend4(int v) { return (v << 4) | v; }
+static inline int etc_extend5(int v) { return (v << 3) | (v >> 2); }
+static inline int etc_extend6(int v) { return (v << 2) | (v >> 4); }
+static inline int etc_extend7(int v) { return (v << 1) | (v >> 6); }
+
+static inline uint64_t etc_load_block(const uint8_t *src)
+{
+  uint64_t v = 0;
+  for (int i = 0; i < 8; ++i) {
+    v = (v << 8) | src[i];
+  }
+  return v;
+}
+
+static inline int etc_bits(uint64_t block, int high, int count)
+{
+  return (int)((block >> (high - count + 1)) & ((1u << count) - 1));
+}
+
+/*
+ * one 4x4 color block into out (16 RGBA texels, row major). codec picks
+ * ETC1, ETC2 or ETC2 punchthrough; alpha is 255 unless punched out.
+ */
+static void etc_decode_color(const uint8_t *src, ktx_codec_t codec, uint8_t *out)
+{
+  uint64_t block = etc_load_block(src);
+  bool punchthrough = codec == KTX_CODEC_ETC2_RGB_A1;
+  // in punchthrough blocks the diff bit says whether the block is opaque
+  bool diff = punchthrough || etc_bits(block, 33, 1);
+  bool opaque = !punchthrough || etc_bits(block, 33, 1);
+  bool flip = etc_bits(block, 32, 1);
+
+  int paint[4][3];            // T, H and planar modes
+  int base[2][3];             // individual and differential modes
+  int table[2];
+  enum { MODE_SUBBLOCK, MODE_PAINT, MODE_PLANAR } mode = MODE_SUBBLOCK;
+
+  if (!diff) {
+    for (int c = 0; c < 3; ++c) {
+      base[0][c] = etc_extend4(etc_bits(block, 63 - c * 8, 4));
+      base[1][c] = etc_extend4(etc_bits(block, 59 - c * 8, 4));
+    }
+  } else {
+    int c5[3], d3[3], sum[3];
+    for (int c = 0; c < 3; ++c) {
+      c5[c] = etc_bits(block, 63 - c * 8, 5);
+      d3[c] = etc_bits(block, 58 - c * 8, 3);
+      d3[c] = d3[c] >= 4 ? d3[c] - 8 : d3[c];
+      sum[c] = c5[c] + d3[c];
+    }
+
+    if (codec != KTX_CODEC_ETC1 && (sum[0] < 0 || sum[0] > 31)) {
+      // T mode
+      int c1[3] = { (etc_bits(block, 60, 2) << 2) | etc_bits(block, 57, 2), etc_bits(block, 55, 4), etc_bits(block, 51, 4) };
+      int c2[3] = { etc_bits(block, 47, 4), etc_bits(block, 43, 4), etc_bits(block, 39, 4) };
+      int d = etc_distances[(etc_bits(block, 35, 2) << 1) | etc_bits(block, 32, 1)];
+      for (int c = 0; c < 3; ++c) {
+        paint[0][c] = etc_extend4(c1[c]);
+        paint[1][c] = etc_extend4(c2[c]) + d;
+        paint[2][c] = etc_extend4(c2[c]);
+        paint[3][c] = etc_extend4(c2[c]) - d;
+      }
+      mode = MODE_PAINT;
+    } else if (codec != KTX_CODEC_ETC1 && (sum[1] < 0 || sum[1] > 31)) {
+      // H mode
+      int c1[3] = {
+        etc_bits(block, 62, 4),
+        (etc_bits(block, 58, 3) << 1) | etc_bits(block, 52, 1),
+        (etc_bits(block, 51, 1) << 3) | etc_bits(block, 49, 3),
+      };
+      int c2[3] = { etc_bits(block, 46, 4), etc_bits(block, 42, 4), etc_bits(block, 38, 4) };
+      int v1 = 0, v2 = 0;
+      for (int c = 0; c < 3; ++c) {
+        c1[c] = etc_extend4(c1[c]);
+        c2[c] = etc_extend4(c2[c]);
+        v1 = (v1 << 8) | c1[c];
+        v2 = (v2 << 8) | c2[c];
+      }
+      int d = etc_distances[(etc_bits(block, 34, 1) << 2) | (etc_bits(block, 32, 1) << 1) | (v1 >= v2)];
+      for (int c = 0; c < 3; ++c) {
+        paint[0][c] = c1[c] + d;
+        paint[1][c] = c1[c] - d;
+        paint[2][c] = c2[c] + d;
+        paint[3][c] = c2[c] - d;
+      }
+      mode = MODE_PAINT;
+    } else if (codec != KTX_CODEC_ETC1 && (sum[2] < 0 || sum[2] > 31)) {
+      // planar mode: origin, horizontal and vertical colors
+      int o[3] = {
+        etc_extend6(etc_bits(block, 62, 6)),
+        etc_extend7((etc_bits(block, 56, 1) << 6) | etc_bits(block, 54, 6)),
+        etc_extend6((etc_bits(block, 48, 1) << 5) | (etc_bits(block, 44, 2) << 3) | etc_bits(block, 41, 3)),
+      };
+      int h[3] = {
+        etc_extend6((etc_bits(block, 38, 5) << 1) | etc_bits(block, 32, 1)),
+        etc_extend7(etc_bits(block, 31, 7)),
+        etc_extend6(etc_bits(block, 24, 6)),
+      };
+      int v[3] = {
+        etc_extend6(etc_bits(block, 18, 6)),
+        etc_extend7(etc_bits(block, 12, 7)),
+        etc_extend6(etc_bits(block, 5, 6)),
+      };
+      for (int y = 0; y < 4; ++y) {
+        for (int x = 0; x < 4; ++x) {
+          uint8_t *texel = out + (y * 4 + x) * 4;
+          for (int c = 0; c < 3; ++c) {
+            texel[c] = etc_clamp((x * (h[c] - o[c]) + y * (v[c] - o[c]) + 4 * o[c] + 2) >> 2);
+          }
+          texel[3] = 255;
+        }
+      }
+      return;
+    } else {
+      // only ETC1 gets here with an overflow, which wraps like on the GPU
+      for (int c = 0; c < 3; ++c) {
+        base[0][c] = etc_extend5(c5[c]);
+        base[1][c] = etc_extend5(sum[c] & 31);
+      }
+    }
+  }
+  table[0] = etc_bits(block, 39, 3);
+  table[1] = etc_bits(block, 36, 3);
+
+  for (int x = 0; x < 4; ++x) {
+    for (int y = 0; y < 4; ++y) {
+      int i = x * 4 + y;      // indices run down the columns
+      int index = (((int)(block >> (16 + i)) & 1) << 1) | ((int)(block >> i) & 1);
+      uint8_t *texel = out + (y * 4 + x) * 4;
+
+      if (!opaque && index == 2) {
+        texel[0] = texel[1] = texel[2] = texel[3] = 0;
+        continue;
+      }
+      if (mode == MODE_PAINT) {
+        for (int c = 0; c < 3; ++c) {
+          texel[c] = etc_clamp(paint[index][c]);
+        }
+      } else {
+        int sub = flip ? y >= 2 : x >= 2;
+        int modifier = etc_modifiers[table[sub]][index];
+        if (!opaque && (index & 1) == 0) {
+          modifier = 0;
+        }
+        for (int c = 0; c < 3; ++c) {
+          texel[c] = etc_clamp(base[sub][c] + modifier);
+        }
+      }
+      texel[3] = 255;
+    }
+  }
+}
+
+/* one 4x4 EAC channel, 8 bit alpha or the top bits of an unsigned R11 */
+static void eac_decode_channel(const uint8_t *src, bool r11, uint8_t *out, int stride)
+{
+  uint64_t block = etc_load_block(src);
+  int base = etc_bits(block, 63, 8);
+  int multiplier = etc_bits(block, 55, 4);
+  const int *modifiers = eac_modifiers[etc_bits(block, 51, 4)];
+
+  for (int x = 0; x < 4; ++x) {
+    for (int y = 0; y < 4; ++y) {
+      int i = x * 4 + y;
+      int index = etc_bits(block, 47 - i * 3, 3);
+      int value;
+      if (r11) {
+        int m = multiplier ? modifiers[index] * multiplier * 8 : modifiers[index];
+        value = base * 8 + 4 + m;
+        value = value < 0 ? 0 : value > 2047 ? 2047 : value;
+        value = (value * 255 + 1023) / 2047;
+      } else {
+        value = etc_clamp(base + modifiers[index] * multiplier);
+      }
+      out[(y * 4 + x) * stride] = (uint8_t)value;
+    }
+  }
+}
+
+static bool ktx_can_decode(const ktx_format_t *format)
+{
+  return format->codec != KTX_CODEC_ASTC && format->codec != KTX_CODEC_EAC_SIGNED;
+}
+
+/*
+ * decodes one level to tightly packed RGBA8, like GL would sample it: R11
+ * and RG11 come out as (r, 0, 0, 1) and (r, g, 0, 1). false for formats
+ * without a cpu decoder.
+ */
+static bool DecodeKTXLevel(const ktx_t *ktx, int level_index, uint8_t *rgba)
+{
+  const ktx_format_t *format = ktx->format;
+  if (!ktx_can_decode(format)) {
+    return false;
+  }
+  const ktx_level_t *level = &ktx->level[level_index];
+  const uint8_t *src = level->data;
+  uint32_t blocks_x = (level->width + 3) / 4;
+  uint32_t blocks_y = (level->height + 3) / 4;
+  uint8_t texels[16 * 4];
+
+  for (uint32_t by = 0; by < blocks_y; ++by) {
+    for (uint32_t bx = 0; bx < blocks_x; ++bx, src += format->block_bytes) {
+      switch (format->codec) {
+      case KTX_CODEC_ETC2_RGBA:
+        etc_decode_color(src + 8, format->codec, texels);
+        eac_decode_channel(src, false, texels + 3, 4);
+        break;
+      case KTX_CODEC_EAC_R11:
+      case KTX_CODEC_EAC_RG11:
+        memset(texels, 0, sizeof(texels));
+        for (int i = 0; i < 16; ++i) {
+          texels[i * 4 + 3] = 255;
+        }
+        eac_decode_channel(src, true, texels, 4);
+        if (format->codec == KTX_CODEC_EAC_RG11) {
+          eac_decode_channel(src + 8, true, texels + 1, 4);
+        }
+        break;
+      default:
+        etc_decode_color(src, format->codec, texels);
+        break;
+      }
+
+      // blocks on the right and bottom edge may hang over the image
+      uint32_t w = level->width - bx * 4 < 4 ? level->width - bx * 4 : 4;
+      uint32_t h = level->height - by * 4 < 4 ? level->height - by * 4 : 4;
+      for (uint32_t y = 0; y < h; ++y) {
+        uint8_t *dst = rgba + ((size_t)(by * 4 + y) * level->width + bx * 4) * 4;
+        memcpy(dst, texels + y * 16, w * 4);
+      }
+    }
+  }
+  return true;
+}
+
+/*    upload     */
+
+static bool KTXFormatSupported(const ktx_format_t *format)
+{
+  const char *decode = getenv("KEYTOY_KTX_DECODE");
+  if (decode && *decode && strcmp(decode, "0") != 0) {
+    return false;
+  }
+
+  bool es3 = !epoxy_is_desktop_gl() && epoxy_gl_version() >= 30;
+  bool etc2 = es3 || epoxy_has_gl_extension("GL_ARB_ES3_compatibility");
+
+  switch (format->codec) {
+  case KTX_CODEC_ETC1:
+    return etc2 || epoxy_has_gl_extension("GL_OES_compressed_ETC1_RGB8_texture");
+  case KTX_CODEC_ASTC:
+    return epoxy_has_gl_extension("GL_KHR_texture_compression_astc_ldr") ||
+      epoxy_has_gl_extension("GL_OES_texture_compression_astc");
+  default:
+    return etc2;
+  }
+}
+
+/* ETC2 decoders take ETC1 data as is, for GLs without the ETC1 extension */
+static GLenum ktx_upload_format(const ktx_format_t *format)
+{
+  if (format->codec == KTX_CODEC_ETC1 && !epoxy_has_gl_extension("GL_OES_compressed_ETC1_RGB8_texture")) {
+    return GL_COMPRESSED_RGB8_ETC2;
+  }
+  return format->gl_format;
+}
+
+static double ktx_now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+/*
+ * uploads every level into the texture bound to GL_TEXTURE_2D and sets its
+ * filters for the levels present. result may be NULL.
+ */
+static bool UploadKTX(const ktx_t *ktx, ktx_upload_t *result)
+{
+  ktx_upload_t upload;
+  memset(&upload, 0, sizeof(upload));
+  double start = ktx_now_ms();
+
+  upload.compressed = KTXFormatSupported(ktx->format);
+  if (upload.compressed) {
+    GLenum gl_format = ktx_upload_format(ktx->format);
+    while (glGetError() != GL_NO_ERROR) {
+    }
+    for (int i = 0; i < ktx->levels; ++i) {
+      const ktx_level_t *level = &ktx->level[i];
+      glCompressedTexImage2D(GL_TEXTURE_2D, i, gl_format, level->width, level->height, 0,
+                             (GLsizei)level->size, level->data);
+      upload.gpu_bytes += level->size;
+    }
+    GLenum error = glGetError();
+    if (error != GL_NO_ERROR) {
+      printf("ktx: compressed upload of %s FAILED (0x%x)\n", ktx->format->name, error);
+      upload.compressed = false;
+      upload.gpu_bytes = 0;
+    }
+  }
+
+  if (!upload.compressed) {
+    if (!ktx_can_decode(ktx->format)) {
+      printf("ktx: %s is not supported by the GL and has no cpu decoder\n", ktx->format->name);
+      return false;
+    }
+    // level 0 is the largest, one buffer serves all of them
+    uint8_t *rgba = (uint8_t *)malloc((size_t)ktx->level[0].width * ktx->level[0].height * 4);
+    if (!rgba) {
+      return false;
+    }
+    // ES2 takes no sized formats and has sRGB only through GL_EXT_sRGB, else the texels stay encoded
+    GLenum internal_format = ktx->format->srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8;
+    GLenum pixel_format = GL_RGBA;
+    if (!epoxy_is_desktop_gl() && epoxy_gl_version() < 30) {
+      bool srgb = ktx->format->srgb && epoxy_has_gl_extension("GL_EXT_sRGB");
+      internal_format = srgb ? GL_SRGB_ALPHA_EXT : GL_RGBA;
+      pixel_format = internal_format;
+    }
+    for (int i = 0; i < ktx->levels; ++i) {
+      const ktx_level_t *level = &ktx->level[i];
+      DecodeKTXLevel(ktx, i, rgba);
+      glTexImage2D(GL_TEXTURE_2D, i, internal_format, level->width, level->height, 0,
+                   pixel_format, GL_UNSIGNED_BYTE, rgba);
+      upload.gpu_bytes += (size_t)level->width * level->height * 4;
+    }
+    free(rgba);
+  }
+
+  // a partial mip chain is complete once the max level says where it ends, ES2 has no max level
+  bool mipmaps = ktx->levels > 1;
+  if (epoxy_is_desktop_gl() || epoxy_gl_version() >= 30) {
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, ktx->levels - 1);
+  } else {
+    const ktx_level_t *last = &ktx->level[ktx->levels - 1];
+    mipmaps = mipmaps && last->width == 1 && last->height == 1;
+  }
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, mipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+  upload.upload_ms = ktx_now_ms() - start;
+  printf("ktx: %ux%u %s, %d levels, %zu bytes %s in %.2f ms\n", ktx->width, ktx->height, ktx->format->name,
+         ktx->levels, upload.gpu_bytes, upload.compressed ? "compressed" : "decoded", upload.upload_ms);
+  if (result) {
+    *result = upload;
+  }
+  return true;
+}
+
+#endif
@@ -6,13 +6,32 @@
 #include <epoxy/egl.h>
 
 #include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/epoll.h>
 #include <libudev.h>
 #include <libinput.h>
 #include <linux/input.h>
 #include <iostream>
+#include <new>
 
 #include "devices.h"
+#include "pixels.h"
+#include "shaders.h"
+#include "imgui_layer.h"
+#include "textures.h"
+#include "compositor.h"
+#include "startup.h"
+#include "arena.h"
+#include "input_trace.h"
+#include "predictor.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb/stb_image_write.h"
+#include "capture.h"
+#include "metrics.h"
+#include "pipeline.h"
+#include "scheduler.h"
 #include "imgui/imgui.h"
 #include "imgui/backends/imgui_impl_opengl3.h"
 
@@ -46,31 +65,59 @@ const static struct libinput_interface input_interface = {
   .close_restricted = CloseRestricted,
 };
 
-/* opengl origin is bottom-left */
-static const GLfloat V2[] = {
-  0.f, 0.f,  // bottom-left
-  1.f, 0.f,  // bottom-right
-  0.f, 1.f,  // top-left
-  1.f, 1.f,  // top-right
-};
+/* count every c++ heap allocation, see arena.h */
+void *operator new(size_t size)
+{
+  CountAlloc(size);
+  void *ptr = malloc(size ? size : 1);
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
 
-static const GLfloat V3[] = {
-  0.f, 0.f, 0.f,  // bottom-left
-  1.f, 0.f, 0.f,  // bottom-right
-  0.f, 1.f, 0.f,  // top-left
-  1.f, 1.f, 0.f,  // top-right
-};
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
 
-/* image data origin is top-left (difference from opengl is Y-axis)*/
-static const GLfloat T2[] = {
-  0.f, 1.f,  // bottom-left
-  1.f, 1.f,  // bottom-right
-  0.f, 0.f,  // top-left
-  1.f, 0.f,  // top-right
-};
+void operator delete(void *ptr) noexcept
+{
+  if (ptr) {
+    CountFree();
+  }
+  free(ptr);
+}
 
-static const GLuint QUAD_VERTEX_NUM = 4;
+void operator delete[](void *ptr) noexcept
+{
+  operator delete(ptr);
+}
 
+void operator delete(void *ptr, size_t) noexcept
+{
+  operator delete(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+  operator delete(ptr);
+}
+
+/* imgui keeps its buffers across frames, so it gets pools rather than the frame arena */
+static pool_allocator_t imgui_allocator;
+
+static void *ImGuiAlloc(size_t size, void *user_data)
+{
+  return PooledAlloc((pool_allocator_t *)user_data, size);
+}
+
+static void ImGuiFree(void *ptr, void *user_data)
+{
+  PooledFree((pool_allocator_t *)user_data, ptr);
+}
+
+/* positions are in screen pixels, mvp is the screen projection */
 static const char VERTEX_SHADER[] =
   "uniform mat4 mvp;"
   "attribute vec3 a_position;"
@@ -85,101 +132,16 @@ static const char FRAGMENT_SHADER[] =
   "precision mediump float;"
   "varying vec2 v_texcoord;"
   "uniform sampler2D s_texture;"
+  "uniform float u_opacity;"
   "void main(){"
-  "    gl_FragColor = texture2D(s_texture, v_texcoord);"
+  "    gl_FragColor = texture2D(s_texture, v_texcoord) * u_opacity;"
   "}";
 
 
-static void CreateTexture(GLuint *texture_id, GLint width, GLint height,  GLubyte *data)
+static void CreateProgram(canvas_t *canvas, shader_cache_t *shader_cache)
 {
-
-  glGenTextures(1, texture_id);
-
-  glBindTexture(GL_TEXTURE_2D, *texture_id);
-
-  // set filtering mode
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-  // set wrap mode
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-  // load image data
-  if (!data) {
-
-    printf("failed to load image. use pixels replace\n");
-
-    GLubyte pixels[4 * 4] = {
-      255,    0,    0,   255, // red
-      0,    255,    0,   255, // green
-      0,      0,  255,   255, // blue
-      255,  255,    0,   255, // yellow
-    };
-
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-
-    data = pixels;
-    width = 2;
-    height = 2;
-  }
-  // upload texture data
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-  glGenerateMipmap(GL_TEXTURE_2D);
-}
-
-static GLuint LoadShader(const char *source, GLenum type)
-{
-  GLuint shader;
-  GLint compiled;
-
-  shader = glCreateShader(type);
-  glShaderSource(shader, 1, &source, NULL);
-  glCompileShader(shader);
-
-  glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
-  if (!compiled) {
-    GLint infolen = 0;
-    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &infolen);
-    if (infolen > 1) {
-      char *infolog = (char *)malloc(infolen);
-      glGetShaderInfoLog(shader, infolen, NULL, infolog);
-      fprintf(stderr, "Error compiling shader:\n %s \n", infolog);
-      free(infolog);
-    }
-    glDeleteShader(shader);
-    return 0;
-  }
-
-  return shader;
-}
-
-static void CreateProgram(canvas_t *canvas)
-{
-  GLint linked;
-  GLuint vertex_shader;
-  GLuint fragment_shader;
-  assert((vertex_shader = LoadShader(VERTEX_SHADER, GL_VERTEX_SHADER)) != 0);
-  assert((fragment_shader = LoadShader(FRAGMENT_SHADER, GL_FRAGMENT_SHADER)) != 0);
-  assert((canvas->program = glCreateProgram()) != 0);
-  glAttachShader(canvas->program, vertex_shader);
-  glAttachShader(canvas->program, fragment_shader);
-  glLinkProgram(canvas->program);
-  glGetProgramiv(canvas->program, GL_LINK_STATUS, &linked);
-
-  glDeleteShader(vertex_shader);
-  glDeleteShader(fragment_shader);
-
-  if (!linked) {
-    GLint infolen = 0;
-    glGetProgramiv(canvas->program, GL_INFO_LOG_LENGTH, &infolen);
-    if (infolen > 1){
-      char *infolog = (char *)malloc(infolen);
-      glGetProgramInfoLog(canvas->program, infolen, NULL, infolog);
-      fprintf(stderr, "Error linking program:\n %s \n", infolog);
-      free(infolog);
-    }
-    glDeleteProgram(canvas->program);
+  canvas->program = CreateProgramCached(shader_cache, VERTEX_SHADER, FRAGMENT_SHADER);
+  if (!canvas->program) {
     exit(1);
   }
 }
@@ -200,59 +162,31 @@ static void InitGLES(canvas_t *canvas)
   glClearColor(0.45f, 0.55f, 0.6f, 1.f);
 }
 
-static void NewFrame(canvas_t *canvas)
+static void NewFrame(int width, int height)
 {
   ImGuiIO &io = ImGui::GetIO();
-  io.DisplaySize = ImVec2((float)canvas->width, (float)canvas->height);
+  io.DisplaySize = ImVec2((float)width, (float)height);
   io.DisplayFramebufferScale = ImVec2(1.f, 1.f);
-  io.DeltaTime = 1.f / 60.f;
-}
-
-static void RenderCursor(canvas_t *canvas, wlr_xcursor_image *cursor_image, double posx, double posy)
-{
-  glUseProgram(canvas->program);
-
-  glm::mat4 projection = glm::ortho(0.f, 1.f*canvas->width, 0.f, 1.f*canvas->height, -1.f, 1.f);
-  glm::mat4 model = glm::mat4(1.f);
-  model = glm::translate(model, glm::vec3(posx, 1.0*canvas->height - posy - cursor_image->height, 0.f));
-
-  //  model = glm::translate(model, glm::vec3(0.5f*48, 0.5f*48, 0.f));
-
-  model = glm::scale(model, glm::vec3(cursor_image->width, cursor_image->height, 1.f));
-
-  glm::mat4 mvp = projection * model;
-
-  glUniformMatrix4fv(glGetUniformLocation(canvas->program, "mvp"), 1, GL_FALSE, glm::value_ptr(mvp));
- 
-  GLint position = glGetAttribLocation(canvas->program, "a_position");
-  glEnableVertexAttribArray(position);
-  glVertexAttribPointer(position, 3, GL_FLOAT, GL_FALSE, 0, (void *)V3);
-
-  GLint texcoord = glGetAttribLocation(canvas->program, "a_texcoord");
-  glEnableVertexAttribArray(texcoord);
-  glVertexAttribPointer(texcoord, 2, GL_FLOAT, GL_FALSE, 0, (void *)T2);
-
-
-  glEnable(GL_BLEND);
-  glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_2D, canvas->texture_id);
-  glUniform1i(glGetUniformLocation(canvas->program, "s_texture"), 0);
-
-  glDrawArrays(GL_TRIANGLE_STRIP, 0, QUAD_VERTEX_NUM);
-
 }
 
-static void RenderIMGUI(canvas_t *canvas)
+/*
+ * builds the imgui frame when the layer asks for it. returns true when the
+ * output changed; copy then holds it for the render thread, along with the
+ * texture requests in textures. touches no GL, the backend's device objects
+ * were created in StartupGL.
+ */
+static bool RenderIMGUI(ui_layer_t *ui_layer, int width, int height, ImDrawData *copy,
+                        ui_texture_updates_t *textures)
 {
   // Our state
   bool show_demo_window = true;
-  bool show_another_window = false;
-  ImVec4 clear_color = ImVec4(0.45f, 0.55f, 0.60f, 1.00f);
 
-  // Start the Dear ImGui frame
-  ImGui_ImplOpenGL3_NewFrame();
+  if (!BeginUILayerFrame(ui_layer)) {
+    return false;
+  }
 
-  NewFrame(canvas);
+  // Start the Dear ImGui frame
+  NewFrame(width, height);
 
   ImGui::NewFrame();
   ImGui::ShowDemoWindow(&show_demo_window);
@@ -261,13 +195,20 @@ static void RenderIMGUI(canvas_t *canvas)
 
   ImGui::Render();
 
-  ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+  ImDrawData *draw_data = ImGui::GetDrawData();
+  bool textures_changed = CopyTextureUpdates(textures, draw_data);
+  if (!UILayerChanged(ui_layer, draw_data) && !textures_changed) {
+    return false;
+  }
+  // imgui reuses its buffers for the next frame while this one renders
+  CopyDrawData(copy, draw_data);
+  return true;
 }
 
 
-static void Render(canvas_t *canvas)
+static void Render(compositor_t *compositor, layer_t *scene)
 {
-
+  ComposeLayers(compositor, scene);
 }
 
 wlr_xcursor *InitCursor()
@@ -288,170 +229,1047 @@ wlr_xcursor *InitCursor()
 
 }
 
-int main(void)
+typedef struct
+{
+  double cursor_x;
+  double cursor_y;
+  uint32_t screen_width;
+  uint32_t screen_height;
+  int key_count;
+  bool quit;
+  uint32_t frame_events;      // handled since the start of the frame
+
+  predictor_t *predictor;     // NULL unless --predict
+} input_state_t;
+
+/* returns false for events that are not replayable input */
+static bool TranslateInputEvent(struct libinput_event *li_event, const input_state_t *input, input_event_t *event)
 {
-  /*    input     */
-  struct udev *udev = udev_new();
-  struct libinput *li;
-  struct libinput_event *li_event;
   struct libinput_event_keyboard *li_event_kb;
   struct libinput_event_pointer *li_event_pt;
-  libinput_event_type li_event_type = LIBINPUT_EVENT_NONE;
-  uint32_t keycode = 0;
 
-  li = libinput_udev_create_context(&input_interface, NULL, udev);
-  libinput_udev_assign_seat(li, "seat0");
+  memset(event, 0, sizeof(*event));
+
+  switch (libinput_event_get_type(li_event)) {
+  case LIBINPUT_EVENT_KEYBOARD_KEY:
+    if ((li_event_kb = libinput_event_get_keyboard_event(li_event)) == NULL) {
+      return false;
+    }
+    event->type = INPUT_EVENT_KEY;
+    event->time_usec = libinput_event_keyboard_get_time_usec(li_event_kb);
+    event->code = libinput_event_keyboard_get_key(li_event_kb);
+    event->pressed = libinput_event_keyboard_get_key_state(li_event_kb) == LIBINPUT_KEY_STATE_PRESSED;
+    return true;
+
+  case LIBINPUT_EVENT_POINTER_MOTION:
+    if ((li_event_pt = libinput_event_get_pointer_event(li_event)) == NULL) {
+      return false;
+    }
+    event->type = INPUT_EVENT_MOTION;
+    event->time_usec = libinput_event_pointer_get_time_usec(li_event_pt);
+    event->dx = libinput_event_pointer_get_dx(li_event_pt);
+    event->dy = libinput_event_pointer_get_dy(li_event_pt);
+    return true;
+
+  case LIBINPUT_EVENT_POINTER_MOTION_ABSOLUTE:
+    if ((li_event_pt = libinput_event_get_pointer_event(li_event)) == NULL) {
+      return false;
+    }
+    event->type = INPUT_EVENT_MOTION_ABSOLUTE;
+    event->time_usec = libinput_event_pointer_get_time_usec(li_event_pt);
+    event->x = libinput_event_pointer_get_absolute_x_transformed(li_event_pt, input->screen_width);
+    event->y = libinput_event_pointer_get_absolute_y_transformed(li_event_pt, input->screen_height);
+    return true;
+
+  case LIBINPUT_EVENT_POINTER_BUTTON:
+    if ((li_event_pt = libinput_event_get_pointer_event(li_event)) == NULL) {
+      return false;
+    }
+    event->type = INPUT_EVENT_BUTTON;
+    event->time_usec = libinput_event_pointer_get_time_usec(li_event_pt);
+    event->code = libinput_event_pointer_get_button(li_event_pt);
+    event->pressed = libinput_event_pointer_get_button_state(li_event_pt) == LIBINPUT_BUTTON_STATE_PRESSED;
+    return true;
+
+  default:
+    return false;
+  }
+}
 
-  int li_fd = libinput_get_fd(li);
+/* the one place input changes state, live or replayed */
+static void HandleInputEvent(input_state_t *input, const input_event_t *event, ui_layer_t *ui_layer)
+{
+  ImGuiIO &io = ImGui::GetIO();
 
-  /*    input     */
+  input->frame_events++;
+  switch (event->type) {
+  case INPUT_EVENT_KEY: {
+    printf("keycode: %d\n", event->code);
+    if (input->key_count++ > 5){
+      printf("count: %d\n", input->key_count);
+      input->quit = true;
+    }
+  }
+    break;
+  case INPUT_EVENT_MOTION: {
+    input->cursor_x = fmin(input->screen_width, fmax(0, input->cursor_x + event->dx));
+    input->cursor_y = fmin(input->screen_height, fmax(0, input->cursor_y + event->dy));
+    io.AddMousePosEvent((float)input->cursor_x, (float)input->cursor_y);
+    MarkUILayerInput(ui_layer);
+    if (input->predictor) {
+      PredictorMotion(input->predictor, input->cursor_x, input->cursor_y, event->time_usec, InputTraceNow());
+    }
+  }
+    break;
+
+  case INPUT_EVENT_MOTION_ABSOLUTE: {
+    input->cursor_x = event->x;
+    input->cursor_y = event->y;
+    if (input->predictor) {
+      PredictorMotion(input->predictor, input->cursor_x, input->cursor_y, event->time_usec, InputTraceNow());
+    }
+  }
+    break;
+
+  case INPUT_EVENT_BUTTON: {
+    int code = 0;
+    switch (event->code) {
+    case BTN_LEFT:
+      code = 0;
+      break;
+    case BTN_RIGHT:
+      code = 1;
+      break;
+    case BTN_MIDDLE:
+      code = 2;
+      break;
+    }
+    io.AddMouseButtonEvent(code, event->pressed);
+    MarkUILayerInput(ui_layer);
+    std::cout << "button: " << event->code << ", is_pressed: " << event->pressed << std::endl;
+  }
+    break;
+
+  default:
+    break;
+  }
+}
+
+typedef struct
+{
+  const char *record_path;
+  const char *replay_path;
+  double replay_speed;        // 0 replays as fast as frames render
+  bool predict;
+  const char *capture_dir;    // capture is off without it
+  capture_format_t capture_format;
+  int capture_frames;         // recorded from the start, and per SIGUSR2
+  bool single_thread;         // render on the main thread, see pipeline.h
+  size_t texture_budget;      // bytes, see textures.h
+  bool late_render;           // start frames just in time for the vblank, see scheduler.h
+  double late_margin_usec;
+  const char *yuv_path;       // raw video shown behind the ui, see yuv.h
+  yuv_format_t yuv_format;
+  int yuv_matrix;             // yuv_matrix_t, -1 picks by height
+  yuv_range_t yuv_range;
+  int yuv_width;
+  int yuv_height;
+} options_t;
+
+static void Usage(const char *argv0)
+{
+  printf("usage: %s [--record FILE | --replay FILE [--replay-speed X]] [--predict]\n"
+         "          [--capture-dir DIR [--capture-format raw|y4m|png] [--capture-frames N]] [--single-thread]\n"
+         "          [--texture-budget MB] [--late-render [--late-margin MS]]\n"
+         "          [--yuv FILE --yuv-size WxH [--yuv-format nv12|i420]\n"
+         "          [--yuv-matrix bt601|bt709] [--yuv-range limited|full]]\n"
+         "  --record FILE        write processed input events to FILE\n"
+         "  --replay FILE        feed input from FILE instead of input devices\n"
+         "  --replay-speed X     1 original timing (default), 2 twice as fast, 0 one recorded frame per frame\n"
+         "  --predict            draw the cursor where the pointer will be at scanout\n"
+         "  --capture-dir DIR    enable capture: SIGUSR1 saves a screenshot, SIGUSR2 records N frames\n"
+         "  --capture-format F   recording format, y4m (default), raw rgb24 or png per frame\n"
+         "  --capture-frames N   record the first N frames (default 0; SIGUSR2 records 300 if 0)\n"
+         "  --single-thread      build and render frames on the main thread\n"
+         "  --texture-budget MB  GPU memory for images before the least recently used are evicted (default 64)\n"
+         "  --late-render        sleep until just before the vblank, then sample input and render\n"
+         "  --late-margin MS     safety margin on top of the learned frame time (default 1)\n"
+         "  --yuv FILE           show raw frames from a fifo, a pipe, - for stdin, or a file (looped),\n"
+         "                       e.g. in /dev/shm\n"
+         "  --yuv-size WxH       frame size of the yuv stream\n"
+         "  --yuv-format F       nv12 (default) or i420\n"
+         "  --yuv-matrix M       bt601 or bt709 (default bt601 below 720 lines, bt709 above)\n"
+         "  --yuv-range R        limited (default, 16..235) or full (jpeg, most webcams)\n",
+         argv0);
+}
+
+static void ParseOptions(int argc, char **argv, options_t *options)
+{
+  static const struct option long_options[] = {
+    { "record",       required_argument, NULL, 'r' },
+    { "replay",       required_argument, NULL, 'p' },
+    { "replay-speed", required_argument, NULL, 's' },
+    { "predict",      no_argument,       NULL, 'm' },
+    { "capture-dir",    required_argument, NULL, 'c' },
+    { "capture-format", required_argument, NULL, 'f' },
+    { "capture-frames", required_argument, NULL, 'n' },
+    { "single-thread",  no_argument,       NULL, 't' },
+    { "texture-budget", required_argument, NULL, 'b' },
+    { "late-render",    no_argument,       NULL, 'l' },
+    { "late-margin",    required_argument, NULL, 'g' },
+    { "yuv",            required_argument, NULL, 'y' },
+    { "yuv-size",       required_argument, NULL, 'z' },
+    { "yuv-format",     required_argument, NULL, 'u' },
+    { "yuv-matrix",     required_argument, NULL, 'x' },
+    { "yuv-range",      required_argument, NULL, 'e' },
+    { "help",         no_argument,       NULL, 'h' },
+    { NULL, 0, NULL, 0 },
+  };
+
+  memset(options, 0, sizeof(*options));
+  options->replay_speed = 1.0;
+  options->capture_format = CAPTURE_FORMAT_Y4M;
+  options->texture_budget = (size_t)64 << 20;
+  options->late_margin_usec = 1000.0;
+  options->yuv_matrix = -1;
+
+  int c;
+  while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+    switch (c) {
+    case 'r':
+      options->record_path = optarg;
+      break;
+    case 'p':
+      options->replay_path = optarg;
+      break;
+    case 's':
+      options->replay_speed = atof(optarg);
+      break;
+    case 'm':
+      options->predict = true;
+      break;
+    case 'c':
+      options->capture_dir = optarg;
+      break;
+    case 'f': {
+      int format = ParseCaptureFormat(optarg);
+      if (format < 0) {
+        Usage(argv[0]);
+        exit(1);
+      }
+      options->capture_format = (capture_format_t)format;
+    }
+      break;
+    case 'n':
+      options->capture_frames = atoi(optarg);
+      break;
+    case 't':
+      options->single_thread = true;
+      break;
+    case 'b':
+      options->texture_budget = (size_t)(atof(optarg) * (1 << 20));
+      break;
+    case 'l':
+      options->late_render = true;
+      break;
+    case 'g':
+      options->late_margin_usec = atof(optarg) * 1e3;
+      break;
+    case 'y':
+      options->yuv_path = optarg;
+      break;
+    case 'z':
+      if (sscanf(optarg, "%dx%d", &options->yuv_width, &options->yuv_height) != 2 ||
+          options->yuv_width <= 0 || options->yuv_height <= 0) {
+        Usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'u':
+      if (strcmp(optarg, "nv12") == 0) {
+        options->yuv_format = YUV_FORMAT_NV12;
+      } else if (strcmp(optarg, "i420") == 0) {
+        options->yuv_format = YUV_FORMAT_I420;
+      } else {
+        Usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'x':
+      if (strcmp(optarg, "bt601") == 0) {
+        options->yuv_matrix = YUV_MATRIX_BT601;
+      } else if (strcmp(optarg, "bt709") == 0) {
+        options->yuv_matrix = YUV_MATRIX_BT709;
+      } else {
+        Usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'e':
+      if (strcmp(optarg, "limited") == 0) {
+        options->yuv_range = YUV_RANGE_LIMITED;
+      } else if (strcmp(optarg, "full") == 0) {
+        options->yuv_range = YUV_RANGE_FULL;
+      } else {
+        Usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'h':
+      Usage(argv[0]);
+      exit(0);
+    default:
+      Usage(argv[0]);
+      exit(1);
+    }
+  }
+  if (options->yuv_path && options->yuv_width == 0) {
+    Usage(argv[0]);
+    exit(1);
+  }
+  // sd sources are usually bt.601, hd bt.709
+  if (options->yuv_matrix < 0) {
+    options->yuv_matrix = options->yuv_height < 720 ? YUV_MATRIX_BT601 : YUV_MATRIX_BT709;
+  }
+}
+
+static volatile sig_atomic_t screenshot_requested = 0;
+static volatile sig_atomic_t recording_requested = 0;
+
+static void CaptureSignal(int sig)
+{
+  if (sig == SIGUSR1) {
+    screenshot_requested = 1;
+  } else {
+    recording_requested = 1;
+  }
+}
+
+/* drains the monitor, true if any drm device reported a hotplug */
+static bool ReceiveHotplug(struct udev_monitor *monitor)
+{
+  bool hotplug = false;
+  struct udev_device *dev;
+  while ((dev = udev_monitor_receive_device(monitor))) {
+    const char *value = udev_device_get_property_value(dev, "HOTPLUG");
+    if (value && strcmp(value, "1") == 0) {
+      hotplug = true;
+    }
+    udev_device_unref(dev);
+  }
+  return hotplug;
+}
+
+typedef struct
+{
+  const options_t *options;
+
+  struct udev *udev;
+  struct libinput *li;
+  int li_fd;
+  int epoll_fd;
+  struct udev_monitor *drm_monitor;
+  int drm_monitor_fd;
+
+  device_t render_device;
+  canvas_t render_context;
+  wlr_xcursor_image *cursor_image;
+
+  shader_cache_t shader_cache;
+  ui_layer_t ui_layer;
+} startup_state_t;
+
+static void StartupInput(void *arg)
+{
+  startup_state_t *s = (startup_state_t *)arg;
+
+  s->epoll_fd = epoll_create(1);
+  s->udev = udev_new();
 
   /*    epoll event     */
-  struct epoll_event ep, ep_events[32];
-  int epoll_fd = epoll_create(1);
+  struct epoll_event ep;
+
+  // connector hotplug
+  s->drm_monitor = udev_monitor_new_from_netlink(s->udev, "udev");
+  udev_monitor_filter_add_match_subsystem_devtype(s->drm_monitor, "drm", "drm_minor");
+  udev_monitor_enable_receiving(s->drm_monitor);
+  s->drm_monitor_fd = udev_monitor_get_fd(s->drm_monitor);
+
+  memset(&ep, 0, sizeof(ep));
+  ep.events = EPOLLIN;
+  ep.data.fd = s->drm_monitor_fd;
+  if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->drm_monitor_fd, &ep) < 0){
+    printf("epoll_ctl FAILED!\n");
+  }
+
+  // replaying needs no input devices at all
+  if (s->options->replay_path) {
+    return;
+  }
+
+  s->li = libinput_udev_create_context(&input_interface, NULL, s->udev);
+  libinput_udev_assign_seat(s->li, "seat0");
+
+  s->li_fd = libinput_get_fd(s->li);
 
   memset(&ep, 0, sizeof(ep));
   ep.events = EPOLLIN;
-  ep.data.fd = li_fd;
+  ep.data.fd = s->li_fd;
 
-  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, li_fd, &ep) < 0){
+  if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->li_fd, &ep) < 0){
     printf("epoll_ctl FAILED!\n");
   }
+}
 
-  /*    epoll event     */
+static void StartupDevice(void *arg)
+{
+  startup_state_t *s = (startup_state_t *)arg;
+  CreateRenderDevice(&s->render_device);
+}
 
-  /*    render     */
-  device_t render_device;
-  CreateRenderDevice(&render_device);
+static void StartupContext(void *arg)
+{
+  startup_state_t *s = (startup_state_t *)arg;
+  CreateRenderContext(&s->render_device, &s->render_context);
 
-  canvas_t render_context;
-  CreateRenderContext(&render_device, &render_context);
+  // created on a worker, released so the main thread can take it
+  eglMakeCurrent(s->render_context.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+}
+
+static void StartupCursor(void *arg)
+{
+  startup_state_t *s = (startup_state_t *)arg;
 
   wlr_xcursor *cursor = InitCursor();
-  struct wlr_xcursor_image *cursor_image = cursor->images[0];
-  if (!cursor_image) {
-    printf("load cursor images FAILED!\n");
+  s->cursor_image = cursor ? cursor->images[0] : NULL;
+  if (!s->cursor_image) {
+    printf("load cursor images FAILED! running without a cursor\n");
   }
+}
+
+static void StartupImGui(void *arg)
+{
+  InitPoolAllocator(&imgui_allocator);
+  ImGui::SetAllocatorFunctions(ImGuiAlloc, ImGuiFree, &imgui_allocator);
 
   IMGUI_CHECKVERSION();
   ImGui::CreateContext();
-  ImGuiIO& io = ImGui::GetIO();
 
   // Setup Dear ImGui style
   ImGui::StyleColorsDark();
+}
+
+static void StartupGL(void *arg)
+{
+  startup_state_t *s = (startup_state_t *)arg;
+  canvas_t *canvas = &s->render_context;
+
+  EGLBoolean current = eglMakeCurrent(canvas->display, canvas->surface, canvas->surface, canvas->context);
+  assert(current == EGL_TRUE);
+  (void)current;
 
   ImGui_ImplOpenGL3_Init("#version 300 es");
+  // creates the backend's GL objects while this thread holds the context
+  ImGui_ImplOpenGL3_NewFrame();
+
+  InitGLES(canvas);
+
+  InitShaderCache(&s->shader_cache, NULL);
+  CreateProgram(canvas, &s->shader_cache);
+  PrintShaderCacheStats(&s->shader_cache);
+
+  CreateUILayer(&s->ui_layer, canvas->width, canvas->height);
+}
+
+/* texture manager callback for the cursor */
+static bool LoadCursorImage(void *user_data, uint8_t *rgba, size_t stride)
+{
+  const wlr_xcursor_image *image = (const wlr_xcursor_image *)user_data;
+  // xcursor pixels are premultiplied ARGB8888, only the byte order differs from GL_RGBA
+  return ConvertPixels(rgba, stride, PIXEL_FORMAT_RGBA8888, image->buffer, 0, PIXEL_FORMAT_BGRA8888,
+                       image->width, image->height, PIXEL_CONVERT_NONE) == 0;
+}
+
+/* everything the render thread needs to draw one frame */
+typedef struct
+{
+  uint64_t frame_start_usec;
+  uint64_t predict_usec;      // when the cursor was predicted, 0 without prediction
+  uint64_t submit_usec;       // start of swap, set by the render thread, 0 if not drawn
+  uint64_t present_usec;      // end of swap, set by the render thread
+  frame_deadline_t deadline;
+  bool missed_deadline;       // set by the render thread
+  double cursor_x;
+  double cursor_y;
+
+  bool ui_changed;            // draw_data holds a new ui frame
+  ImDrawData draw_data;       // copy, see CopyDrawData
+  ui_texture_updates_t textures; // applied even when the ui did not change
+  bool yuv_changed;           // yuv_frame holds a new frame
+  uint8_t *yuv_frame;         // packed, swapped with the reader's buffers, see ReadYUVFrame
+
+  bool hotplug;
+  bool screenshot;
+  int record_frames;          // start recording this many frames
+  uint32_t input_events;
+} frame_packet_t;
+
+/* owned by the render thread once the pipeline runs */
+typedef struct
+{
+  device_t *device;
+  canvas_t *canvas;
+  ui_layer_t *ui_layer;
+  layer_t *scene;
+  layer_t *ui_surface;
+  layer_t *cursor_surface;    // NULL without a cursor theme
+  layer_t *yuv_surface;       // NULL without --yuv
+  yuv_surface_t *yuv;
+  texture_manager_t *textures;
+  compositor_t *compositor;
+  arena_t *frame_arena;
+  alloc_tracker_t *alloc_tracker;
+  capture_t *capture;         // NULL unless capturing
+  metrics_t *metrics;
+  startup_t *startup;
+
+  metrics_frame_t frame_metrics;
+  uint64_t last_swap_usec;
+
+  // output as last configured, read by the main thread
+  pthread_mutex_t output_lock;
+  int width;
+  int height;
+  bool connected;
+  uint32_t crtc_pipe;
+  double refresh_period_usec;
+  uint32_t generation;        // bumped on every change
+} render_state_t;
+
+static uint64_t TextureBytes(const ui_layer_t *ui_layer, const texture_manager_t *textures)
+{
+  return (uint64_t)ui_layer->width * ui_layer->height * 4 + TextureManagerBytes(textures);
+}
+
+/* returns the generation, the output fields are only valid when it moved */
+static uint32_t ReadOutputState(render_state_t *r, int *width, int *height, bool *connected,
+                                uint32_t *crtc_pipe, double *refresh_period_usec)
+{
+  pthread_mutex_lock(&r->output_lock);
+  *width = r->width;
+  *height = r->height;
+  *connected = r->connected;
+  *crtc_pipe = r->crtc_pipe;
+  *refresh_period_usec = r->refresh_period_usec;
+  uint32_t generation = r->generation;
+  pthread_mutex_unlock(&r->output_lock);
+  return generation;
+}
+
+/* scales the video to the output, keeping its aspect, and centers it */
+static void FitVideoLayer(layer_t *layer, int width, int height)
+{
+  float scale = fminf((float)width / layer->width, (float)height / layer->height);
+  layer->scale = glm::vec2(scale, scale);
+  layer->position = glm::vec2((width - layer->width * scale) * 0.5f, (height - layer->height * scale) * 0.5f);
+}
+
+/* rebuilds the output and whatever follows its size, GPU resources are kept */
+static void ApplyHotplug(render_state_t *r)
+{
+  uint64_t start_usec = InputTraceNow();
+  output_change_t change = ReconfigureOutput(r->device, r->canvas);
+  if (change == OUTPUT_UNCHANGED) {
+    return;
+  }
+
+  canvas_t *canvas = r->canvas;
+  if (change == OUTPUT_CHANGED) {
+    if (r->ui_layer->width != canvas->width || r->ui_layer->height != canvas->height) {
+      ResizeUILayer(r->ui_layer, canvas->width, canvas->height);
+      SetLayerSurface(r->ui_surface, r->ui_layer->texture, r->ui_layer->width, r->ui_layer->height, false);
+    }
+    r->compositor->width = canvas->width;
+    r->compositor->height = canvas->height;
+    if (r->yuv_surface) {
+      FitVideoLayer(r->yuv_surface, canvas->width, canvas->height);
+    }
+    if (r->capture && !ResizeCapture(r->capture, canvas->width, canvas->height,
+                                     r->device->crtc_p->mode.vrefresh)) {
+      // torn down with the rest at exit
+      printf("capture: off after the output change\n");
+      r->capture = NULL;
+    }
+
+    if (r->metrics->segment) {
+      BeginMetricsUpdate(r->metrics)->refresh_hz = r->device->crtc_p->mode.vrefresh;
+      EndMetricsUpdate(r->metrics);
+    }
+    r->last_swap_usec = 0;
+    printf("output: reconfigured in %.2f ms\n", (InputTraceNow() - start_usec) * 1e-3);
+  } else {
+    printf("output: disconnected, waiting for a connector\n");
+  }
+
+  pthread_mutex_lock(&r->output_lock);
+  r->width = canvas->width;
+  r->height = canvas->height;
+  r->connected = r->device->connected;
+  if (r->connected) {
+    r->crtc_pipe = CrtcPipe(r->device->drm_fd, r->device->crtc_p->crtc_id);
+    r->refresh_period_usec = ModeRefreshPeriodUsec(&r->device->crtc_p->mode);
+  }
+  r->generation++;
+  pthread_mutex_unlock(&r->output_lock);
+}
+
+static void RenderBegin(void *ctx, void *packet)
+{
+  render_state_t *r = (render_state_t *)ctx;
+  EGLBoolean current = eglMakeCurrent(r->canvas->display, r->canvas->surface, r->canvas->surface,
+                                      r->canvas->context);
+  assert(current == EGL_TRUE);
+  (void)current;
+}
+
+static void RenderEnd(void *ctx, void *packet)
+{
+  render_state_t *r = (render_state_t *)ctx;
+  eglMakeCurrent(r->canvas->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+}
+
+static void RenderFramePacket(void *ctx, void *arg)
+{
+  render_state_t *r = (render_state_t *)ctx;
+  frame_packet_t *packet = (frame_packet_t *)arg;
+
+  ResetArena(r->frame_arena);
+
+  if (packet->hotplug) {
+    ApplyHotplug(r);
+  }
+  // imgui already counts these as done, so they are applied even when nothing is drawn
+  ApplyTextureUpdates(&packet->textures);
+  // nothing to draw on while unplugged
+  if (!r->device->connected) {
+    return;
+  }
+
+  if (packet->ui_changed) {
+    RedrawUILayer(r->ui_layer, &packet->draw_data);
+  }
+  if (packet->yuv_changed) {
+    yuv_image_t image;
+    PackedYUVImage(&image, r->yuv->format, r->yuv->width, r->yuv->height, packet->yuv_frame);
+    UploadYUV(r->yuv, &image);
+  }
+
+  glClear(GL_COLOR_BUFFER_BIT);
+  if (r->cursor_surface) {
+    r->cursor_surface->position = glm::vec2(packet->cursor_x, packet->cursor_y);
+  }
+  Render(r->compositor, r->scene);
+  if (r->capture) {
+    if (packet->screenshot) {
+      RequestScreenshot(r->capture);
+    }
+    if (packet->record_frames > 0) {
+      StartRecording(r->capture, packet->record_frames);
+    }
+    CaptureFrame(r->capture);
+  }
+  packet->submit_usec = InputTraceNow();
+  SwapBuffer(r->device, r->canvas);
+  // the swap returned with the frame latched, see scheduler.h
+  packet->missed_deadline = false;
+  uint32_t latched;
+  if (packet->deadline.scheduled && !packet->hotplug &&
+      ReadLastVBlank(r->device->drm_fd, r->crtc_pipe, &latched, NULL)) {
+    packet->missed_deadline = DeadlineMissed(&packet->deadline, latched);
+  }
+  if (r->capture) {
+    CaptureScanout(r->capture, r->device->previous_bo);
+  }
+  packet->present_usec = InputTraceNow();
+  MarkFirstFrame(r->startup);
+
+  metrics_frame_t *frame_metrics = &r->frame_metrics;
+  frame_metrics->now_usec = packet->present_usec;
+  frame_metrics->frame_usec = frame_metrics->now_usec - packet->frame_start_usec;
+  frame_metrics->present_interval_usec = r->last_swap_usec ? frame_metrics->now_usec - r->last_swap_usec : 0;
+  frame_metrics->input_events = packet->input_events;
+  frame_metrics->texture_bytes = TextureBytes(r->ui_layer, r->textures);
+  frame_metrics->deadline = packet->deadline.scheduled;
+  frame_metrics->missed_deadline = packet->missed_deadline;
+  frame_metrics->deadline_lead_usec = packet->deadline.lead_usec;
+  frame_metrics->surfaces_culled = r->compositor->frame.culled;
+  frame_metrics->pixels_opaque = r->compositor->frame.pixels_opaque;
+  frame_metrics->pixels_blended = r->compositor->frame.pixels_blended;
+  PublishFrameMetrics(r->metrics, frame_metrics);
+  r->last_swap_usec = frame_metrics->now_usec;
+
+  EndAllocFrame(r->alloc_tracker, r->frame_arena);
+}
+
+int main(int argc, char **argv)
+{
+  startup_t startup;
+  InitStartup(&startup);
+
+  options_t options;
+  ParseOptions(argc, argv, &options);
+
+  /*    startup     */
+  startup_state_t state;
+  memset(&state, 0, sizeof(state));
+  state.options = &options;
+
+  // input, drm and the cursor theme do not depend on each other
+  AddStartupTask(&startup, "input", StartupInput, &state, 0, false);
+  int device_task = AddStartupTask(&startup, "drm/gbm", StartupDevice, &state, 0, false);
+  int context_task = AddStartupTask(&startup, "egl", StartupContext, &state, 1u << device_task, false);
+  int cursor_task = AddStartupTask(&startup, "cursor", StartupCursor, &state, 0, false);
+  int imgui_task = AddStartupTask(&startup, "imgui", StartupImGui, &state, 0, false);
+  AddStartupTask(&startup, "gl", StartupGL, &state,
+                 (1u << context_task) | (1u << cursor_task) | (1u << imgui_task), true);
+
+  RunStartup(&startup);
+  /*    startup     */
+
+  /*    input     */
+  struct libinput *li = state.li;
+  struct libinput_event *li_event;
+  input_event_t event;
+
+  struct epoll_event ep_events[32];
+  int epoll_fd = state.epoll_fd;
+  /*    input     */
 
-  InitGLES(&render_context);
-  CreateProgram(&render_context);
-  CreateTexture(&(render_context.texture_id), cursor_image->width, cursor_image->height, cursor_image->buffer);
+  /*    render     */
+  device_t &render_device = state.render_device;
+  canvas_t &render_context = state.render_context;
+  wlr_xcursor_image *cursor_image = state.cursor_image;
+  ui_layer_t &ui_layer = state.ui_layer;
+
+  arena_t frame_arena;
+  InitArena(&frame_arena, 64 * 1024);
+
+  // images are loaded when first drawn and evicted over budget
+  texture_manager_t textures;
+  InitTextureManager(&textures, options.texture_budget);
+
+  // programs are built on the render thread when a yuv layer is first drawn
+  yuv_renderer_t yuv_renderer;
+  InitYUVRenderer(&yuv_renderer, &state.shader_cache);
+
+  compositor_t compositor;
+  CreateCompositor(&compositor, render_context.program, render_context.width, render_context.height,
+                   &frame_arena, &textures, &yuv_renderer);
+
+  // scene: video below, imgui above it, cursor on top. the clear color is the background
+  layer_t *scene = CreateLayer("scene", NULL, 0);
+  layer_t *ui_surface = CreateLayer("imgui", scene, 0);
+  SetLayerSurface(ui_surface, ui_layer.texture, ui_layer.width, ui_layer.height, false);
+  // no cursor theme, no cursor layer
+  layer_t *cursor_surface = NULL;
+  if (cursor_image) {
+    cursor_surface = CreateLayer("cursor", scene, 100);
+    int cursor_id = AddImage(&textures, "cursor", cursor_image->width, cursor_image->height, LoadCursorImage,
+                             cursor_image);
+    SetLayerImage(cursor_surface, cursor_id, cursor_image->width, cursor_image->height, true);
+  }
+  yuv_reader_t yuv_reader;
+  yuv_surface_t yuv;
+  layer_t *yuv_surface = NULL;
+  if (options.yuv_path) {
+    if (!OpenYUVReader(&yuv_reader, options.yuv_path, options.yuv_format, options.yuv_width, options.yuv_height)) {
+      return 1;
+    }
+    InitYUVSurface(&yuv, options.yuv_format, options.yuv_width, options.yuv_height,
+                   (yuv_matrix_t)options.yuv_matrix, options.yuv_range);
+    yuv_surface = CreateLayer("video", scene, -1);
+    SetLayerYUV(yuv_surface, &yuv);
+    FitVideoLayer(yuv_surface, render_context.width, render_context.height);
+  }
   /*    render     */
 
-  bool is_need_quit = false;
-  int count = 0;
   int event_count = 0;
 
-  uint32_t screen_width = render_device.default_fb_width;
-  uint32_t screen_height = render_device.default_fb_height;
+  input_state_t input;
+  memset(&input, 0, sizeof(input));
+  input.screen_width = render_device.default_fb_width;
+  input.screen_height = render_device.default_fb_height;
+  input.cursor_x = input.screen_width * 0.5;
+  input.cursor_y = input.screen_height * 0.5;
+
+  predictor_t predictor;
+  if (options.predict) {
+    InitPredictor(&predictor, render_device.crtc_p->mode.vrefresh);
+    input.predictor = &predictor;
+  }
 
-  double cursor_posx = screen_width * 0.5;
-  double cursor_posy = screen_height * 0.5;
+  input_recorder_t recorder;
+  memset(&recorder, 0, sizeof(recorder));
+  if (options.record_path) {
+    OpenInputRecorder(&recorder, options.record_path, input.screen_width, input.screen_height);
+  }
+
+  input_replay_t replay;
+  memset(&replay, 0, sizeof(replay));
+  if (options.replay_path) {
+    if (!OpenInputReplay(&replay, options.replay_path, options.replay_speed)) {
+      return 1;
+    }
+    if (replay.screen_width != input.screen_width || replay.screen_height != input.screen_height) {
+      printf("input trace was recorded at %ux%u, screen is %ux%u\n", replay.screen_width, replay.screen_height,
+             input.screen_width, input.screen_height);
+    }
+  }
+
+  capture_t capture;
+  bool capturing = false;
+  if (options.capture_dir) {
+    capturing = InitCapture(&capture, options.capture_dir, options.capture_format,
+                            render_context.width, render_context.height, render_device.crtc_p->mode.vrefresh);
+  }
+  if (capturing) {
+    StartRecording(&capture, options.capture_frames);
+    signal(SIGUSR1, CaptureSignal);
+    signal(SIGUSR2, CaptureSignal);
+  }
+
+  alloc_tracker_t alloc_tracker;
+  InitAllocTracker(&alloc_tracker);
+
+  // read with tools/keytoy_stat
+  metrics_t metrics;
+  OpenMetrics(&metrics, NULL, render_device.crtc_p->mode.vrefresh);
+
+  render_state_t render_state;
+  memset(&render_state, 0, sizeof(render_state));
+  render_state.device = &render_device;
+  render_state.canvas = &render_context;
+  render_state.ui_layer = &ui_layer;
+  render_state.scene = scene;
+  render_state.ui_surface = ui_surface;
+  render_state.cursor_surface = cursor_surface;
+  render_state.yuv_surface = yuv_surface;
+  render_state.yuv = &yuv;
+  render_state.textures = &textures;
+  render_state.compositor = &compositor;
+  render_state.frame_arena = &frame_arena;
+  render_state.alloc_tracker = &alloc_tracker;
+  render_state.capture = capturing ? &capture : NULL;
+  render_state.metrics = &metrics;
+  render_state.startup = &startup;
+  pthread_mutex_init(&render_state.output_lock, NULL);
+  render_state.width = render_context.width;
+  render_state.height = render_context.height;
+  render_state.connected = render_device.connected;
+  if (render_device.connected) {
+    render_state.crtc_pipe = CrtcPipe(render_device.drm_fd, render_device.crtc_p->crtc_id);
+    render_state.refresh_period_usec = ModeRefreshPeriodUsec(&render_device.crtc_p->mode);
+  }
+
+  // main thread view of the output
+  uint32_t output_generation = 0;
+  int output_width = render_context.width;
+  int output_height = render_context.height;
+  bool output_connected = render_device.connected;
+  uint32_t output_pipe = render_state.crtc_pipe;
+  double output_period_usec = render_state.refresh_period_usec;
+
+  frame_scheduler_t scheduler;
+  InitFrameScheduler(&scheduler, render_device.drm_fd, options.late_margin_usec);
+  SetSchedulerOutput(&scheduler, output_pipe, output_connected ? output_period_usec : 0.0);
+
+  // from here on only the render thread touches GL
+  frame_packet_t packets[2] = {};
+  frame_pipeline_t pipeline;
+  if (!options.single_thread) {
+    eglMakeCurrent(render_context.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  }
+  InitFramePipeline(&pipeline, !options.single_thread, &packets[0], &packets[1], &render_state,
+                    RenderBegin, RenderFramePacket, RenderEnd);
 
   // loop
-  while(!is_need_quit) {
+  while(!input.quit) {
 
-    event_count = epoll_wait(epoll_fd, ep_events, ARRAY_LENGTH(ep_events), 0);
+    frame_packet_t *packet = (frame_packet_t *)AcquireFramePacket(&pipeline);
+    // the packet came back from the render thread, its frame is on screen
+    if (input.predictor && packet->predict_usec && packet->present_usec) {
+      PredictorPresent(input.predictor, packet->predict_usec, packet->present_usec);
+    }
+    if (options.late_render && packet->submit_usec) {
+      SchedulerPresent(&scheduler, &packet->deadline, packet->frame_start_usec, packet->submit_usec,
+                       packet->missed_deadline);
+    }
+    packet->predict_usec = 0;
+    packet->submit_usec = 0;
+    packet->present_usec = 0;
+    ReleaseTextureUpdates(&packet->textures);
+    input.frame_events = 0;
+
+    uint32_t generation = ReadOutputState(&render_state, &output_width, &output_height, &output_connected,
+                                          &output_pipe, &output_period_usec);
+    if (generation != output_generation) {
+      output_generation = generation;
+      input.screen_width = output_width;
+      input.screen_height = output_height;
+      input.cursor_x = fmin(input.screen_width, input.cursor_x);
+      input.cursor_y = fmin(input.screen_height, input.cursor_y);
+      InvalidateUILayer(&ui_layer);
+      SetSchedulerOutput(&scheduler, output_pipe, output_connected ? output_period_usec : 0.0);
+    }
 
-    libinput_dispatch(li);
-    while ((li_event = libinput_get_event(li))) {
-      li_event_type = libinput_event_get_type(li_event);
-      printf("event_type: %d\n", li_event_type);
+    // input is sampled from here on, so sleep first
+    memset(&packet->deadline, 0, sizeof(packet->deadline));
+    if (options.late_render && output_connected) {
+      WaitForRenderDeadline(&scheduler, &packet->deadline);
+    }
+    packet->frame_start_usec = InputTraceNow();
 
-      switch (li_event_type) {
-      case LIBINPUT_EVENT_DEVICE_ADDED: {
-        struct libinput_device *dev = libinput_event_get_device(li_event);
-        const char *name = libinput_device_get_name(dev);
-        printf("Found Input Device: %s.\n", name);
-      }
-        break;
-      case LIBINPUT_EVENT_KEYBOARD_KEY: {
-        if ( (li_event_kb = libinput_event_get_keyboard_event(li_event)) != NULL){
-          keycode = libinput_event_keyboard_get_key(li_event_kb);
-          printf("keycode: %d\n", keycode);
-          if (count++ > 5){
-            printf("count: %d\n", count);
-            is_need_quit = true;
-          }
-        }
-      }
-        break;
-      case LIBINPUT_EVENT_POINTER_MOTION: {
-        if ((li_event_pt = libinput_event_get_pointer_event(li_event)) != NULL) {
-          double cursor_posx_dx = libinput_event_pointer_get_dx(li_event_pt);
-          double cursor_posy_dy = libinput_event_pointer_get_dy(li_event_pt);
-
-          cursor_posx = fmin(screen_width, fmax(0, cursor_posx + cursor_posx_dx));
-          cursor_posy = fmin(screen_height, fmax(0, cursor_posy + cursor_posy_dy));
-          //printf("cursorx: %lf, cursory: %lf", cursor_posx_dx, cursor_posy_dy);
-          io.AddMousePosEvent((float)cursor_posx, (float)cursor_posy);
-        }
-      }
-        break;
+    // nothing to draw on while unplugged, just wait for events
+    int timeout = output_connected ? 0 : 100;
+    event_count = epoll_wait(epoll_fd, ep_events, ARRAY_LENGTH(ep_events), timeout);
 
+    bool hotplug = false;
+    for (int i = 0; i < event_count; ++i) {
+      if (ep_events[i].data.fd == state.drm_monitor_fd) {
+        hotplug |= ReceiveHotplug(state.drm_monitor);
+      }
+    }
 
-      case LIBINPUT_EVENT_POINTER_MOTION_ABSOLUTE: {
-        if ((li_event_pt = libinput_event_get_pointer_event(li_event)) != NULL) {
-          cursor_posx = libinput_event_pointer_get_absolute_x_transformed(li_event_pt, screen_width);
-          cursor_posy = libinput_event_pointer_get_absolute_y_transformed(li_event_pt, screen_height);
+    if (li) {
+      libinput_dispatch(li);
+      while ((li_event = libinput_get_event(li))) {
+        libinput_event_type li_event_type = libinput_event_get_type(li_event);
+        printf("event_type: %d\n", li_event_type);
+
+        if (li_event_type == LIBINPUT_EVENT_DEVICE_ADDED) {
+          struct libinput_device *dev = libinput_event_get_device(li_event);
+          const char *name = libinput_device_get_name(dev);
+          printf("Found Input Device: %s.\n", name);
+        } else if (TranslateInputEvent(li_event, &input, &event)) {
+          RecordInputEvent(&recorder, &event);
+          HandleInputEvent(&input, &event, &ui_layer);
         }
+        libinput_event_destroy(li_event);
       }
-        break;
-
-      case LIBINPUT_EVENT_POINTER_BUTTON: {
-        if ((li_event_pt = libinput_event_get_pointer_event(li_event)) != NULL) {
-          uint32_t button = libinput_event_pointer_get_button(li_event_pt);
-          bool is_press = libinput_event_pointer_get_button_state(li_event_pt) == LIBINPUT_BUTTON_STATE_PRESSED;
-          int code = 0;
-          switch (button) {
-          case BTN_LEFT:
-            code = 0;
-            break;
-          case BTN_RIGHT:
-            code = 1;
-          case BTN_MIDDLE:
-            code = 2;
-          }
-          io.AddMouseButtonEvent(code, is_press);
-          std::cout << "button: " << button << ", is_pressed: " << is_press << std::endl;
-        }
-
+    } else if (replay.file) {
+      while (PollInputReplay(&replay, &event)) {
+        HandleInputEvent(&input, &event, &ui_layer);
+      }
+      if (replay.finished) {
+        input.quit = true;
       }
-        break;
+    }
 
+    // the render thread reconfigures the output, so a hotplug is still submitted
+    if (!output_connected && !hotplug) {
+      continue;
+    }
 
-      default:
-        break;
+    packet->hotplug = hotplug;
+    packet->ui_changed = output_connected &&
+      RenderIMGUI(&ui_layer, output_width, output_height, &packet->draw_data, &packet->textures);
+    packet->yuv_changed = options.yuv_path && ReadYUVFrame(&yuv_reader, &packet->yuv_frame);
+
+    double cursor_x = input.cursor_x;
+    double cursor_y = input.cursor_y;
+    if (input.predictor) {
+      packet->predict_usec = InputTraceNow();
+      PredictCursor(input.predictor, packet->predict_usec, input.cursor_x, input.cursor_y, &cursor_x, &cursor_y);
+      cursor_x = fmin(input.screen_width, fmax(0, cursor_x));
+      cursor_y = fmin(input.screen_height, fmax(0, cursor_y));
+    }
+    packet->cursor_x = cursor_x;
+    packet->cursor_y = cursor_y;
+
+    packet->screenshot = false;
+    packet->record_frames = 0;
+    if (capturing) {
+      if (screenshot_requested) {
+        screenshot_requested = 0;
+        packet->screenshot = true;
+      }
+      if (recording_requested) {
+        recording_requested = 0;
+        packet->record_frames = options.capture_frames > 0 ? options.capture_frames : 300;
       }
-      libinput_event_destroy(li_event);
     }
+    packet->input_events = input.frame_events;
 
-    glClear(GL_COLOR_BUFFER_BIT);
-    //Render(&render_context);
-    RenderIMGUI(&render_context);
-    RenderCursor(&render_context, cursor_image, cursor_posx, cursor_posy);
-    SwapBuffer(&render_device, &render_context);
+    SubmitFramePacket(&pipeline);
+    RecordInputFrame(&recorder);
   }
 
   // end
-  libinput_unref(li);
+  FinishFramePipeline(&pipeline);
+  if (pipeline.threaded) {
+    // the surface may have been replaced by a hotplug
+    eglMakeCurrent(render_context.display, render_context.surface, render_context.surface, render_context.context);
+  }
+  PrintFramePipelineStats(&pipeline);
+
+  if (input.predictor) {
+    for (int i = 0; i < 2; ++i) {
+      if (packets[i].predict_usec && packets[i].present_usec) {
+        PredictorPresent(input.predictor, packets[i].predict_usec, packets[i].present_usec);
+      }
+    }
+    PrintPredictorStats(input.predictor);
+  }
+  if (options.late_render) {
+    for (int i = 0; i < 2; ++i) {
+      if (packets[i].submit_usec) {
+        SchedulerPresent(&scheduler, &packets[i].deadline, packets[i].frame_start_usec, packets[i].submit_usec,
+                         packets[i].missed_deadline);
+      }
+    }
+    PrintFrameSchedulerStats(&scheduler);
+  }
+  pthread_mutex_destroy(&render_state.output_lock);
+  CloseMetrics(&metrics);
+  CloseInputRecorder(&recorder);
+  CloseInputReplay(&replay);
+  if (li) {
+    libinput_unref(li);
+  }
+  udev_monitor_unref(state.drm_monitor);
   close(epoll_fd);
 
+  if (capturing) {
+    DestroyCapture(&capture);
+  }
   RestoreDefaultFramebuffer(&render_device);
 
+  PrintUILayerStats(&ui_layer);
+  PrintCompositorStats(&compositor);
+  PrintTextureStats(&textures);
+  if (options.yuv_path) {
+    PrintYUVStats(&yuv);
+    DestroyYUVSurface(&yuv);
+    CloseYUVReader(&yuv_reader);
+  }
+  DestroyYUVRenderer(&yuv_renderer);
+  PrintAllocStats(&alloc_tracker, &frame_arena);
+  DestroyLayer(scene);
+  DestroyTextureManager(&textures);
+  DestroyUILayer(&ui_layer);
+
   // Cleanup
+  DestroyUITextures();
   ImGui_ImplOpenGL3_Shutdown();
 
+  for (int i = 0; i < 2; ++i) {
+    FreeDrawDataCopy(&packets[i].draw_data);
+    ReleaseTextureUpdates(&packets[i].textures);
+    free(packets[i].yuv_frame);
+  }
   ImGui::DestroyContext();
+  DestroyPoolAllocator(&imgui_allocator);
+  DestroyArena(&frame_arena);
 
   return 0;
 }
@@ -0,0 +1,323 @@
+#ifndef KT_METRICS_H
+#define KT_METRICS_H
+
+/*
+ * live metrics in shared memory.
+ *
+ * keytoy publishes its counters and histograms into a POSIX shared memory
+ * segment ($KEYTOY_METRICS, default /keytoy-metrics) once per frame. the
+ * segment is guarded by a seqlock: the writer bumps the sequence to odd,
+ * updates the payload in place and bumps it back to even, so publishing is
+ * a handful of stores and never waits on a reader. readers copy the payload
+ * and retry when the sequence was odd or moved while they copied.
+ *
+ * the layout is versioned; a reader refuses a segment whose magic, version
+ * or size differ from its own. see tools/keytoy_stat for the reader.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define METRICS_MAGIC "KTMETRIC"
+#define METRICS_VERSION 4
+#define METRICS_DEFAULT_NAME "/keytoy-metrics"
+
+// two buckets per power of two of microseconds, the last one holds 12 s and up
+#define METRICS_HIST_BUCKETS 48
+
+typedef struct
+{
+  uint64_t count;
+  uint64_t sum_usec;
+  uint64_t min_usec;
+  uint64_t max_usec;
+  uint64_t buckets[METRICS_HIST_BUCKETS];
+} metrics_histogram_t;
+
+/* everything the seqlock protects */
+typedef struct
+{
+  uint64_t update_usec;       // CLOCK_MONOTONIC of the last publish
+  double refresh_hz;
+
+  uint64_t frames;
+  uint64_t missed_vblanks;    // present intervals longer than one refresh period
+  uint64_t input_events;
+  uint32_t input_queue_depth; // events handled in the last frame
+  uint32_t reserved;
+  uint64_t texture_bytes;
+  uint64_t deadline_frames;   // rendered late against a vblank deadline, see scheduler.h
+  uint64_t missed_deadlines;
+  uint64_t deadline_lead_usec; // wake up to target vblank of the last such frame
+  uint64_t surfaces_culled;   // compositor, summed over frames
+  uint64_t pixels_opaque;
+  uint64_t pixels_blended;
+
+  metrics_histogram_t frame_time;       // start of frame to end of swap
+  metrics_histogram_t present_interval; // swap to swap
+  metrics_histogram_t input_queue;      // events per frame, counts rather than usec
+} metrics_payload_t;
+
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t size;              // sizeof(metrics_segment_t)
+  int32_t pid;
+  uint32_t reserved;
+
+  uint64_t seq;               // odd while the payload is being written
+  metrics_payload_t payload;
+} metrics_segment_t;
+
+typedef struct
+{
+  char name[NAME_MAX];
+  metrics_segment_t *segment;
+  bool owner;                 // created the segment, unlinks it on close
+} metrics_t;
+
+/* what the render loop hands over once per frame */
+typedef struct
+{
+  uint64_t now_usec;
+  uint64_t frame_usec;
+  uint64_t present_interval_usec;
+  uint32_t input_events;
+  uint64_t texture_bytes;
+  bool deadline;              // had a vblank deadline
+  bool missed_deadline;
+  uint64_t deadline_lead_usec;
+  uint64_t surfaces_culled;   // this frame's compositor stats
+  uint64_t pixels_opaque;
+  uint64_t pixels_blended;
+} metrics_frame_t;
+
+static const char *metrics_name(const char *name)
+{
+  if (name) {
+    return name;
+  }
+  const char *env = getenv("KEYTOY_METRICS");
+  return env && *env ? env : METRICS_DEFAULT_NAME;
+}
+
+static int metrics_bucket(uint64_t usec)
+{
+  if (usec < 2) {
+    return (int)usec;
+  }
+  int log2 = 63 - __builtin_clzll(usec);
+  int bucket = log2 * 2 + (int)((usec >> (log2 - 1)) & 1);
+  return bucket < METRICS_HIST_BUCKETS ? bucket : METRICS_HIST_BUCKETS - 1;
+}
+
+/* lower bound of a bucket in usec */
+static uint64_t MetricsBucketStart(int bucket)
+{
+  if (bucket < 2) {
+    return (uint64_t)bucket;
+  }
+  uint64_t base = 1ull << (bucket / 2);
+  return base + (bucket & 1 ? base / 2 : 0);
+}
+
+static void MetricsRecord(metrics_histogram_t *hist, uint64_t usec)
+{
+  if (hist->count == 0 || usec < hist->min_usec) {
+    hist->min_usec = usec;
+  }
+  if (usec > hist->max_usec) {
+    hist->max_usec = usec;
+  }
+  hist->count++;
+  hist->sum_usec += usec;
+  hist->buckets[metrics_bucket(usec)]++;
+}
+
+/* approximate percentile (0..1) from the buckets */
+static uint64_t MetricsPercentile(const metrics_histogram_t *hist, double p)
+{
+  if (hist->count == 0) {
+    return 0;
+  }
+  uint64_t target = (uint64_t)(p * (hist->count - 1)) + 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < METRICS_HIST_BUCKETS; ++i) {
+    seen += hist->buckets[i];
+    if (seen >= target) {
+      uint64_t end = i + 1 < METRICS_HIST_BUCKETS ? MetricsBucketStart(i + 1) : hist->max_usec;
+      return end < hist->max_usec ? end : hist->max_usec;
+    }
+  }
+  return hist->max_usec;
+}
+
+/*    writer     */
+
+/* creates (or takes over) the segment. name may be NULL for the default */
+static bool OpenMetrics(metrics_t *metrics, const char *name, double refresh_hz)
+{
+  memset(metrics, 0, sizeof(*metrics));
+  snprintf(metrics->name, sizeof(metrics->name), "%s", metrics_name(name));
+
+  int fd = shm_open(metrics->name, O_CREAT | O_RDWR, 0644);
+  if (fd < 0) {
+    printf("shm_open %s FAILED!\n", metrics->name);
+    return false;
+  }
+  if (ftruncate(fd, sizeof(metrics_segment_t)) != 0) {
+    printf("resize metrics segment %s FAILED!\n", metrics->name);
+    close(fd);
+    return false;
+  }
+
+  void *map = mmap(NULL, sizeof(metrics_segment_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    printf("mmap metrics segment %s FAILED!\n", metrics->name);
+    return false;
+  }
+
+  metrics_segment_t *segment = (metrics_segment_t *)map;
+  // readers check the magic last, so hide it until the rest is valid
+  memset(segment->magic, 0, sizeof(segment->magic));
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  segment->version = METRICS_VERSION;
+  segment->size = sizeof(metrics_segment_t);
+  segment->pid = (int32_t)getpid();
+  segment->seq = 0;
+  memset(&segment->payload, 0, sizeof(segment->payload));
+  segment->payload.refresh_hz = refresh_hz;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(segment->magic, METRICS_MAGIC, sizeof(segment->magic));
+
+  metrics->segment = segment;
+  metrics->owner = true;
+  return true;
+}
+
+/* publish: begin, change segment->payload in place, end */
+static metrics_payload_t *BeginMetricsUpdate(metrics_t *metrics)
+{
+  metrics_segment_t *segment = metrics->segment;
+  __atomic_store_n(&segment->seq, segment->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  return &segment->payload;
+}
+
+static void EndMetricsUpdate(metrics_t *metrics)
+{
+  metrics_segment_t *segment = metrics->segment;
+  __atomic_store_n(&segment->seq, segment->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void PublishFrameMetrics(metrics_t *metrics, const metrics_frame_t *frame)
+{
+  if (!metrics->segment) {
+    return;
+  }
+
+  metrics_payload_t *p = BeginMetricsUpdate(metrics);
+  p->update_usec = frame->now_usec;
+  p->frames++;
+  MetricsRecord(&p->frame_time, frame->frame_usec);
+  if (frame->present_interval_usec > 0) {
+    MetricsRecord(&p->present_interval, frame->present_interval_usec);
+    if (p->refresh_hz > 0.0) {
+      // anything past 1.5 periods skipped at least one vblank
+      double periods = frame->present_interval_usec * p->refresh_hz * 1e-6;
+      if (periods > 1.5) {
+        p->missed_vblanks += (uint64_t)(periods - 0.5);
+      }
+    }
+  }
+  p->input_events += frame->input_events;
+  p->input_queue_depth = frame->input_events;
+  MetricsRecord(&p->input_queue, frame->input_events);
+  p->texture_bytes = frame->texture_bytes;
+  p->surfaces_culled += frame->surfaces_culled;
+  p->pixels_opaque += frame->pixels_opaque;
+  p->pixels_blended += frame->pixels_blended;
+  if (frame->deadline) {
+    p->deadline_frames++;
+    p->missed_deadlines += frame->missed_deadline;
+    p->deadline_lead_usec = frame->deadline_lead_usec;
+  }
+  EndMetricsUpdate(metrics);
+}
+
+static void CloseMetrics(metrics_t *metrics)
+{
+  if (!metrics->segment) {
+    return;
+  }
+  munmap(metrics->segment, sizeof(metrics_segment_t));
+  if (metrics->owner) {
+    shm_unlink(metrics->name);
+  }
+  metrics->segment = NULL;
+}
+
+/*    reader     */
+
+static bool OpenMetricsReader(metrics_t *metrics, const char *name)
+{
+  memset(metrics, 0, sizeof(*metrics));
+  snprintf(metrics->name, sizeof(metrics->name), "%s", metrics_name(name));
+
+  int fd = shm_open(metrics->name, O_RDONLY, 0);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(metrics_segment_t)) {
+    close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, sizeof(metrics_segment_t), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+
+  metrics_segment_t *segment = (metrics_segment_t *)map;
+  if (memcmp(segment->magic, METRICS_MAGIC, sizeof(segment->magic)) != 0 ||
+      segment->version != METRICS_VERSION || segment->size != sizeof(metrics_segment_t)) {
+    printf("metrics segment %s has an unknown layout (version %u, %u bytes)\n",
+           metrics->name, segment->version, segment->size);
+    munmap(map, sizeof(metrics_segment_t));
+    return false;
+  }
+  metrics->segment = segment;
+  return true;
+}
+
+/* consistent copy of the payload, false if the writer kept it busy */
+static bool ReadMetrics(const metrics_t *metrics, metrics_payload_t *out)
+{
+  const metrics_segment_t *segment = metrics->segment;
+  for (int tries = 0; tries < 1000; ++tries) {
+    uint64_t begin = __atomic_load_n(&segment->seq, __ATOMIC_ACQUIRE);
+    if (begin & 1) {
+      continue;
+    }
+    memcpy(out, (const void *)&segment->payload, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&segment->seq, __ATOMIC_RELAXED) == begin) {
+      return true;
+    }
+  }
+  return false;
+}
+
+#endif
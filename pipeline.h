@@ -0,0 +1,185 @@
+#ifndef KT_PIPELINE_H
+#define KT_PIPELINE_H
+
+/*
+ * two stage frame pipeline.
+ *
+ * the main thread fills a frame packet (input, ui, cursor) and submits it;
+ * a render thread owning the GL context draws and presents it. there are
+ * two packets, so the main thread builds frame N+1 while frame N renders
+ * and only waits when it gets a whole frame ahead. a packet is never
+ * touched by both threads at once: it belongs to the render thread from
+ * submit until it was rendered, then to the main thread again.
+ *
+ * without a thread, submit renders the packet on the spot, so both modes
+ * run the same code.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+
+typedef void (*pipeline_fn)(void *ctx, void *packet);
+
+typedef struct
+{
+  bool threaded;
+  void *ctx;
+  pipeline_fn begin;          // render thread start, packet is NULL (make the context current)
+  pipeline_fn render;
+  pipeline_fn end;            // render thread exit, packet is NULL (release the context)
+
+  void *packets[2];
+  bool ready[2];              // submitted, not rendered yet
+  int write;                  // main: next packet to fill
+  int read;                   // render: next packet to draw
+  bool quit;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  uint64_t frames;
+  double main_wait_ms;        // main thread blocked on the render thread
+  double render_wait_ms;      // render thread idle, waiting for a packet
+  double render_ms;
+} frame_pipeline_t;
+
+static double pipeline_now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+static void *pipeline_thread(void *arg)
+{
+  frame_pipeline_t *pipeline = (frame_pipeline_t *)arg;
+
+  if (pipeline->begin) {
+    pipeline->begin(pipeline->ctx, NULL);
+  }
+
+  pthread_mutex_lock(&pipeline->lock);
+  for (;;) {
+    int i = pipeline->read;
+    double wait_start = pipeline_now_ms();
+    while (!pipeline->ready[i] && !pipeline->quit) {
+      pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+    }
+    // submitted packets are rendered even after quit
+    if (!pipeline->ready[i]) {
+      break;
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    double start = pipeline_now_ms();
+    pipeline->render(pipeline->ctx, pipeline->packets[i]);
+    double end = pipeline_now_ms();
+
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->render_wait_ms += start - wait_start;
+    pipeline->render_ms += end - start;
+    pipeline->frames++;
+    pipeline->ready[i] = false;
+    pipeline->read = i ^ 1;
+    pthread_cond_broadcast(&pipeline->cond);
+  }
+  pthread_mutex_unlock(&pipeline->lock);
+
+  if (pipeline->end) {
+    pipeline->end(pipeline->ctx, NULL);
+  }
+  return NULL;
+}
+
+/* the caller must have released the GL context before a threaded start */
+static void InitFramePipeline(frame_pipeline_t *pipeline, bool threaded, void *packet0, void *packet1,
+                              void *ctx, pipeline_fn begin, pipeline_fn render, pipeline_fn end)
+{
+  memset(pipeline, 0, sizeof(*pipeline));
+  pipeline->threaded = threaded;
+  pipeline->ctx = ctx;
+  pipeline->begin = begin;
+  pipeline->render = render;
+  pipeline->end = end;
+  pipeline->packets[0] = packet0;
+  pipeline->packets[1] = packet1;
+
+  if (!threaded) {
+    return;
+  }
+  pthread_mutex_init(&pipeline->lock, NULL);
+  pthread_cond_init(&pipeline->cond, NULL);
+  int ret = pthread_create(&pipeline->thread, NULL, pipeline_thread, pipeline);
+  assert(ret == 0);
+  (void)ret;
+}
+
+/* the packet to fill next, once the render thread is done with it */
+static void *AcquireFramePacket(frame_pipeline_t *pipeline)
+{
+  int i = pipeline->write;
+  if (!pipeline->threaded) {
+    return pipeline->packets[i];
+  }
+
+  double start = pipeline_now_ms();
+  pthread_mutex_lock(&pipeline->lock);
+  while (pipeline->ready[i]) {
+    pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+  }
+  pthread_mutex_unlock(&pipeline->lock);
+  pipeline->main_wait_ms += pipeline_now_ms() - start;
+  return pipeline->packets[i];
+}
+
+/* hands the acquired packet over; renders it right away without a thread */
+static void SubmitFramePacket(frame_pipeline_t *pipeline)
+{
+  int i = pipeline->write;
+  pipeline->write = i ^ 1;
+
+  if (!pipeline->threaded) {
+    double start = pipeline_now_ms();
+    pipeline->render(pipeline->ctx, pipeline->packets[i]);
+    pipeline->render_ms += pipeline_now_ms() - start;
+    pipeline->frames++;
+    return;
+  }
+
+  pthread_mutex_lock(&pipeline->lock);
+  pipeline->ready[i] = true;
+  pthread_cond_broadcast(&pipeline->cond);
+  pthread_mutex_unlock(&pipeline->lock);
+}
+
+/* renders what was submitted and stops the render thread */
+static void FinishFramePipeline(frame_pipeline_t *pipeline)
+{
+  if (!pipeline->threaded) {
+    return;
+  }
+  pthread_mutex_lock(&pipeline->lock);
+  pipeline->quit = true;
+  pthread_cond_broadcast(&pipeline->cond);
+  pthread_mutex_unlock(&pipeline->lock);
+
+  pthread_join(pipeline->thread, NULL);
+  pthread_mutex_destroy(&pipeline->lock);
+  pthread_cond_destroy(&pipeline->cond);
+}
+
+static void PrintFramePipelineStats(const frame_pipeline_t *pipeline)
+{
+  double frames = pipeline->frames ? (double)pipeline->frames : 1.0;
+  printf("pipeline: %s, %llu frames, render %.3f ms/frame, main waited %.3f ms/frame, render idle %.3f ms/frame\n",
+         pipeline->threaded ? "render thread" : "single thread", (unsigned long long)pipeline->frames,
+         pipeline->render_ms / frames, pipeline->main_wait_ms / frames, pipeline->render_wait_ms / frames);
+}
+
+#endif
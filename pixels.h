@@ -0,0 +1,650 @@
+#ifndef KT_PIXELS_H
+#define KT_PIXELS_H
+
+/*
+ * pixel format conversion for texture upload.
+ *
+ * every upload path goes through ConvertPixels(), which swizzles into the
+ * GL_RGBA byte order, optionally (un)premultiplies alpha and repacks rows to
+ * a tight stride. row kernels exist as scalar, SSE2/SSSE3, AVX2 and NEON
+ * variants; the best one the running cpu supports is picked on first use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KT_PIXELS_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define KT_PIXELS_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* formats are named after their byte order in memory, low address first */
+typedef enum
+{
+  PIXEL_FORMAT_RGBA8888 = 0,  /* GL_RGBA / GL_UNSIGNED_BYTE, DRM_FORMAT_ABGR8888 */
+  PIXEL_FORMAT_BGRA8888,      /* DRM_FORMAT_ARGB8888 on little endian, xcursor images */
+  PIXEL_FORMAT_RGB888,        /* GL_RGB / GL_UNSIGNED_BYTE, stb_image 3 channels */
+  PIXEL_FORMAT_COUNT,
+} pixel_format_t;
+
+enum
+{
+  PIXEL_CONVERT_NONE          = 0,
+  PIXEL_CONVERT_PREMULTIPLY   = 1 << 0,
+  PIXEL_CONVERT_UNPREMULTIPLY = 1 << 1,
+};
+
+typedef enum
+{
+  PIXEL_ISA_SCALAR = 0,
+  PIXEL_ISA_SSSE3,
+  PIXEL_ISA_AVX2,
+  PIXEL_ISA_NEON,
+  PIXEL_ISA_COUNT,
+} pixel_isa_t;
+
+/* one row of `count` pixels, src and dst never overlap except as noted */
+typedef void (*pixel_row_fn)(uint8_t *dst, const uint8_t *src, size_t count);
+/* in place on a row of 4 byte pixels whose alpha is the last byte */
+typedef void (*pixel_inplace_fn)(uint8_t *pixels, size_t count);
+
+typedef struct
+{
+  const char *name;
+  pixel_row_fn swap_rb;       /* RGBA <-> BGRA, also with src == dst */
+  pixel_row_fn rgb_to_rgba;
+  pixel_row_fn bgra_to_rgb;
+  pixel_row_fn rgba_to_rgb;
+  pixel_inplace_fn premultiply;
+  pixel_inplace_fn unpremultiply;
+} pixel_kernels_t;
+
+static const char *pixel_isa_names[PIXEL_ISA_COUNT] = { "scalar", "ssse3", "avx2", "neon" };
+
+static inline size_t PixelFormatBytes(pixel_format_t format)
+{
+  return format == PIXEL_FORMAT_RGB888 ? 3 : 4;
+}
+
+/*    scalar     */
+
+/* exact round(c * a / 255) */
+static inline uint8_t mul_div255(uint32_t c, uint32_t a)
+{
+  uint32_t t = c * a + 128;
+  return (uint8_t)((t + (t >> 8)) >> 8);
+}
+
+/* exact round(c * 255 / a), clamped */
+static inline uint8_t div_alpha(uint32_t c, uint32_t a)
+{
+  if (a == 0) {
+    return 0;
+  }
+  uint32_t v = (c * 255 + a / 2) / a;
+  return (uint8_t)(v > 255 ? 255 : v);
+}
+
+/* the swap_rb kernels read a pixel or a vector before writing it, so they work in place */
+static void swap_rb_scalar(uint8_t *dst, const uint8_t *src, size_t count)
+{
+  for (size_t i = 0; i < count; ++i, src += 4, dst += 4) {
+    uint8_t r = src[0];
+    dst[0] = src[2];
+    dst[1] = src[1];
+    dst[2] = r;
+    dst[3] = src[3];
+  }
+}
+
+static void rgb_to_rgba_scalar(uint8_t *dst, const uint8_t *src, size_t count)
+{
+  for (size_t i = 0; i < count; ++i, src += 3, dst += 4) {
+    dst[0] = src[0];
+    dst[1] = src[1];
+    dst[2] = src[2];
+    dst[3] = 255;
+  }
+}
+
+static void bgra_to_rgb_scalar(uint8_t *dst, const uint8_t *src, size_t count)
+{
+  for (size_t i = 0; i < count; ++i, src += 4, dst += 3) {
+    dst[0] = src[2];
+    dst[1] = src[1];
+    dst[2] = src[0];
+  }
+}
+
+static void rgba_to_rgb_scalar(uint8_t *dst, const uint8_t *src, size_t count)
+{
+  for (size_t i = 0; i < count; ++i, src += 4, dst += 3) {
+    dst[0] = src[0];
+    dst[1] = src[1];
+    dst[2] = src[2];
+  }
+}
+
+static void premultiply_scalar(uint8_t *p, size_t count)
+{
+  for (size_t i = 0; i < count; ++i, p += 4) {
+    uint32_t a = p[3];
+    p[0] = mul_div255(p[0], a);
+    p[1] = mul_div255(p[1], a);
+    p[2] = mul_div255(p[2], a);
+  }
+}
+
+static void unpremultiply_scalar(uint8_t *p, size_t count)
+{
+  for (size_t i = 0; i < count; ++i, p += 4) {
+    uint32_t a = p[3];
+    if (a == 255) {
+      continue;
+    }
+    p[0] = div_alpha(p[0], a);
+    p[1] = div_alpha(p[1], a);
+    p[2] = div_alpha(p[2], a);
+  }
+}
+
+/*    x86     */
+
+#ifdef KT_PIXELS_X86
+
+#define KT_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define KT_TARGET_AVX2 __attribute__((target("avx2")))
+
+KT_TARGET_SSSE3 static void swap_rb_ssse3(uint8_t *dst, const uint8_t *src, size_t count)
+{
+  const __m128i mask = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+    _mm_storeu_si128((__m128i *)(dst + i * 4), _mm_shuffle_epi8(v, mask));
+  }
+  swap_rb_scalar(dst + i * 4, src + i * 4, count - i);
+}
+
+KT_TARGET_SSSE3 static void rgb_to_rgba_ssse3(uint8_t *dst, const uint8_t *src, size_t count)
+{
+  const __m128i mask = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+  size_t i = 0;
+  /* each load reads 16 bytes but consumes 12, stop before overreading */
+  for (; i + 6 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 3));
+    _mm_storeu_si128((__m128i *)(dst + i * 4), _mm_or_si128(_mm_shuffle_epi8(v, mask), alpha));
+  }
+  rgb_to_rgba_scalar(dst + i * 4, src + i * 3, count - i);
+}
+
+KT_TARGET_SSSE3 static void rgbx_to_rgb_ssse3(uint8_t *dst, const uint8_t *src, size_t count,
+                                              __m128i mask, pixel_row_fn tail)
+{
+  size_t i = 0;
+  /* each store writes 16 bytes but produces 12, stop before overwriting */
+  for (; i + 6 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+    _mm_storeu_si128((__m128i *)(dst + i * 3), _mm_shuffle_epi8(v, mask));
+  }
+  tail(dst + i * 3, src + i * 4, count - i);
+}
+
+KT_TARGET_SSSE3 static void bgra_to_rgb_ssse3(uint8_t *dst, const uint8_t *src, size_t count)
+{
+  rgbx_to_rgb_ssse3(dst, src, count,
+                    _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1),
+                    bgra_to_rgb_scalar);
+}
+
+KT_TARGET_SSSE3 static void rgba_to_rgb_ssse3(uint8_t *dst, const uint8_t *src, size_t count)
+{
+  rgbx_to_rgb_ssse3(dst, src, count,
+                    _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1),
+                    rgba_to_rgb_scalar);
+}
+
+/* 16 bit lanes: round(c * a / 255) */
+KT_TARGET_SSSE3 static inline __m128i mul_div255_epi16(__m128i c, __m128i a)
+{
+  __m128i t = _mm_add_epi16(_mm_mullo_epi16(c, a), _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+KT_TARGET_SSSE3 static void premultiply_ssse3(uint8_t *p, size_t count)
+{
+  /* broadcast each pixel's alpha over its color bytes, alpha itself times 255 */
+  const __m128i alpha_lo = _mm_setr_epi8(3, -1, 3, -1, 3, -1, -1, -1, 7, -1, 7, -1, 7, -1, -1, -1);
+  const __m128i alpha_hi = _mm_setr_epi8(11, -1, 11, -1, 11, -1, -1, -1, 15, -1, 15, -1, 15, -1, -1, -1);
+  const __m128i keep = _mm_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255);
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i * 4));
+    __m128i lo = _mm_unpacklo_epi8(v, zero);
+    __m128i hi = _mm_unpackhi_epi8(v, zero);
+    __m128i alo = _mm_or_si128(_mm_shuffle_epi8(v, alpha_lo), keep);
+    __m128i ahi = _mm_or_si128(_mm_shuffle_epi8(v, alpha_hi), keep);
+    lo = mul_div255_epi16(lo, alo);
+    hi = mul_div255_epi16(hi, ahi);
+    _mm_storeu_si128((__m128i *)(p + i * 4), _mm_packus_epi16(lo, hi));
+  }
+  premultiply_scalar(p + i * 4, count - i);
+}
+
+KT_TARGET_SSSE3 static void unpremultiply_ssse3(uint8_t *p, size_t count)
+{
+  const __m128i byte_mask = _mm_set1_epi32(0xff);
+  const __m128 v255 = _mm_set1_ps(255.f);
+  const __m128 zero_ps = _mm_setzero_ps();
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i * 4));
+    __m128i a = _mm_srli_epi32(v, 24);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, byte_mask)) == 0xffff) {
+      continue;
+    }
+
+    /* (c * 255 + a / 2) / a computed in float is exact for these ranges */
+    __m128 af = _mm_cvtepi32_ps(a);
+    __m128 half = _mm_cvtepi32_ps(_mm_srli_epi32(a, 1));
+    /* a == 0 divides by zero, the result is masked out below */
+    __m128 zero_alpha = _mm_cmpeq_ps(af, zero_ps);
+    __m128i out = _mm_slli_epi32(a, 24);
+    for (int k = 0; k < 3; ++k) {
+      __m128i c = _mm_and_si128(v, byte_mask);
+      __m128 n = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(c), v255), half);
+      __m128 q = _mm_andnot_ps(zero_alpha, _mm_min_ps(_mm_div_ps(n, af), v255));
+      __m128i r = _mm_cvttps_epi32(q);
+      /* shift the next channel into the low byte */
+      v = _mm_srli_epi32(v, 8);
+      out = _mm_or_si128(out, k == 0 ? r : k == 1 ? _mm_slli_epi32(r, 8) : _mm_slli_epi32(r, 16));
+    }
+    _mm_storeu_si128((__m128i *)(p + i * 4), out);
+  }
+  unpremultiply_scalar(p + i * 4, count - i);
+}
+
+KT_TARGET_AVX2 static void swap_rb_avx2(uint8_t *dst, const uint8_t *src, size_t count)
+{
+  const __m256i mask = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+    _mm256_storeu_si256((__m256i *)(dst + i * 4), _mm256_shuffle_epi8(v, mask));
+  }
+  swap_rb_scalar(dst + i * 4, src + i * 4, count - i);
+}
+
+KT_TARGET_AVX2 static void rgb_to_rgba_avx2(uint8_t *dst, const uint8_t *src, size_t count)
+{
+  /* move the second group of 12 source bytes into the high lane, then shuffle per lane */
+  const __m256i spread = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+  const __m256i mask = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+  size_t i = 0;
+  for (; i + 11 <= count; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i * 3));
+    v = _mm256_permutevar8x32_epi32(v, spread);
+    _mm256_storeu_si256((__m256i *)(dst + i * 4), _mm256_or_si256(_mm256_shuffle_epi8(v, mask), alpha));
+  }
+  rgb_to_rgba_ssse3(dst + i * 4, src + i * 3, count - i);
+}
+
+KT_TARGET_AVX2 static inline __m256i mul_div255_epi16_avx2(__m256i c, __m256i a)
+{
+  __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(c, a), _mm256_set1_epi16(128));
+  return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+KT_TARGET_AVX2 static void premultiply_avx2(uint8_t *p, size_t count)
+{
+  const __m256i alpha_lo = _mm256_setr_epi8(3, -1, 3, -1, 3, -1, -1, -1, 7, -1, 7, -1, 7, -1, -1, -1,
+                                            3, -1, 3, -1, 3, -1, -1, -1, 7, -1, 7, -1, 7, -1, -1, -1);
+  const __m256i alpha_hi = _mm256_setr_epi8(11, -1, 11, -1, 11, -1, -1, -1, 15, -1, 15, -1, 15, -1, -1, -1,
+                                            11, -1, 11, -1, 11, -1, -1, -1, 15, -1, 15, -1, 15, -1, -1, -1);
+  const __m256i keep = _mm256_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255);
+  const __m256i zero = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i * 4));
+    __m256i lo = _mm256_unpacklo_epi8(v, zero);
+    __m256i hi = _mm256_unpackhi_epi8(v, zero);
+    __m256i alo = _mm256_or_si256(_mm256_shuffle_epi8(v, alpha_lo), keep);
+    __m256i ahi = _mm256_or_si256(_mm256_shuffle_epi8(v, alpha_hi), keep);
+    lo = mul_div255_epi16_avx2(lo, alo);
+    hi = mul_div255_epi16_avx2(hi, ahi);
+    /* unpack and pack both work per 128 bit lane, so the order is preserved */
+    _mm256_storeu_si256((__m256i *)(p + i * 4), _mm256_packus_epi16(lo, hi));
+  }
+  premultiply_ssse3(p + i * 4, count - i);
+}
+
+KT_TARGET_AVX2 static void unpremultiply_avx2(uint8_t *p, size_t count)
+{
+  const __m256i byte_mask = _mm256_set1_epi32(0xff);
+  const __m256 v255 = _mm256_set1_ps(255.f);
+  const __m256 zero_ps = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i * 4));
+    __m256i a = _mm256_srli_epi32(v, 24);
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(a, byte_mask)) == -1) {
+      continue;
+    }
+
+    __m256 af = _mm256_cvtepi32_ps(a);
+    __m256 half = _mm256_cvtepi32_ps(_mm256_srli_epi32(a, 1));
+    /* a == 0 divides by zero, the result is masked out below */
+    __m256 zero_alpha = _mm256_cmp_ps(af, zero_ps, _CMP_EQ_OQ);
+    __m256i out = _mm256_slli_epi32(a, 24);
+    for (int k = 0; k < 3; ++k) {
+      __m256i c = _mm256_and_si256(v, byte_mask);
+      __m256 n = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(c), v255), half);
+      __m256 q = _mm256_andnot_ps(zero_alpha, _mm256_min_ps(_mm256_div_ps(n, af), v255));
+      __m256i r = _mm256_cvttps_epi32(q);
+      v = _mm256_srli_epi32(v, 8);
+      out = _mm256_or_si256(out, k == 0 ? r : k == 1 ? _mm256_slli_epi32(r, 8) : _mm256_slli_epi32(r, 16));
+    }
+    _mm256_storeu_si256((__m256i *)(p + i * 4), out);
+  }
+  unpremultiply_scalar(p + i * 4, count - i);
+}
+
+#endif
+
+/*    arm     */
+
+#ifdef KT_PIXELS_NEON
+
+static void swap_rb_neon(uint8_t *dst, const uint8_t *src, size_t count)
+{
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    uint8x16x4_t v = vld4q_u8(src + i * 4);
+    uint8x16_t r = v.val[0];
+    v.val[0] = v.val[2];
+    v.val[2] = r;
+    vst4q_u8(dst + i * 4, v);
+  }
+  swap_rb_scalar(dst + i * 4, src + i * 4, count - i);
+}
+
+static void rgb_to_rgba_neon(uint8_t *dst, const uint8_t *src, size_t count)
+{
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    uint8x16x3_t v = vld3q_u8(src + i * 3);
+    uint8x16x4_t o;
+    o.val[0] = v.val[0];
+    o.val[1] = v.val[1];
+    o.val[2] = v.val[2];
+    o.val[3] = vdupq_n_u8(255);
+    vst4q_u8(dst + i * 4, o);
+  }
+  rgb_to_rgba_scalar(dst + i * 4, src + i * 3, count - i);
+}
+
+static void bgra_to_rgb_neon(uint8_t *dst, const uint8_t *src, size_t count)
+{
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    uint8x16x4_t v = vld4q_u8(src + i * 4);
+    uint8x16x3_t o;
+    o.val[0] = v.val[2];
+    o.val[1] = v.val[1];
+    o.val[2] = v.val[0];
+    vst3q_u8(dst + i * 3, o);
+  }
+  bgra_to_rgb_scalar(dst + i * 3, src + i * 4, count - i);
+}
+
+static void rgba_to_rgb_neon(uint8_t *dst, const uint8_t *src, size_t count)
+{
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    uint8x16x4_t v = vld4q_u8(src + i * 4);
+    uint8x16x3_t o;
+    o.val[0] = v.val[0];
+    o.val[1] = v.val[1];
+    o.val[2] = v.val[2];
+    vst3q_u8(dst + i * 3, o);
+  }
+  rgba_to_rgb_scalar(dst + i * 3, src + i * 4, count - i);
+}
+
+/* t = c * a; (t + ((t + 128) >> 8) + 128) >> 8 is the exact rounded c * a / 255 */
+static inline uint8x8_t mul_div255_neon(uint8x8_t c, uint8x8_t a)
+{
+  uint16x8_t t = vmull_u8(c, a);
+  return vrshrn_n_u16(vrsraq_n_u16(t, t, 8), 8);
+}
+
+static void premultiply_neon(uint8_t *p, size_t count)
+{
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    uint8x8x4_t v = vld4_u8(p + i * 4);
+    v.val[0] = mul_div255_neon(v.val[0], v.val[3]);
+    v.val[1] = mul_div255_neon(v.val[1], v.val[3]);
+    v.val[2] = mul_div255_neon(v.val[2], v.val[3]);
+    vst4_u8(p + i * 4, v);
+  }
+  premultiply_scalar(p + i * 4, count - i);
+}
+
+#ifdef __aarch64__
+static inline uint8x8_t div_alpha_neon(uint8x8_t c, float32x4_t alo, float32x4_t ahi,
+                                       float32x4_t hlo, float32x4_t hhi)
+{
+  const float32x4_t v255 = vdupq_n_f32(255.f);
+  uint16x8_t c16 = vmovl_u8(c);
+  float32x4_t nlo = vmlaq_f32(hlo, vcvtq_f32_u32(vmovl_u16(vget_low_u16(c16))), v255);
+  float32x4_t nhi = vmlaq_f32(hhi, vcvtq_f32_u32(vmovl_u16(vget_high_u16(c16))), v255);
+  uint32x4_t qlo = vcvtq_u32_f32(vminq_f32(vdivq_f32(nlo, alo), v255));
+  uint32x4_t qhi = vcvtq_u32_f32(vminq_f32(vdivq_f32(nhi, ahi), v255));
+  return vmovn_u16(vcombine_u16(vmovn_u32(qlo), vmovn_u32(qhi)));
+}
+
+static void unpremultiply_neon(uint8_t *p, size_t count)
+{
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    uint8x8x4_t v = vld4_u8(p + i * 4);
+    if (vget_lane_u64(vreinterpret_u64_u8(vmvn_u8(v.val[3])), 0) == 0) {
+      continue;
+    }
+    /* a == 0 divides by zero, vcvtq saturates and the bsl below clears it */
+    uint16x8_t a16 = vmovl_u8(v.val[3]);
+    float32x4_t alo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(a16)));
+    float32x4_t ahi = vcvtq_f32_u32(vmovl_u16(vget_high_u16(a16)));
+    uint16x8_t h16 = vshrq_n_u16(a16, 1);
+    float32x4_t hlo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(h16)));
+    float32x4_t hhi = vcvtq_f32_u32(vmovl_u16(vget_high_u16(h16)));
+    uint8x8_t transparent = vceq_u8(v.val[3], vdup_n_u8(0));
+    for (int k = 0; k < 3; ++k) {
+      v.val[k] = vbsl_u8(transparent, vdup_n_u8(0), div_alpha_neon(v.val[k], alo, ahi, hlo, hhi));
+    }
+    vst4_u8(p + i * 4, v);
+  }
+  unpremultiply_scalar(p + i * 4, count - i);
+}
+#endif
+
+#endif
+
+/*    dispatch     */
+
+static pixel_kernels_t pixel_kernels_table[PIXEL_ISA_COUNT] = {
+  { "scalar", swap_rb_scalar, rgb_to_rgba_scalar, bgra_to_rgb_scalar, rgba_to_rgb_scalar,
+    premultiply_scalar, unpremultiply_scalar },
+#ifdef KT_PIXELS_X86
+  { "ssse3", swap_rb_ssse3, rgb_to_rgba_ssse3, bgra_to_rgb_ssse3, rgba_to_rgb_ssse3,
+    premultiply_ssse3, unpremultiply_ssse3 },
+  { "avx2", swap_rb_avx2, rgb_to_rgba_avx2, bgra_to_rgb_ssse3, rgba_to_rgb_ssse3,
+    premultiply_avx2, unpremultiply_avx2 },
+#else
+  { NULL }, { NULL },
+#endif
+#ifdef KT_PIXELS_NEON
+  { "neon", swap_rb_neon, rgb_to_rgba_neon, bgra_to_rgb_neon, rgba_to_rgb_neon,
+    premultiply_neon,
+#ifdef __aarch64__
+    unpremultiply_neon },
+#else
+    unpremultiply_scalar },
+#endif
+#else
+  { NULL },
+#endif
+};
+
+static const pixel_kernels_t *pixel_kernels_active = NULL;
+
+/* returns NULL when the running cpu can not execute the given isa */
+static const pixel_kernels_t *GetPixelKernels(pixel_isa_t isa)
+{
+  if (isa >= PIXEL_ISA_COUNT || !pixel_kernels_table[isa].name) {
+    return NULL;
+  }
+#ifdef KT_PIXELS_X86
+  if (isa == PIXEL_ISA_SSSE3 && !__builtin_cpu_supports("ssse3")) {
+    return NULL;
+  }
+  if (isa == PIXEL_ISA_AVX2 && !__builtin_cpu_supports("avx2")) {
+    return NULL;
+  }
+#endif
+  return &pixel_kernels_table[isa];
+}
+
+/*
+ * picks the widest supported isa once. KT_PIXEL_ISA=scalar|ssse3|avx2|neon
+ * forces a particular one, which is handy when chasing a kernel bug.
+ */
+static const pixel_kernels_t *SelectPixelKernels(void)
+{
+  if (pixel_kernels_active) {
+    return pixel_kernels_active;
+  }
+
+  const char *forced = getenv("KT_PIXEL_ISA");
+  for (int isa = PIXEL_ISA_COUNT - 1; isa >= 0; --isa) {
+    if (forced && strcmp(forced, pixel_isa_names[isa]) != 0) {
+      continue;
+    }
+    const pixel_kernels_t *kernels = GetPixelKernels((pixel_isa_t)isa);
+    if (kernels) {
+      pixel_kernels_active = kernels;
+      return kernels;
+    }
+  }
+
+  if (forced) {
+    printf("pixel isa %s unavailable, use scalar\n", forced);
+  }
+  pixel_kernels_active = &pixel_kernels_table[PIXEL_ISA_SCALAR];
+  return pixel_kernels_active;
+}
+
+/*
+ * converts a width x height image between formats. strides are in bytes,
+ * 0 means tightly packed. RGB888 destinations only support the swizzle, as
+ * premultiplication needs an alpha channel to write back.
+ * returns 0 on success, -1 for an unsupported combination.
+ */
+static int ConvertPixelsWith(const pixel_kernels_t *k,
+                             void *dst, size_t dst_stride, pixel_format_t dst_format,
+                             const void *src, size_t src_stride, pixel_format_t src_format,
+                             uint32_t width, uint32_t height, uint32_t flags)
+{
+  size_t src_row = width * PixelFormatBytes(src_format);
+  size_t dst_row = width * PixelFormatBytes(dst_format);
+  if (!src_stride) {
+    src_stride = src_row;
+  }
+  if (!dst_stride) {
+    dst_stride = dst_row;
+  }
+
+  bool in_place = dst == src;
+  if (in_place && (src_format == PIXEL_FORMAT_RGB888) != (dst_format == PIXEL_FORMAT_RGB888)) {
+    return -1;
+  }
+  if (dst_format == PIXEL_FORMAT_RGB888 && flags) {
+    return -1;
+  }
+
+  for (uint32_t y = 0; y < height; ++y) {
+    const uint8_t *s = (const uint8_t *)src + y * src_stride;
+    uint8_t *d = (uint8_t *)dst + y * dst_stride;
+
+    if (src_format == dst_format) {
+      if (!in_place) {
+        memcpy(d, s, dst_row);
+      }
+    } else if (src_format == PIXEL_FORMAT_RGB888) {
+      /* RGB888 -> BGRA8888 is never asked for, route it through RGBA */
+      k->rgb_to_rgba(d, s, width);
+      if (dst_format == PIXEL_FORMAT_BGRA8888) {
+        k->swap_rb(d, d, width);
+      }
+    } else if (dst_format == PIXEL_FORMAT_RGB888) {
+      if (src_format == PIXEL_FORMAT_BGRA8888) {
+        k->bgra_to_rgb(d, s, width);
+      } else {
+        k->rgba_to_rgb(d, s, width);
+      }
+    } else {
+      k->swap_rb(d, s, width);
+    }
+
+    if (flags & PIXEL_CONVERT_PREMULTIPLY) {
+      k->premultiply(d, width);
+    } else if (flags & PIXEL_CONVERT_UNPREMULTIPLY) {
+      k->unpremultiply(d, width);
+    }
+  }
+
+  return 0;
+}
+
+static int ConvertPixels(void *dst, size_t dst_stride, pixel_format_t dst_format,
+                         const void *src, size_t src_stride, pixel_format_t src_format,
+                         uint32_t width, uint32_t height, uint32_t flags)
+{
+  return ConvertPixelsWith(SelectPixelKernels(), dst, dst_stride, dst_format,
+                           src, src_stride, src_format, width, height, flags);
+}
+
+/*
+ * returns a malloc'ed, tightly packed RGBA8888 copy ready for
+ * glTexImage2D(GL_RGBA, GL_UNSIGNED_BYTE) at the default unpack alignment.
+ */
+static uint8_t *ConvertToRGBA(const void *src, size_t src_stride, pixel_format_t src_format,
+                              uint32_t width, uint32_t height, uint32_t flags)
+{
+  uint8_t *rgba = (uint8_t *)malloc((size_t)width * height * 4);
+  if (!rgba) {
+    return NULL;
+  }
+  if (ConvertPixels(rgba, 0, PIXEL_FORMAT_RGBA8888, src, src_stride, src_format,
+                    width, height, flags) != 0) {
+    free(rgba);
+    return NULL;
+  }
+  return rgba;
+}
+
+#endif
@@ -0,0 +1,292 @@
+#ifndef KT_PREDICTOR_H
+#define KT_PREDICTOR_H
+
+/*
+ * pointer motion prediction.
+ *
+ * the cursor is drawn at where the pointer is expected to be when the frame
+ * reaches the screen, not where the last event left it. pointer velocity is
+ * smoothed with a one euro filter (cutoff rises with acceleration, so slow
+ * moves are steady and flicks are not lagged) and extrapolated from the
+ * last event to the estimated presentation time of the frame being built.
+ * that estimate is the measured time from prediction to the end of
+ * SwapBuffer, averaged over recent frames.
+ *
+ * every prediction is checked once the raw position at its presentation
+ * time is known, against the error of showing the unpredicted position.
+ * only the cursor uses the prediction; hit testing keeps the raw position.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#define PREDICTOR_HISTORY 64
+// never extrapolate further than this
+#define PREDICTOR_MAX_AHEAD_USEC 50000
+// no motion for this long: the pointer is at rest, velocity starts over
+#define PREDICTOR_IDLE_USEC 40000
+// predictions waiting for their frame to be presented (frames in flight)
+#define PREDICTOR_PENDING 4
+
+typedef struct
+{
+  double value;
+  double deriv;
+  bool init;
+} one_euro_t;
+
+typedef struct
+{
+  uint64_t time_usec;         // event clock
+  double x, y;
+} predictor_sample_t;
+
+typedef struct
+{
+  // one euro parameters, applied to velocity
+  double min_cutoff;          // Hz
+  double beta;                // Hz per px/s^2
+  double d_cutoff;            // Hz
+
+  one_euro_t vx, vy;          // px/s, deriv px/s^2
+
+  predictor_sample_t history[PREDICTOR_HISTORY];
+  int history_count;
+  int history_head;           // next slot to write
+
+  uint64_t last_event_usec;   // event clock
+  uint64_t last_receive_usec; // monotonic clock, when the last event was handled
+
+  double present_delay_usec;  // prediction to end of swap, running average
+
+  struct
+  {
+    bool valid;
+    bool presented;
+    bool moving;
+    uint64_t predict_usec;    // identifies the frame
+    uint64_t present_usec;
+    double x, y;              // predicted
+    double raw_x, raw_y;      // what would have been shown without prediction
+    double ahead_usec;
+  } pending[PREDICTOR_PENDING];
+  int pending_head;           // next slot to write
+
+  uint64_t frames;
+  uint64_t samples;           // evaluated frames with the pointer moving
+  double sum_error;
+  double max_error;
+  double sum_raw_error;
+  double sum_ahead_usec;
+} predictor_t;
+
+static double one_euro_alpha(double cutoff, double dt)
+{
+  double tau = 1.0 / (2.0 * M_PI * cutoff);
+  return 1.0 / (1.0 + tau / dt);
+}
+
+static void one_euro_update(one_euro_t *f, double sample, double dt, double min_cutoff, double beta, double d_cutoff)
+{
+  if (!f->init) {
+    f->value = sample;
+    f->deriv = 0.0;
+    f->init = true;
+    return;
+  }
+  f->deriv += one_euro_alpha(d_cutoff, dt) * ((sample - f->value) / dt - f->deriv);
+  double cutoff = min_cutoff + beta * fabs(f->deriv);
+  f->value += one_euro_alpha(cutoff, dt) * (sample - f->value);
+}
+
+/* refresh_hz seeds the presentation delay until the first frame is measured */
+static void InitPredictor(predictor_t *predictor, double refresh_hz)
+{
+  memset(predictor, 0, sizeof(*predictor));
+  predictor->min_cutoff = 4.0;
+  predictor->beta = 0.001;
+  predictor->d_cutoff = 1.0;
+  predictor->present_delay_usec = 1e6 / (refresh_hz > 0.0 ? refresh_hz : 60.0);
+}
+
+static const predictor_sample_t *predictor_sample(const predictor_t *predictor, int age)
+{
+  int i = (predictor->history_head - 1 - age + PREDICTOR_HISTORY) % PREDICTOR_HISTORY;
+  return &predictor->history[i];
+}
+
+/* raw position at time_usec (event clock), from the recorded samples */
+static void predictor_raw_at(const predictor_t *predictor, uint64_t time_usec, double *x, double *y)
+{
+  const predictor_sample_t *newer = predictor_sample(predictor, 0);
+  *x = newer->x;
+  *y = newer->y;
+  if (time_usec >= newer->time_usec) {
+    return;
+  }
+
+  for (int age = 1; age < predictor->history_count; ++age) {
+    const predictor_sample_t *older = predictor_sample(predictor, age);
+    if (older->time_usec <= time_usec) {
+      double t = (double)(time_usec - older->time_usec) / (double)(newer->time_usec - older->time_usec);
+      *x = older->x + (newer->x - older->x) * t;
+      *y = older->y + (newer->y - older->y) * t;
+      return;
+    }
+    newer = older;
+    *x = newer->x;
+    *y = newer->y;
+  }
+}
+
+/*
+ * call with the raw pointer position after every motion event. event_usec
+ * is the event timestamp, now_usec the monotonic time it is handled at.
+ */
+static void PredictorMotion(predictor_t *predictor, double x, double y, uint64_t event_usec, uint64_t now_usec)
+{
+  if (predictor->history_count > 0) {
+    const predictor_sample_t *last = predictor_sample(predictor, 0);
+
+    if (event_usec > last->time_usec + PREDICTOR_IDLE_USEC) {
+      // starting from rest, the next sample seeds the velocity
+      predictor->vx.init = false;
+      predictor->vy.init = false;
+    } else if (event_usec > last->time_usec) {
+      double dt = (event_usec - last->time_usec) * 1e-6;
+      one_euro_update(&predictor->vx, (x - last->x) / dt, dt,
+                      predictor->min_cutoff, predictor->beta, predictor->d_cutoff);
+      one_euro_update(&predictor->vy, (y - last->y) / dt, dt,
+                      predictor->min_cutoff, predictor->beta, predictor->d_cutoff);
+    } else {
+      // same timestamp as the last sample (another device): just move it
+      predictor->history_head = (predictor->history_head - 1 + PREDICTOR_HISTORY) % PREDICTOR_HISTORY;
+      predictor->history_count--;
+      event_usec = last->time_usec;
+    }
+  }
+
+  predictor_sample_t *sample = &predictor->history[predictor->history_head];
+  sample->time_usec = event_usec;
+  sample->x = x;
+  sample->y = y;
+  predictor->history_head = (predictor->history_head + 1) % PREDICTOR_HISTORY;
+  if (predictor->history_count < PREDICTOR_HISTORY) {
+    predictor->history_count++;
+  }
+
+  predictor->last_event_usec = event_usec;
+  predictor->last_receive_usec = now_usec;
+}
+
+static void predictor_evaluate(predictor_t *predictor)
+{
+  for (int i = 0; i < PREDICTOR_PENDING; ++i) {
+    if (!predictor->pending[i].valid || !predictor->pending[i].presented) {
+      continue;
+    }
+    predictor->pending[i].valid = false;
+    if (!predictor->pending[i].moving) {
+      continue;
+    }
+
+    // presentation time on the event clock
+    uint64_t present_usec = predictor->pending[i].present_usec - predictor->last_receive_usec + predictor->last_event_usec;
+    double x, y;
+    predictor_raw_at(predictor, present_usec, &x, &y);
+
+    double error = hypot(predictor->pending[i].x - x, predictor->pending[i].y - y);
+    double raw_error = hypot(predictor->pending[i].raw_x - x, predictor->pending[i].raw_y - y);
+
+    predictor->samples++;
+    predictor->sum_error += error;
+    predictor->sum_raw_error += raw_error;
+    predictor->sum_ahead_usec += predictor->pending[i].ahead_usec;
+    if (error > predictor->max_error) {
+      predictor->max_error = error;
+    }
+  }
+}
+
+/*
+ * predicted pointer position for the frame being built now. falls back to
+ * the raw position (raw_x, raw_y) when there is no motion to extrapolate.
+ * now_usec identifies the frame for PredictorPresent.
+ */
+static void PredictCursor(predictor_t *predictor, uint64_t now_usec, double raw_x, double raw_y,
+                          double *x, double *y)
+{
+  predictor_evaluate(predictor);
+  predictor->frames++;
+
+  *x = raw_x;
+  *y = raw_y;
+
+  bool moving = predictor->history_count > 1 && predictor->vx.init &&
+    now_usec < predictor->last_receive_usec + PREDICTOR_IDLE_USEC;
+
+  double ahead_usec = 0.0;
+  if (moving) {
+    ahead_usec = now_usec + predictor->present_delay_usec - predictor->last_receive_usec;
+    ahead_usec = fmin(fmax(ahead_usec, 0.0), PREDICTOR_MAX_AHEAD_USEC);
+
+    double t = ahead_usec * 1e-6;
+    *x += predictor->vx.value * t + 0.5 * predictor->vx.deriv * t * t;
+    *y += predictor->vy.value * t + 0.5 * predictor->vy.deriv * t * t;
+  }
+
+  // the oldest slot is overwritten if its frame never made it to the screen
+  int i = predictor->pending_head;
+  predictor->pending_head = (i + 1) % PREDICTOR_PENDING;
+  predictor->pending[i].valid = true;
+  predictor->pending[i].presented = false;
+  predictor->pending[i].moving = moving;
+  predictor->pending[i].predict_usec = now_usec;
+  predictor->pending[i].x = *x;
+  predictor->pending[i].y = *y;
+  predictor->pending[i].raw_x = raw_x;
+  predictor->pending[i].raw_y = raw_y;
+  predictor->pending[i].ahead_usec = ahead_usec;
+}
+
+/*
+ * the frame predicted at predict_usec was handed to the display at
+ * present_usec. with a render thread this is reported a frame later.
+ */
+static void PredictorPresent(predictor_t *predictor, uint64_t predict_usec, uint64_t present_usec)
+{
+  for (int i = 0; i < PREDICTOR_PENDING; ++i) {
+    if (!predictor->pending[i].valid || predictor->pending[i].presented ||
+        predictor->pending[i].predict_usec != predict_usec) {
+      continue;
+    }
+    predictor->pending[i].presented = true;
+    predictor->pending[i].present_usec = present_usec;
+
+    double delay = (double)(present_usec - predict_usec);
+    predictor->present_delay_usec += 0.1 * (delay - predictor->present_delay_usec);
+    return;
+  }
+}
+
+static void PrintPredictorStats(const predictor_t *predictor)
+{
+  if (predictor->samples == 0) {
+    printf("predictor: %llu frames, pointer never moved\n", (unsigned long long)predictor->frames);
+    return;
+  }
+
+  double n = (double)predictor->samples;
+  double error = predictor->sum_error / n;
+  double raw_error = predictor->sum_raw_error / n;
+  printf("predictor: %llu frames, %llu moving, %.2f ms ahead on average, presentation delay %.2f ms\n",
+         (unsigned long long)predictor->frames, (unsigned long long)predictor->samples,
+         predictor->sum_ahead_usec / n * 1e-3, predictor->present_delay_usec * 1e-3);
+  printf("predictor: error %.2f px mean, %.2f px max; %.2f px mean without prediction (%+.0f%%)\n",
+         error, predictor->max_error, raw_error, raw_error > 0.0 ? (error / raw_error - 1.0) * 100.0 : 0.0);
+}
+
+#endif
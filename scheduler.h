@@ -0,0 +1,272 @@
+#ifndef KT_SCHEDULER_H
+#define KT_SCHEDULER_H
+
+/*
+ * deadline scheduling: frames start as late as they can.
+ *
+ * a frame started right after the previous commit samples input that is
+ * almost a refresh old by the time it is scanned out. the scheduler instead
+ * sleeps until the next vblank minus the time a frame takes, so input is
+ * sampled just before it is needed. that time is learned: the 90th
+ * percentile of wake up to commit over recent frames, plus a safety margin.
+ *
+ * SwapBuffer commits with SetCrtc, a blocking commit that returns once the
+ * new framebuffer is latched, so the vblank counter read right after it is
+ * the vblank the frame made. a frame later than its target missed its
+ * deadline. the margin covers what is not measured, the GPU finishing and
+ * the commit: it grows by half when a frame committed in time and was still
+ * late, and decays back slowly while frames make it. a streak of misses
+ * falls back to rendering right after the vblank for a while, as does
+ * anything slower than a refresh period.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#define SCHEDULER_HISTORY 64
+// render as soon as possible until this many frames were measured
+#define SCHEDULER_MIN_SAMPLES 8
+// consecutive misses before falling back, and for how many frames
+#define SCHEDULER_MISS_STREAK 3
+#define SCHEDULER_FALLBACK_FRAMES 120
+
+/* what a frame was scheduled for, travels with the frame */
+typedef struct
+{
+  bool scheduled;             // false: started right away, no deadline to miss
+  uint32_t vblank;            // target vblank sequence
+  uint64_t vblank_usec;       // its predicted time
+  uint64_t lead_usec;         // woke up this long before it
+} frame_deadline_t;
+
+typedef struct
+{
+  int drm_fd;
+  uint32_t pipe;              // crtc index, for drmWaitVBlank
+  double period_usec;         // 0 while there is no output
+
+  uint64_t durations[SCHEDULER_HISTORY];  // wake up to commit
+  int count;
+  int next;
+  double budget_usec;         // percentile of durations
+  double base_margin_usec;
+  double margin_usec;
+  int miss_streak;
+  int fallback_frames;        // left to render right after the vblank
+
+  uint64_t waits;
+  uint64_t frames;            // presented with a deadline
+  uint64_t misses;
+  uint64_t fallbacks;
+  uint64_t vblank_errors;
+  double slept_usec;
+  double input_age_usec;      // wake up to target vblank, summed over frames
+} frame_scheduler_t;
+
+static uint64_t scheduler_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
+
+/* refresh period from the pixel clock, vrefresh is rounded to whole Hz */
+static double ModeRefreshPeriodUsec(const drmModeModeInfo *mode)
+{
+  if (mode->clock == 0 || mode->htotal == 0 || mode->vtotal == 0) {
+    return mode->vrefresh ? 1e6 / mode->vrefresh : 0.0;
+  }
+  double period = 1e3 * mode->htotal * mode->vtotal / mode->clock;
+  if (mode->flags & DRM_MODE_FLAG_INTERLACE) {
+    period *= 0.5;
+  }
+  if (mode->flags & DRM_MODE_FLAG_DBLSCAN) {
+    period *= 2.0;
+  }
+  if (mode->vscan > 1) {
+    period *= mode->vscan;
+  }
+  return period;
+}
+
+/* index of the crtc in the resources, what vblank requests call the pipe */
+static uint32_t CrtcPipe(int fd, uint32_t crtc_id)
+{
+  uint32_t pipe = 0;
+  drmModeResPtr res = drmModeGetResources(fd);
+  if (!res) {
+    return 0;
+  }
+  for (int i = 0; i < res->count_crtcs; ++i) {
+    if (res->crtcs[i] == crtc_id) {
+      pipe = (uint32_t)i;
+      break;
+    }
+  }
+  drmModeFreeResources(res);
+  return pipe;
+}
+
+/* sequence and CLOCK_MONOTONIC time of the last vblank, does not wait. usec may be NULL */
+static bool ReadLastVBlank(int fd, uint32_t pipe, uint32_t *sequence, uint64_t *usec)
+{
+  drmVBlank vbl;
+  memset(&vbl, 0, sizeof(vbl));
+  vbl.request.type = (drmVBlankSeqType)(DRM_VBLANK_RELATIVE |
+                                        ((pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK));
+  vbl.request.sequence = 0;
+  if (drmWaitVBlank(fd, &vbl) != 0) {
+    return false;
+  }
+  *sequence = vbl.reply.sequence;
+  if (usec) {
+    *usec = (uint64_t)vbl.reply.tval_sec * 1000000u + (uint64_t)vbl.reply.tval_usec;
+  }
+  return true;
+}
+
+/* latched is the vblank counter right after the commit returned */
+static bool DeadlineMissed(const frame_deadline_t *deadline, uint32_t latched)
+{
+  return deadline->scheduled && (int32_t)(latched - deadline->vblank) > 0;
+}
+
+static void InitFrameScheduler(frame_scheduler_t *scheduler, int drm_fd, double margin_usec)
+{
+  memset(scheduler, 0, sizeof(*scheduler));
+  scheduler->drm_fd = drm_fd;
+  scheduler->base_margin_usec = margin_usec;
+  scheduler->margin_usec = margin_usec;
+}
+
+/* after a hotplug; period 0 stops scheduling. the learned durations are kept */
+static void SetSchedulerOutput(frame_scheduler_t *scheduler, uint32_t pipe, double period_usec)
+{
+  scheduler->pipe = pipe;
+  scheduler->period_usec = period_usec;
+  scheduler->miss_streak = 0;
+  scheduler->fallback_frames = 0;
+}
+
+/*
+ * sleeps until the frame has to start to make the next vblank it can
+ * still make, and fills in that target. returns right away while the
+ * scheduler is still learning, falling back or has no vblank to go by.
+ */
+static void WaitForRenderDeadline(frame_scheduler_t *scheduler, frame_deadline_t *deadline)
+{
+  memset(deadline, 0, sizeof(*deadline));
+  double period = scheduler->period_usec;
+  if (period <= 0.0 || scheduler->count < SCHEDULER_MIN_SAMPLES || scheduler->fallback_frames > 0) {
+    return;
+  }
+  double lead = scheduler->budget_usec + scheduler->margin_usec;
+  if (lead >= period) {
+    return;
+  }
+
+  uint32_t sequence;
+  uint64_t last_usec;
+  if (!ReadLastVBlank(scheduler->drm_fd, scheduler->pipe, &sequence, &last_usec)) {
+    scheduler->vblank_errors++;
+    return;
+  }
+
+  uint64_t now = scheduler_now();
+  uint32_t ahead = now > last_usec ? (uint32_t)((now - last_usec) / period) + 1 : 1;
+  double target_usec = last_usec + ahead * period;
+  // too late for that one, the frame goes to the following vblank
+  if (target_usec - lead < now) {
+    ahead++;
+    target_usec += period;
+  }
+
+  uint64_t wake_usec = (uint64_t)(target_usec - lead);
+  struct timespec ts;
+  ts.tv_sec = (time_t)(wake_usec / 1000000u);
+  ts.tv_nsec = (long)(wake_usec % 1000000u) * 1000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+  }
+
+  deadline->scheduled = true;
+  deadline->vblank = sequence + ahead;
+  deadline->vblank_usec = (uint64_t)target_usec;
+  deadline->lead_usec = (uint64_t)lead;
+  scheduler->waits++;
+  scheduler->slept_usec += scheduler_now() - now;
+}
+
+static int scheduler_compare(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* a frame came back: start_usec is when it woke up, submit_usec when it was committed */
+static void SchedulerPresent(frame_scheduler_t *scheduler, const frame_deadline_t *deadline,
+                             uint64_t start_usec, uint64_t submit_usec, bool missed)
+{
+  if (submit_usec > start_usec) {
+    scheduler->durations[scheduler->next] = submit_usec - start_usec;
+    scheduler->next = (scheduler->next + 1) % SCHEDULER_HISTORY;
+    if (scheduler->count < SCHEDULER_HISTORY) {
+      scheduler->count++;
+    }
+    uint64_t sorted[SCHEDULER_HISTORY];
+    memcpy(sorted, scheduler->durations, scheduler->count * sizeof(sorted[0]));
+    qsort(sorted, scheduler->count, sizeof(sorted[0]), scheduler_compare);
+    scheduler->budget_usec = (double)sorted[(scheduler->count * 9) / 10];
+  }
+
+  if (scheduler->fallback_frames > 0) {
+    scheduler->fallback_frames--;
+  }
+  if (!deadline->scheduled) {
+    return;
+  }
+
+  scheduler->frames++;
+  scheduler->input_age_usec += deadline->vblank_usec > start_usec ? deadline->vblank_usec - start_usec : 0;
+  if (!missed) {
+    scheduler->miss_streak = 0;
+    double margin = scheduler->margin_usec * 0.995;
+    scheduler->margin_usec = margin > scheduler->base_margin_usec ? margin : scheduler->base_margin_usec;
+    return;
+  }
+
+  scheduler->misses++;
+  // a slow frame shows up in the budget; committed in time and still late, the margin is short
+  if (submit_usec - start_usec < deadline->lead_usec) {
+    double margin = scheduler->margin_usec * 1.5 + 500.0;
+    scheduler->margin_usec = margin < scheduler->period_usec * 0.5 ? margin : scheduler->period_usec * 0.5;
+  }
+  if (++scheduler->miss_streak >= SCHEDULER_MISS_STREAK) {
+    scheduler->miss_streak = 0;
+    scheduler->fallback_frames = SCHEDULER_FALLBACK_FRAMES;
+    scheduler->fallbacks++;
+  }
+}
+
+static void PrintFrameSchedulerStats(const frame_scheduler_t *scheduler)
+{
+  double frames = scheduler->frames ? (double)scheduler->frames : 1.0;
+  double waits = scheduler->waits ? (double)scheduler->waits : 1.0;
+  printf("scheduler: %llu frames on a deadline, %llu missed (%.2f%%), %llu fallbacks, %llu vblank errors\n",
+         (unsigned long long)scheduler->frames, (unsigned long long)scheduler->misses,
+         scheduler->misses * 100.0 / frames, (unsigned long long)scheduler->fallbacks,
+         (unsigned long long)scheduler->vblank_errors);
+  printf("scheduler: budget %.2f ms + margin %.2f ms, slept %.2f ms/frame, wake to vblank %.2f ms\n",
+         scheduler->budget_usec * 1e-3, scheduler->margin_usec * 1e-3, scheduler->slept_usec * 1e-3 / waits,
+         scheduler->input_age_usec * 1e-3 / frames);
+}
+
+#endif
@@ -0,0 +1,342 @@
+#ifndef KT_SHADERS_H
+#define KT_SHADERS_H
+
+/*
+ * shader compilation with a persistent program binary cache.
+ *
+ * linked programs are saved with glGetProgramBinary under
+ * $KEYTOY_SHADER_CACHE, $XDG_CACHE_HOME/keytoy or ~/.cache/keytoy, and not
+ * at all without any of them. the file name and header carry a hash of the
+ * sources and of the GL vendor, renderer and version strings, so a driver
+ * update or a shader edit misses the cache. a binary the driver refuses is
+ * deleted and the program is compiled from source again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <epoxy/gl.h>
+
+#define SHADER_CACHE_MAGIC "KTPROGBN"
+#define SHADER_CACHE_VERSION 1
+#define SHADER_CACHE_MAX_FORMATS 16
+
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t binary_format;
+  uint64_t source_hash;
+  uint64_t driver_hash;
+  uint32_t length;
+  uint32_t reserved;
+} shader_cache_header_t;
+
+typedef struct
+{
+  char dir[PATH_MAX];
+  bool enabled;               // driver can hand out binaries and dir is writable
+  bool retrievable_hint;      // glProgramParameteri exists, es3 only
+  uint64_t driver_hash;
+  GLenum formats[SHADER_CACHE_MAX_FORMATS];  // binary formats the driver accepts
+  int format_count;
+
+  unsigned int hits;
+  unsigned int misses;
+  unsigned int rejected;      // on disk, but refused by the driver
+  unsigned int stored;
+} shader_cache_t;
+
+static uint64_t fnv1a(uint64_t h, const char *str)
+{
+  for (; str && *str; ++str) {
+    h = (h ^ (uint8_t)*str) * 0x100000001b3ull;
+  }
+  // separator, so ("ab", "c") and ("a", "bc") differ
+  return (h ^ 0xff) * 0x100000001b3ull;
+}
+
+static GLuint LoadShader(const char *source, GLenum type)
+{
+  GLuint shader;
+  GLint compiled;
+
+  shader = glCreateShader(type);
+  glShaderSource(shader, 1, &source, NULL);
+  glCompileShader(shader);
+
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+  if (!compiled) {
+    GLint infolen = 0;
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &infolen);
+    if (infolen > 1) {
+      char *infolog = (char *)malloc(infolen);
+      glGetShaderInfoLog(shader, infolen, NULL, infolog);
+      fprintf(stderr, "Error compiling shader:\n %s \n", infolog);
+      free(infolog);
+    }
+    glDeleteShader(shader);
+    return 0;
+  }
+
+  return shader;
+}
+
+static bool program_linked(GLuint program, bool print_log)
+{
+  GLint linked = 0;
+  glGetProgramiv(program, GL_LINK_STATUS, &linked);
+
+  if (!linked && print_log) {
+    GLint infolen = 0;
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &infolen);
+    if (infolen > 1){
+      char *infolog = (char *)malloc(infolen);
+      glGetProgramInfoLog(program, infolen, NULL, infolog);
+      fprintf(stderr, "Error linking program:\n %s \n", infolog);
+      free(infolog);
+    }
+  }
+  return linked;
+}
+
+/* creates every missing directory of path, like mkdir -p */
+static bool make_dirs(const char *path)
+{
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s", path);
+  for (char *p = tmp + 1; *p; ++p) {
+    if (*p == '/') {
+      *p = '\0';
+      mkdir(tmp, 0755);
+      *p = '/';
+    }
+  }
+  mkdir(tmp, 0755);
+
+  struct stat st;
+  return stat(tmp, &st) == 0 && S_ISDIR(st.st_mode) && access(tmp, W_OK) == 0;
+}
+
+/* needs a current context. dir may be NULL for the default location */
+static void InitShaderCache(shader_cache_t *cache, const char *dir)
+{
+  memset(cache, 0, sizeof(*cache));
+
+  const char *env = getenv("KEYTOY_SHADER_CACHE");
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (dir) {
+    snprintf(cache->dir, sizeof(cache->dir), "%s", dir);
+  } else if (env) {
+    snprintf(cache->dir, sizeof(cache->dir), "%s", env);
+  } else if (xdg && *xdg) {
+    snprintf(cache->dir, sizeof(cache->dir), "%s/keytoy", xdg);
+  } else if (home && *home) {
+    snprintf(cache->dir, sizeof(cache->dir), "%s/.cache/keytoy", home);
+  }
+  // no fallback to a shared place like /tmp, anyone could plant binaries there
+
+  uint64_t h = 0xcbf29ce484222325ull;
+  h = fnv1a(h, (const char *)glGetString(GL_VENDOR));
+  h = fnv1a(h, (const char *)glGetString(GL_RENDERER));
+  h = fnv1a(h, (const char *)glGetString(GL_VERSION));
+  cache->driver_hash = h;
+
+  GLint formats = 0;
+  bool has_binary = epoxy_gl_version() >= 30 || epoxy_has_gl_extension("GL_OES_get_program_binary");
+  if (has_binary) {
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  }
+  // the query writes all of them, however many there are
+  GLint *list = formats > 0 ? (GLint *)malloc(formats * sizeof(GLint)) : NULL;
+  if (list) {
+    glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, list);
+    for (GLint i = 0; i < formats && cache->format_count < SHADER_CACHE_MAX_FORMATS; ++i) {
+      cache->formats[cache->format_count++] = (GLenum)list[i];
+    }
+    free(list);
+  }
+  cache->retrievable_hint = epoxy_gl_version() >= 30;
+
+  cache->enabled = formats > 0 && cache->dir[0] && make_dirs(cache->dir);
+  if (!cache->enabled) {
+    printf("shader cache disabled (%d binary formats, dir %s)\n", formats, cache->dir[0] ? cache->dir : "unset");
+  }
+}
+
+static bool shader_cache_format_known(const shader_cache_t *cache, GLenum format)
+{
+  for (int i = 0; i < cache->format_count; ++i) {
+    if (cache->formats[i] == format) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void shader_cache_path(const shader_cache_t *cache, uint64_t source_hash, char *path, size_t size)
+{
+  snprintf(path, size, "%s/%016llx-%016llx.bin", cache->dir,
+           (unsigned long long)source_hash, (unsigned long long)cache->driver_hash);
+}
+
+static bool load_program_binary(shader_cache_t *cache, GLuint program, uint64_t source_hash)
+{
+  char path[PATH_MAX];
+  shader_cache_path(cache, source_hash, path, sizeof(path));
+
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return false;
+  }
+
+  shader_cache_header_t header;
+  void *binary = NULL;
+  bool loaded = false;
+  struct stat st;
+
+  if (fstat(fileno(file), &st) == 0 && st.st_size >= (off_t)sizeof(header) &&
+      fread(&header, sizeof(header), 1, file) == 1 &&
+      memcmp(header.magic, SHADER_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+      header.version == SHADER_CACHE_VERSION &&
+      header.source_hash == source_hash &&
+      header.driver_hash == cache->driver_hash &&
+      shader_cache_format_known(cache, header.binary_format) &&
+      header.length > 0 &&
+      // the length is not trusted beyond what the file holds
+      (uint64_t)header.length <= (uint64_t)(st.st_size - sizeof(header)) &&
+      (binary = malloc(header.length)) != NULL &&
+      fread(binary, header.length, 1, file) == 1) {
+    glProgramBinary(program, header.binary_format, binary, header.length);
+    loaded = program_linked(program, false);
+  }
+
+  free(binary);
+  fclose(file);
+
+  if (!loaded) {
+    // stale or corrupt, it is rewritten after the source compile
+    cache->rejected++;
+    unlink(path);
+  }
+  return loaded;
+}
+
+static void store_program_binary(shader_cache_t *cache, GLuint program, uint64_t source_hash)
+{
+  GLint length = 0;
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0) {
+    return;
+  }
+
+  shader_cache_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SHADER_CACHE_MAGIC, sizeof(header.magic));
+  header.version = SHADER_CACHE_VERSION;
+  header.source_hash = source_hash;
+  header.driver_hash = cache->driver_hash;
+
+  void *binary = malloc(length);
+  if (!binary) {
+    return;
+  }
+  GLsizei written = 0;
+  GLenum format = 0;
+  glGetProgramBinary(program, length, &written, &format, binary);
+  header.binary_format = format;
+  header.length = written;
+
+  // write then rename, so a concurrent start never reads half a file
+  char path[PATH_MAX];
+  char tmp_path[PATH_MAX + 16];
+  shader_cache_path(cache, source_hash, path, sizeof(path));
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+
+  FILE *file = fopen(tmp_path, "wb");
+  if (file) {
+    bool ok = written > 0 &&
+      fwrite(&header, sizeof(header), 1, file) == 1 &&
+      fwrite(binary, written, 1, file) == 1;
+    ok = fclose(file) == 0 && ok;
+    if (ok && rename(tmp_path, path) == 0) {
+      cache->stored++;
+    } else {
+      unlink(tmp_path);
+    }
+  }
+  free(binary);
+}
+
+/*
+ * returns a linked program for the sources, from the cache when possible.
+ * cache may be NULL to always compile. returns 0 when compiling or linking
+ * fails, the log is printed to stderr.
+ */
+static GLuint CreateProgramCached(shader_cache_t *cache, const char *vertex_source, const char *fragment_source)
+{
+  GLuint program = glCreateProgram();
+  if (!program) {
+    return 0;
+  }
+
+  uint64_t source_hash = 0xcbf29ce484222325ull;
+  source_hash = fnv1a(source_hash, vertex_source);
+  source_hash = fnv1a(source_hash, fragment_source);
+
+  bool use_cache = cache && cache->enabled;
+  if (use_cache && load_program_binary(cache, program, source_hash)) {
+    cache->hits++;
+    return program;
+  }
+  if (use_cache) {
+    cache->misses++;
+  }
+
+  GLuint vertex_shader = LoadShader(vertex_source, GL_VERTEX_SHADER);
+  GLuint fragment_shader = LoadShader(fragment_source, GL_FRAGMENT_SHADER);
+  if (!vertex_shader || !fragment_shader) {
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+    glDeleteProgram(program);
+    return 0;
+  }
+
+  glAttachShader(program, vertex_shader);
+  glAttachShader(program, fragment_shader);
+  // es2 with GL_OES_get_program_binary has no glProgramParameteri, binaries are retrievable anyway
+  if (use_cache && cache->retrievable_hint) {
+    glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+  }
+  glLinkProgram(program);
+
+  glDeleteShader(vertex_shader);
+  glDeleteShader(fragment_shader);
+
+  if (!program_linked(program, true)) {
+    glDeleteProgram(program);
+    return 0;
+  }
+
+  if (use_cache) {
+    store_program_binary(cache, program, source_hash);
+  }
+  return program;
+}
+
+static void PrintShaderCacheStats(const shader_cache_t *cache)
+{
+  printf("shader cache: %u hits, %u misses, %u rejected, %u stored (%s)\n",
+         cache->hits, cache->misses, cache->rejected, cache->stored, cache->dir);
+}
+
+#endif
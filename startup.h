@@ -0,0 +1,179 @@
+#ifndef KT_STARTUP_H
+#define KT_STARTUP_H
+
+/*
+ * startup task graph and time-to-first-frame report.
+ *
+ * tasks declare the tasks they depend on. every worker task gets its own
+ * thread that waits for its dependencies, so independent setup steps
+ * (input enumeration, drm/egl init, theme loading) overlap. tasks touching
+ * the GL context are flagged main_thread and run in order on the caller.
+ * all times are milliseconds since InitStartup(), which should be the
+ * first thing main() does.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+
+#define STARTUP_MAX_TASKS 16
+
+typedef void (*startup_fn)(void *arg);
+
+typedef struct
+{
+  const char *name;
+  startup_fn fn;
+  void *arg;
+  uint32_t deps;              // bit i set: depends on task i
+  bool main_thread;
+
+  pthread_t thread;
+  double start_ms;
+  double end_ms;
+} startup_task_t;
+
+typedef struct
+{
+  struct timespec origin;
+  startup_task_t tasks[STARTUP_MAX_TASKS];
+  int count;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint32_t done;
+
+  double ready_ms;            // all tasks finished
+  double first_frame_ms;      // first frame handed to the display
+} startup_t;
+
+typedef struct
+{
+  startup_t *startup;
+  int id;
+} startup_worker_t;
+
+static double StartupNow(const startup_t *startup)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - startup->origin.tv_sec) * 1e3 + (now.tv_nsec - startup->origin.tv_nsec) * 1e-6;
+}
+
+static void InitStartup(startup_t *startup)
+{
+  memset(startup, 0, sizeof(*startup));
+  clock_gettime(CLOCK_MONOTONIC, &startup->origin);
+  pthread_mutex_init(&startup->lock, NULL);
+  pthread_cond_init(&startup->cond, NULL);
+}
+
+/* returns the task id, usable as (1u << id) in the deps of later tasks */
+static int AddStartupTask(startup_t *startup, const char *name, startup_fn fn, void *arg,
+                          uint32_t deps, bool main_thread)
+{
+  assert(startup->count < STARTUP_MAX_TASKS);
+  int id = startup->count++;
+  // only earlier tasks can be depended on, which rules out cycles
+  assert((deps >> id) == 0);
+
+  startup_task_t *task = &startup->tasks[id];
+  task->name = name;
+  task->fn = fn;
+  task->arg = arg;
+  task->deps = deps;
+  task->main_thread = main_thread;
+  return id;
+}
+
+static void run_startup_task(startup_t *startup, int id)
+{
+  startup_task_t *task = &startup->tasks[id];
+
+  pthread_mutex_lock(&startup->lock);
+  while ((startup->done & task->deps) != task->deps) {
+    pthread_cond_wait(&startup->cond, &startup->lock);
+  }
+  pthread_mutex_unlock(&startup->lock);
+
+  task->start_ms = StartupNow(startup);
+  task->fn(task->arg);
+  task->end_ms = StartupNow(startup);
+
+  pthread_mutex_lock(&startup->lock);
+  startup->done |= 1u << id;
+  pthread_cond_broadcast(&startup->cond);
+  pthread_mutex_unlock(&startup->lock);
+}
+
+static void *startup_worker(void *arg)
+{
+  startup_worker_t *worker = (startup_worker_t *)arg;
+  run_startup_task(worker->startup, worker->id);
+  return NULL;
+}
+
+/* runs every task, returns once all of them finished */
+static void RunStartup(startup_t *startup)
+{
+  startup_worker_t workers[STARTUP_MAX_TASKS];
+
+  for (int i = 0; i < startup->count; ++i) {
+    if (startup->tasks[i].main_thread) {
+      continue;
+    }
+    workers[i].startup = startup;
+    workers[i].id = i;
+    int ret = pthread_create(&startup->tasks[i].thread, NULL, startup_worker, &workers[i]);
+    assert(ret == 0);
+    (void)ret;
+  }
+
+  for (int i = 0; i < startup->count; ++i) {
+    if (startup->tasks[i].main_thread) {
+      run_startup_task(startup, i);
+    }
+  }
+
+  for (int i = 0; i < startup->count; ++i) {
+    if (!startup->tasks[i].main_thread) {
+      pthread_join(startup->tasks[i].thread, NULL);
+    }
+  }
+
+  startup->ready_ms = StartupNow(startup);
+}
+
+static void PrintStartupReport(const startup_t *startup)
+{
+  double serial_ms = 0.0;
+
+  printf("startup: %-12s %9s %9s %9s\n", "phase", "start", "end", "took");
+  for (int i = 0; i < startup->count; ++i) {
+    const startup_task_t *task = &startup->tasks[i];
+    double took = task->end_ms - task->start_ms;
+    serial_ms += took;
+    printf("startup: %-12s %9.2f %9.2f %9.2f%s\n", task->name, task->start_ms, task->end_ms, took,
+           task->main_thread ? "  (main thread)" : "");
+  }
+  printf("startup: %-12s %9.2f %9.2f %9.2f\n", "first frame", startup->ready_ms, startup->first_frame_ms,
+         startup->first_frame_ms - startup->ready_ms);
+  printf("startup: time to first frame %.2f ms, tasks would take %.2f ms run serially\n",
+         startup->first_frame_ms, serial_ms);
+}
+
+/* call after the first frame is presented, prints the report once */
+static void MarkFirstFrame(startup_t *startup)
+{
+  if (startup->first_frame_ms > 0.0) {
+    return;
+  }
+  startup->first_frame_ms = StartupNow(startup);
+  PrintStartupReport(startup);
+}
+
+#endif
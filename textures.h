@@ -0,0 +1,444 @@
+#ifndef KT_TEXTURES_H
+#define KT_TEXTURES_H
+
+/*
+ * texture manager.
+ *
+ * images are registered with their size and a load callback and only get
+ * GPU memory once they are drawn. images up to TEXTURE_ATLAS_MAX on a side
+ * share atlas pages, packed with a skyline (bottom-left) packer and kept
+ * apart by a transparent 1 px gutter so linear filtering never picks up a
+ * neighbour. larger images get a texture of their own.
+ *
+ * every texture is accounted against a budget. when a new page or texture
+ * would exceed it, the least recently drawn one is deleted and its images
+ * are loaded again through their callback the next time they are drawn.
+ * pages are evicted whole: a skyline cannot give back single rects, and
+ * deleting the texture is what returns the memory to the driver. textures
+ * drawn in the current frame are never evicted; when they alone exceed the
+ * budget it is overrun, and counted.
+ *
+ * registering is plain bookkeeping, AcquireImage does all the GL work and
+ * belongs to the thread that owns the context.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+
+#include <epoxy/gl.h>
+
+#define TEXTURE_PAGE_SIZE 1024
+// larger images get a texture of their own
+#define TEXTURE_ATLAS_MAX 256
+#define TEXTURE_GUTTER 1
+
+/* writes width x height premultiplied RGBA8888 pixels, rows stride bytes apart */
+typedef bool (*image_load_fn)(void *user_data, uint8_t *rgba, size_t stride);
+
+typedef struct
+{
+  int x;
+  int y;
+  int width;
+} skyline_node_t;
+
+typedef struct
+{
+  GLuint texture;             // 0: free slot
+  int width;
+  int height;
+  bool dedicated;             // holds a single image, no packing
+  uint64_t last_used;         // frame
+
+  skyline_node_t *nodes;
+  int node_count;
+  int node_capacity;
+} texture_page_t;
+
+typedef struct
+{
+  const char *name;
+  int width;
+  int height;
+  image_load_fn load;
+  void *user_data;
+
+  int page;                   // -1 while not resident
+  int x, y;                   // in the page, gutter excluded
+  bool failed;                // the callback failed, not retried
+} texture_image_t;
+
+/* where an image lives right now, valid until the next AcquireImage */
+typedef struct
+{
+  GLuint texture;
+  float u0, v0, u1, v1;
+} texture_view_t;
+
+typedef struct
+{
+  size_t budget_bytes;
+  size_t resident_bytes;
+  size_t peak_bytes;
+  uint64_t frame;
+
+  texture_image_t *images;
+  int image_count;
+  int image_capacity;
+  texture_page_t *pages;
+  int page_count;
+  int page_capacity;
+
+  uint8_t *scratch;           // staging for the load callbacks
+  size_t scratch_size;
+
+  uint64_t loads;
+  uint64_t evictions;
+  uint64_t over_budget;       // allocations that had to overrun the budget
+} texture_manager_t;
+
+static void InitTextureManager(texture_manager_t *textures, size_t budget_bytes)
+{
+  memset(textures, 0, sizeof(*textures));
+  textures->budget_bytes = budget_bytes;
+}
+
+/* registers an image, returns its id. no GL, nothing is loaded yet */
+static int AddImage(texture_manager_t *textures, const char *name, int width, int height,
+                    image_load_fn load, void *user_data)
+{
+  if (textures->image_count == textures->image_capacity) {
+    textures->image_capacity = textures->image_capacity ? textures->image_capacity * 2 : 16;
+    textures->images = (texture_image_t *)realloc(textures->images,
+                                                  textures->image_capacity * sizeof(texture_image_t));
+  }
+  texture_image_t *image = &textures->images[textures->image_count];
+  memset(image, 0, sizeof(*image));
+  image->name = name;
+  image->width = width;
+  image->height = height;
+  image->load = load;
+  image->user_data = user_data;
+  image->page = -1;
+  return textures->image_count++;
+}
+
+/* call once per frame before acquiring, it dates the LRU */
+static void BeginTextureFrame(texture_manager_t *textures)
+{
+  textures->frame++;
+}
+
+static size_t TextureManagerBytes(const texture_manager_t *textures)
+{
+  return textures->resident_bytes;
+}
+
+/*    skyline     */
+
+/* lowest y at which a w x h rect starting at node index fits, -1 if none */
+static int skyline_fit(const texture_page_t *page, int index, int w, int h)
+{
+  int x = page->nodes[index].x;
+  if (x + w > page->width) {
+    return -1;
+  }
+  int y = 0;
+  for (int i = index, left = w; left > 0; ++i) {
+    if (page->nodes[i].y > y) {
+      y = page->nodes[i].y;
+    }
+    if (y + h > page->height) {
+      return -1;
+    }
+    left -= page->nodes[i].width;
+  }
+  return y;
+}
+
+static void skyline_insert(texture_page_t *page, int index, skyline_node_t node)
+{
+  if (page->node_count == page->node_capacity) {
+    page->node_capacity = page->node_capacity ? page->node_capacity * 2 : 32;
+    page->nodes = (skyline_node_t *)realloc(page->nodes, page->node_capacity * sizeof(skyline_node_t));
+  }
+  memmove(&page->nodes[index + 1], &page->nodes[index], (page->node_count - index) * sizeof(skyline_node_t));
+  page->nodes[index] = node;
+  page->node_count++;
+}
+
+static void skyline_remove(texture_page_t *page, int index)
+{
+  memmove(&page->nodes[index], &page->nodes[index + 1], (page->node_count - index - 1) * sizeof(skyline_node_t));
+  page->node_count--;
+}
+
+/* bottom-left: the lowest top edge wins, then the snuggest node */
+static bool skyline_pack(texture_page_t *page, int w, int h, int *out_x, int *out_y)
+{
+  int best = -1, best_bottom = INT_MAX, best_width = INT_MAX, best_y = 0;
+  for (int i = 0; i < page->node_count; ++i) {
+    int y = skyline_fit(page, i, w, h);
+    if (y < 0) {
+      continue;
+    }
+    if (y + h < best_bottom || (y + h == best_bottom && page->nodes[i].width < best_width)) {
+      best = i;
+      best_bottom = y + h;
+      best_width = page->nodes[i].width;
+      best_y = y;
+    }
+  }
+  if (best < 0) {
+    return false;
+  }
+
+  skyline_node_t node = { page->nodes[best].x, best_y + h, w };
+  skyline_insert(page, best, node);
+
+  // the new node shadows the start of the ones after it
+  for (int i = best + 1; i < page->node_count; ++i) {
+    skyline_node_t *prev = &page->nodes[i - 1];
+    skyline_node_t *cur = &page->nodes[i];
+    int overlap = prev->x + prev->width - cur->x;
+    if (overlap <= 0) {
+      break;
+    }
+    cur->x += overlap;
+    cur->width -= overlap;
+    if (cur->width > 0) {
+      break;
+    }
+    skyline_remove(page, i--);
+  }
+  for (int i = 0; i + 1 < page->node_count; ++i) {
+    if (page->nodes[i].y == page->nodes[i + 1].y) {
+      page->nodes[i].width += page->nodes[i + 1].width;
+      skyline_remove(page, i + 1);
+      --i;
+    }
+  }
+
+  *out_x = node.x;
+  *out_y = best_y;
+  return true;
+}
+
+/*    residency     */
+
+static size_t texture_page_bytes(const texture_page_t *page)
+{
+  return (size_t)page->width * page->height * 4;
+}
+
+static void texture_evict_page(texture_manager_t *textures, int index)
+{
+  texture_page_t *page = &textures->pages[index];
+  for (int i = 0; i < textures->image_count; ++i) {
+    if (textures->images[i].page == index) {
+      textures->images[i].page = -1;
+    }
+  }
+  glDeleteTextures(1, &page->texture);
+  textures->resident_bytes -= texture_page_bytes(page);
+  free(page->nodes);
+  memset(page, 0, sizeof(*page));
+  textures->evictions++;
+}
+
+/* evicts least recently used pages until bytes more fit the budget */
+static void texture_make_room(texture_manager_t *textures, size_t bytes)
+{
+  while (textures->resident_bytes + bytes > textures->budget_bytes) {
+    int lru = -1;
+    for (int i = 0; i < textures->page_count; ++i) {
+      const texture_page_t *page = &textures->pages[i];
+      if (page->texture && page->last_used < textures->frame &&
+          (lru < 0 || page->last_used < textures->pages[lru].last_used)) {
+        lru = i;
+      }
+    }
+    if (lru < 0) {
+      // everything left is in use this frame
+      textures->over_budget++;
+      return;
+    }
+    texture_evict_page(textures, lru);
+  }
+}
+
+static int texture_new_page(texture_manager_t *textures, int width, int height, bool dedicated)
+{
+  texture_make_room(textures, (size_t)width * height * 4);
+
+  int index = -1;
+  for (int i = 0; i < textures->page_count; ++i) {
+    if (!textures->pages[i].texture) {
+      index = i;
+      break;
+    }
+  }
+  if (index < 0) {
+    if (textures->page_count == textures->page_capacity) {
+      textures->page_capacity = textures->page_capacity ? textures->page_capacity * 2 : 8;
+      textures->pages = (texture_page_t *)realloc(textures->pages,
+                                                  textures->page_capacity * sizeof(texture_page_t));
+    }
+    index = textures->page_count++;
+  }
+
+  texture_page_t *page = &textures->pages[index];
+  memset(page, 0, sizeof(*page));
+  page->width = width;
+  page->height = height;
+  page->dedicated = dedicated;
+  if (!dedicated) {
+    skyline_node_t root = { 0, 0, width };
+    skyline_insert(page, 0, root);
+  }
+
+  glGenTextures(1, &page->texture);
+  glBindTexture(GL_TEXTURE_2D, page->texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  // contents stay undefined until images are uploaded, gutters included
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+  textures->resident_bytes += texture_page_bytes(page);
+  if (textures->resident_bytes > textures->peak_bytes) {
+    textures->peak_bytes = textures->resident_bytes;
+  }
+  return index;
+}
+
+/* finds a page and a spot for the image, x/y include the gutter */
+static int texture_place(texture_manager_t *textures, const texture_image_t *image, int *x, int *y)
+{
+  if (image->width > TEXTURE_ATLAS_MAX || image->height > TEXTURE_ATLAS_MAX) {
+    *x = 0;
+    *y = 0;
+    return texture_new_page(textures, image->width, image->height, true);
+  }
+
+  int w = image->width + 2 * TEXTURE_GUTTER;
+  int h = image->height + 2 * TEXTURE_GUTTER;
+  for (int i = 0; i < textures->page_count; ++i) {
+    texture_page_t *page = &textures->pages[i];
+    if (page->texture && !page->dedicated && skyline_pack(page, w, h, x, y)) {
+      return i;
+    }
+  }
+  int index = texture_new_page(textures, TEXTURE_PAGE_SIZE, TEXTURE_PAGE_SIZE, false);
+  bool packed = skyline_pack(&textures->pages[index], w, h, x, y);
+  assert(packed);
+  (void)packed;
+  return index;
+}
+
+static bool texture_load(texture_manager_t *textures, int id)
+{
+  texture_image_t *image = &textures->images[id];
+  bool dedicated = image->width > TEXTURE_ATLAS_MAX || image->height > TEXTURE_ATLAS_MAX;
+  int gutter = dedicated ? 0 : TEXTURE_GUTTER;
+  int w = image->width + 2 * gutter;
+  int h = image->height + 2 * gutter;
+
+  size_t size = (size_t)w * h * 4;
+  if (size > textures->scratch_size) {
+    free(textures->scratch);
+    textures->scratch = (uint8_t *)malloc(size);
+    textures->scratch_size = textures->scratch ? size : 0;
+    if (!textures->scratch) {
+      return false;
+    }
+  }
+  // transparent gutter around the image
+  memset(textures->scratch, 0, size);
+  size_t stride = (size_t)w * 4;
+  if (!image->load(image->user_data, textures->scratch + gutter * stride + gutter * 4, stride)) {
+    printf("load image %s FAILED!\n", image->name);
+    image->failed = true;
+    return false;
+  }
+
+  int x, y;
+  int index = texture_place(textures, image, &x, &y);
+  texture_page_t *page = &textures->pages[index];
+  glBindTexture(GL_TEXTURE_2D, page->texture);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RGBA, GL_UNSIGNED_BYTE, textures->scratch);
+
+  image->page = index;
+  image->x = x + gutter;
+  image->y = y + gutter;
+  textures->loads++;
+  return true;
+}
+
+/*
+ * makes the image resident, loading it if it was never loaded or got
+ * evicted, and marks it used this frame. false if it cannot be loaded.
+ * leaves an arbitrary texture bound.
+ */
+static bool AcquireImage(texture_manager_t *textures, int id, texture_view_t *view)
+{
+  texture_image_t *image = &textures->images[id];
+  if (image->failed) {
+    return false;
+  }
+  if (image->page < 0 && !texture_load(textures, id)) {
+    return false;
+  }
+
+  texture_page_t *page = &textures->pages[image->page];
+  page->last_used = textures->frame;
+
+  view->texture = page->texture;
+  view->u0 = (float)image->x / page->width;
+  view->v0 = (float)image->y / page->height;
+  view->u1 = (float)(image->x + image->width) / page->width;
+  view->v1 = (float)(image->y + image->height) / page->height;
+  return true;
+}
+
+static void PrintTextureStats(const texture_manager_t *textures)
+{
+  int pages = 0, dedicated = 0, resident = 0;
+  for (int i = 0; i < textures->page_count; ++i) {
+    if (textures->pages[i].texture) {
+      pages++;
+      dedicated += textures->pages[i].dedicated;
+    }
+  }
+  for (int i = 0; i < textures->image_count; ++i) {
+    resident += textures->images[i].page >= 0;
+  }
+  printf("textures: %d images, %d resident in %d textures (%d dedicated), %zu KiB (peak %zu KiB) of %zu KiB\n",
+         textures->image_count, resident, pages, dedicated, textures->resident_bytes / 1024,
+         textures->peak_bytes / 1024, textures->budget_bytes / 1024);
+  printf("textures: %llu loads, %llu evictions, %llu allocations over budget\n",
+         (unsigned long long)textures->loads, (unsigned long long)textures->evictions,
+         (unsigned long long)textures->over_budget);
+}
+
+static void DestroyTextureManager(texture_manager_t *textures)
+{
+  for (int i = 0; i < textures->page_count; ++i) {
+    if (textures->pages[i].texture) {
+      glDeleteTextures(1, &textures->pages[i].texture);
+    }
+    free(textures->pages[i].nodes);
+  }
+  free(textures->pages);
+  free(textures->images);
+  free(textures->scratch);
+  memset(textures, 0, sizeof(*textures));
+}
+
+#endif
@@ -0,0 +1,132 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+/*
+ * polls the keytoy metrics segment and prints one line per interval.
+ * histograms are cumulative in the segment, the percentiles printed are
+ * for the interval only.
+ */
+
+static void usage(const char *argv0)
+{
+  printf("usage: %s [-n /segment-name] [-i interval-ms] [-c count]\n", argv0);
+}
+
+static void histogram_delta(metrics_histogram_t *out, const metrics_histogram_t *now,
+                            const metrics_histogram_t *before)
+{
+  *out = *now;
+  out->count = now->count - before->count;
+  out->sum_usec = now->sum_usec - before->sum_usec;
+  for (int i = 0; i < METRICS_HIST_BUCKETS; ++i) {
+    out->buckets[i] = now->buckets[i] - before->buckets[i];
+  }
+}
+
+/* largest value recorded in an interval histogram, exact up to the bucket width */
+static uint64_t histogram_max(const metrics_histogram_t *hist)
+{
+  for (int i = METRICS_HIST_BUCKETS - 1; i >= 0; --i) {
+    if (hist->buckets[i]) {
+      uint64_t end = i + 1 < METRICS_HIST_BUCKETS ? MetricsBucketStart(i + 1) - 1 : hist->max_usec;
+      return end < hist->max_usec ? end : hist->max_usec;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  const char *name = NULL;
+  int interval_ms = 1000;
+  int count = -1;
+
+  int c;
+  while ((c = getopt(argc, argv, "n:i:c:h")) != -1) {
+    switch (c) {
+    case 'n':
+      name = optarg;
+      break;
+    case 'i':
+      interval_ms = atoi(optarg);
+      break;
+    case 'c':
+      count = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return c == 'h' ? 0 : 1;
+    }
+  }
+  if (interval_ms <= 0) {
+    interval_ms = 1000;
+  }
+
+  metrics_t metrics;
+  if (!OpenMetricsReader(&metrics, name)) {
+    printf("no keytoy metrics at %s\n", metrics.name);
+    return 1;
+  }
+  printf("reading %s from pid %d\n", metrics.name, metrics.segment->pid);
+
+  metrics_payload_t before, now;
+  if (!ReadMetrics(&metrics, &before)) {
+    printf("read metrics FAILED!\n");
+    return 1;
+  }
+
+  printf("%7s %8s %8s %8s %8s %9s %7s %6s %7s %8s %6s %9s %7s %9s %9s\n", "fps", "p50 ms", "p90 ms",
+         "p99 ms", "max ms", "present", "missed", "late", "lead ms", "input/s", "queue", "tex MiB", "culled",
+         "opaq Mpx", "blnd Mpx");
+
+  for (int n = 0; count < 0 || n < count; ++n) {
+    usleep(interval_ms * 1000);
+    if (!ReadMetrics(&metrics, &now)) {
+      continue;
+    }
+
+    uint64_t frames = now.frames - before.frames;
+    double seconds = (now.update_usec - before.update_usec) * 1e-6;
+    if (frames == 0 || seconds <= 0.0) {
+      printf("%7s\n", "idle");
+      continue;
+    }
+
+    metrics_histogram_t frame_time, present, queue;
+    histogram_delta(&frame_time, &now.frame_time, &before.frame_time);
+    histogram_delta(&present, &now.present_interval, &before.present_interval);
+    histogram_delta(&queue, &now.input_queue, &before.input_queue);
+
+    // max: longest frame in this interval, to the bucket width
+    // culled and pixels are compositor averages per frame
+    // queue: most input events handled by one frame in this interval
+    // late: frames that missed their vblank deadline, lead: how early the last one started
+    bool scheduled = now.deadline_frames != before.deadline_frames;
+    printf("%7.1f %8.2f %8.2f %8.2f %8.2f %9.2f %7llu %6llu %7.2f %8.0f %6llu %9.1f %7.1f %9.2f %9.2f\n",
+           frames / seconds,
+           MetricsPercentile(&frame_time, 0.5) * 1e-3,
+           MetricsPercentile(&frame_time, 0.9) * 1e-3,
+           MetricsPercentile(&frame_time, 0.99) * 1e-3,
+           histogram_max(&frame_time) * 1e-3,
+           present.count ? present.sum_usec * 1e-3 / present.count : 0.0,
+           (unsigned long long)(now.missed_vblanks - before.missed_vblanks),
+           (unsigned long long)(now.missed_deadlines - before.missed_deadlines),
+           scheduled ? now.deadline_lead_usec * 1e-3 : 0.0,
+           (now.input_events - before.input_events) / seconds,
+           (unsigned long long)histogram_max(&queue),
+           now.texture_bytes / (1024.0 * 1024.0),
+           (double)(now.surfaces_culled - before.surfaces_culled) / frames,
+           (now.pixels_opaque - before.pixels_opaque) * 1e-6 / frames,
+           (now.pixels_blended - before.pixels_blended) * 1e-6 / frames);
+    fflush(stdout);
+    before = now;
+  }
+
+  CloseMetrics(&metrics);
+  return 0;
+}
@@ -0,0 +1,804 @@
+#ifndef KT_YUV_H
+#define KT_YUV_H
+
+/*
+ * planar YUV surfaces converted to RGB on the GPU.
+ *
+ * NV12 and I420 frames from shared memory are uploaded as one texture per
+ * plane at their native size, 1.5 bytes per pixel instead of the 4 of an
+ * RGBA upload. the fragment shader applies the BT.601 or BT.709 matrix with
+ * limited or full range and the sampler upscales the chroma.
+ *
+ * a dmabuf is imported without a copy: each plane becomes an R8/GR88
+ * EGLImage bound to a 2D texture, so the same shader runs. drivers that
+ * refuse single plane images get one multi-plane EGLImage on an external
+ * texture instead; the matrix and range then travel as EGL color space
+ * hints and the driver converts while sampling.
+ *
+ * ConvertYUVToRGBA is the CPU path, kept as the reference and baseline.
+ *
+ * frames reach keytoy as a raw stream of packed frames, from a fifo, a
+ * pipe or a file in /dev/shm, see yuv_reader_t; the compositor draws the
+ * surface as one of its layers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <drm_fourcc.h>
+
+#include <epoxy/gl.h>
+#include <epoxy/egl.h>
+
+#include "shaders.h"
+
+#define YUV_MAX_PLANES 3
+
+typedef enum
+{
+  YUV_FORMAT_NV12 = 0,        // Y plane, interleaved UV plane at half size
+  YUV_FORMAT_I420,            // Y, U and V planes, chroma at half size
+  YUV_FORMAT_COUNT,
+} yuv_format_t;
+
+typedef enum
+{
+  YUV_MATRIX_BT601 = 0,       // SD video, most webcams
+  YUV_MATRIX_BT709,           // HD video
+} yuv_matrix_t;
+
+typedef enum
+{
+  YUV_RANGE_LIMITED = 0,      // Y 16..235, chroma 16..240
+  YUV_RANGE_FULL,             // 0..255, jpeg and some cameras
+} yuv_range_t;
+
+typedef enum
+{
+  YUV_SHADER_NV12 = 0,        // uploaded, chroma in luminance alpha
+  YUV_SHADER_NV12_RG,         // imported, chroma plane as GR88
+  YUV_SHADER_I420,
+  YUV_SHADER_EXTERNAL,        // multi-plane EGLImage, the driver converts
+  YUV_SHADER_COUNT,
+} yuv_shader_t;
+
+/* a frame in CPU memory, rows top down */
+typedef struct
+{
+  yuv_format_t format;
+  int width;
+  int height;
+  const uint8_t *planes[YUV_MAX_PLANES];
+  size_t strides[YUV_MAX_PLANES];
+} yuv_image_t;
+
+/* a frame in a dmabuf. the fds stay owned by the caller, EGL takes its own reference */
+typedef struct
+{
+  yuv_format_t format;
+  int width;
+  int height;
+  int fds[YUV_MAX_PLANES];
+  uint32_t offsets[YUV_MAX_PLANES];
+  uint32_t strides[YUV_MAX_PLANES];
+  uint64_t modifier;          // DRM_FORMAT_MOD_INVALID for the implicit layout
+} yuv_dmabuf_t;
+
+typedef struct
+{
+  yuv_format_t format;
+  yuv_matrix_t matrix;
+  yuv_range_t range;
+  int width;
+  int height;
+
+  yuv_shader_t shader;
+  GLenum target;              // GL_TEXTURE_2D, GL_TEXTURE_EXTERNAL_OES for a multi-plane import
+  GLuint textures[YUV_MAX_PLANES];
+  int count;                  // textures in use
+  bool row_length;            // GL_UNPACK_ROW_LENGTH, strided planes upload in one call
+
+  EGLDisplay display;
+  EGLImageKHR images[YUV_MAX_PLANES];
+
+  uint64_t uploads;
+  uint64_t upload_bytes;
+  uint64_t imports;
+} yuv_surface_t;
+
+typedef struct
+{
+  GLuint program;
+  GLint position;
+  GLint texcoord;
+  GLint mvp;
+  GLint opacity;
+  GLint matrix;
+  GLint offset;
+} yuv_program_t;
+
+typedef struct
+{
+  shader_cache_t *cache;
+  yuv_program_t programs[YUV_SHADER_COUNT];
+  bool failed[YUV_SHADER_COUNT];
+} yuv_renderer_t;
+
+static int YUVPlaneCount(yuv_format_t format)
+{
+  return format == YUV_FORMAT_NV12 ? 2 : 3;
+}
+
+/* plane size in texels and bytes per texel */
+static void yuv_plane_size(yuv_format_t format, int plane, int width, int height,
+                           int *plane_width, int *plane_height, int *texel_bytes)
+{
+  *plane_width = plane == 0 ? width : (width + 1) / 2;
+  *plane_height = plane == 0 ? height : (height + 1) / 2;
+  *texel_bytes = format == YUV_FORMAT_NV12 && plane == 1 ? 2 : 1;
+}
+
+/* the planes of a frame with tightly packed rows, one after another */
+static void PackedYUVImage(yuv_image_t *image, yuv_format_t format, int width, int height, const uint8_t *data)
+{
+  memset(image, 0, sizeof(*image));
+  image->format = format;
+  image->width = width;
+  image->height = height;
+  for (int i = 0; i < YUVPlaneCount(format); ++i) {
+    int w, h, texel;
+    yuv_plane_size(format, i, width, height, &w, &h, &texel);
+    image->planes[i] = data;
+    image->strides[i] = (size_t)w * texel;
+    data += image->strides[i] * h;
+  }
+}
+
+/* bytes of one frame with tightly packed rows */
+static size_t YUVFrameBytes(yuv_format_t format, int width, int height)
+{
+  size_t bytes = 0;
+  for (int i = 0; i < YUVPlaneCount(format); ++i) {
+    int w, h, texel;
+    yuv_plane_size(format, i, width, height, &w, &h, &texel);
+    bytes += (size_t)w * h * texel;
+  }
+  return bytes;
+}
+
+/*
+ * column major mat3 and offset taking texel values (0..1) to RGB (0..1).
+ * the rows come from Kr and Kb of the standard; limited range is scaled
+ * up first, chroma is centered on 128.
+ */
+static void yuv_coefficients(yuv_matrix_t matrix, yuv_range_t range, float m[9], float offset[3])
+{
+  float kr = matrix == YUV_MATRIX_BT709 ? 0.2126f : 0.299f;
+  float kb = matrix == YUV_MATRIX_BT709 ? 0.0722f : 0.114f;
+  float kg = 1.f - kr - kb;
+  float k[3][3] = {
+    { 1.f, 0.f,                       2.f * (1.f - kr) },
+    { 1.f, -2.f * kb * (1.f - kb) / kg, -2.f * kr * (1.f - kr) / kg },
+    { 1.f, 2.f * (1.f - kb),          0.f },
+  };
+  bool full = range == YUV_RANGE_FULL;
+  float scale[3] = { full ? 1.f : 255.f / 219.f, full ? 1.f : 255.f / 224.f, full ? 1.f : 255.f / 224.f };
+  float bias[3] = { full ? 0.f : 16.f / 255.f, 128.f / 255.f, 128.f / 255.f };
+
+  for (int row = 0; row < 3; ++row) {
+    offset[row] = 0.f;
+    for (int col = 0; col < 3; ++col) {
+      float v = k[row][col] * scale[col];
+      m[col * 3 + row] = v;
+      offset[row] -= v * bias[col];
+    }
+  }
+}
+
+/*    CPU conversion     */
+
+static inline uint8_t yuv_clamp(int v)
+{
+  return v < 0 ? 0 : v > 255 ? 255 : (uint8_t)v;
+}
+
+/* dst_stride 0 means width * 4. fixed point, two pixels share each chroma sample */
+static void ConvertYUVToRGBA(uint8_t *dst, size_t dst_stride, const yuv_image_t *image,
+                             yuv_matrix_t matrix, yuv_range_t range)
+{
+  float m[9];
+  float offset[3];
+  yuv_coefficients(matrix, range, m, offset);
+
+  // Q12, offsets carry the rounding
+  int cy = (int)(m[0] * 4096.f + 0.5f);
+  int crv = (int)(m[6] * 4096.f + 0.5f);
+  int cgu = (int)(m[4] * 4096.f - 0.5f);
+  int cgv = (int)(m[7] * 4096.f - 0.5f);
+  int cbu = (int)(m[5] * 4096.f + 0.5f);
+  int o[3];
+  for (int i = 0; i < 3; ++i) {
+    o[i] = (int)(offset[i] * 255.f * 4096.f + (offset[i] < 0.f ? -0.5f : 0.5f)) + 2048;
+  }
+
+  if (dst_stride == 0) {
+    dst_stride = (size_t)image->width * 4;
+  }
+  bool nv12 = image->format == YUV_FORMAT_NV12;
+
+  for (int y = 0; y < image->height; ++y) {
+    const uint8_t *luma = image->planes[0] + y * image->strides[0];
+    const uint8_t *u_row = image->planes[1] + (y / 2) * image->strides[1];
+    const uint8_t *v_row = nv12 ? u_row + 1 : image->planes[2] + (y / 2) * image->strides[2];
+    int chroma_step = nv12 ? 2 : 1;
+    uint8_t *out = dst + y * dst_stride;
+
+    for (int x = 0; x < image->width; x += 2) {
+      int u = u_row[(x / 2) * chroma_step];
+      int v = v_row[(x / 2) * chroma_step];
+      int r = crv * v + o[0];
+      int g = cgu * u + cgv * v + o[1];
+      int b = cbu * u + o[2];
+
+      int n = x + 1 < image->width ? 2 : 1;
+      for (int i = 0; i < n; ++i) {
+        int l = cy * luma[x + i];
+        out[0] = yuv_clamp((l + r) >> 12);
+        out[1] = yuv_clamp((l + g) >> 12);
+        out[2] = yuv_clamp((l + b) >> 12);
+        out[3] = 255;
+        out += 4;
+      }
+    }
+  }
+}
+
+/*    shaders     */
+
+static const char YUV_VERTEX_SHADER[] =
+  "attribute vec2 a_position;"
+  "attribute vec2 a_texcoord;"
+  "uniform mat4 u_mvp;"
+  "varying vec2 v_texcoord;"
+  "void main(){"
+  "    gl_Position = u_mvp * vec4(a_position, 0, 1);"
+  "    v_texcoord = a_texcoord;"
+  "}";
+
+// how each variant fetches the chroma pair
+static const char *yuv_chroma_fetch[YUV_SHADER_EXTERNAL] = {
+  "#define FETCH_UV(t) texture2D(s_u, t).ra\n",
+  "#define FETCH_UV(t) texture2D(s_u, t).rg\n",
+  "#define FETCH_UV(t) vec2(texture2D(s_u, t).r, texture2D(s_v, t).r)\n",
+};
+
+static const char YUV_FRAGMENT_SHADER[] =
+  "#ifdef GL_FRAGMENT_PRECISION_HIGH\n"
+  "precision highp float;\n"
+  "#else\n"
+  "precision mediump float;\n"
+  "#endif\n"
+  "varying vec2 v_texcoord;"
+  "uniform sampler2D s_y;"
+  "uniform sampler2D s_u;"
+  "uniform sampler2D s_v;"
+  "uniform mat3 u_matrix;"
+  "uniform vec3 u_offset;"
+  "uniform float u_opacity;"
+  "void main(){"
+  "    vec3 yuv = vec3(texture2D(s_y, v_texcoord).r, FETCH_UV(v_texcoord));"
+  "    gl_FragColor = vec4(clamp(u_matrix * yuv + u_offset, 0.0, 1.0), 1.0) * u_opacity;"
+  "}";
+
+static const char YUV_EXTERNAL_FRAGMENT_SHADER[] =
+  "#extension GL_OES_EGL_image_external : require\n"
+  "precision mediump float;"
+  "varying vec2 v_texcoord;"
+  "uniform samplerExternalOES s_y;"
+  "uniform float u_opacity;"
+  "void main(){"
+  "    gl_FragColor = texture2D(s_y, v_texcoord) * u_opacity;"
+  "}";
+
+/* cache may be NULL. programs are compiled on first use */
+static void InitYUVRenderer(yuv_renderer_t *renderer, shader_cache_t *cache)
+{
+  memset(renderer, 0, sizeof(*renderer));
+  renderer->cache = cache;
+}
+
+static const yuv_program_t *yuv_program(yuv_renderer_t *renderer, yuv_shader_t shader)
+{
+  yuv_program_t *p = &renderer->programs[shader];
+  if (p->program || renderer->failed[shader]) {
+    return p->program ? p : NULL;
+  }
+
+  char fragment[1024];
+  if (shader == YUV_SHADER_EXTERNAL) {
+    snprintf(fragment, sizeof(fragment), "%s", YUV_EXTERNAL_FRAGMENT_SHADER);
+  } else {
+    snprintf(fragment, sizeof(fragment), "%s%s", yuv_chroma_fetch[shader], YUV_FRAGMENT_SHADER);
+  }
+  p->program = CreateProgramCached(renderer->cache, YUV_VERTEX_SHADER, fragment);
+  if (!p->program) {
+    printf("yuv shader %d FAILED!\n", (int)shader);
+    renderer->failed[shader] = true;
+    return NULL;
+  }
+
+  p->position = glGetAttribLocation(p->program, "a_position");
+  p->texcoord = glGetAttribLocation(p->program, "a_texcoord");
+  p->mvp = glGetUniformLocation(p->program, "u_mvp");
+  p->opacity = glGetUniformLocation(p->program, "u_opacity");
+  p->matrix = glGetUniformLocation(p->program, "u_matrix");
+  p->offset = glGetUniformLocation(p->program, "u_offset");
+  glUseProgram(p->program);
+  glUniform1i(glGetUniformLocation(p->program, "s_y"), 0);
+  glUniform1i(glGetUniformLocation(p->program, "s_u"), 1);
+  glUniform1i(glGetUniformLocation(p->program, "s_v"), 2);
+  return p;
+}
+
+static void DestroyYUVRenderer(yuv_renderer_t *renderer)
+{
+  for (int i = 0; i < YUV_SHADER_COUNT; ++i) {
+    if (renderer->programs[i].program) {
+      glDeleteProgram(renderer->programs[i].program);
+    }
+  }
+  memset(renderer->programs, 0, sizeof(renderer->programs));
+}
+
+/*    surfaces     */
+
+/* no GL yet, textures appear with the first upload or import */
+static void InitYUVSurface(yuv_surface_t *surface, yuv_format_t format, int width, int height,
+                           yuv_matrix_t matrix, yuv_range_t range)
+{
+  memset(surface, 0, sizeof(*surface));
+  surface->format = format;
+  surface->width = width;
+  surface->height = height;
+  surface->matrix = matrix;
+  surface->range = range;
+  surface->target = GL_TEXTURE_2D;
+}
+
+static void yuv_release(yuv_surface_t *surface)
+{
+  if (surface->count) {
+    glDeleteTextures(surface->count, surface->textures);
+  }
+  for (int i = 0; i < YUV_MAX_PLANES; ++i) {
+    if (surface->images[i] != EGL_NO_IMAGE_KHR) {
+      eglDestroyImageKHR(surface->display, surface->images[i]);
+      surface->images[i] = EGL_NO_IMAGE_KHR;
+    }
+  }
+  memset(surface->textures, 0, sizeof(surface->textures));
+  surface->count = 0;
+}
+
+static void yuv_create_textures(yuv_surface_t *surface, GLenum target, int count)
+{
+  surface->target = target;
+  surface->count = count;
+  glGenTextures(count, surface->textures);
+  for (int i = 0; i < count; ++i) {
+    glBindTexture(target, surface->textures[i]);
+    // planes are rarely a power of two, es2 then wants no mipmaps and clamping
+    glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  }
+}
+
+static void yuv_upload_plane(yuv_surface_t *surface, GLenum format, int width, int height, int texel,
+                             const uint8_t *pixels, size_t stride)
+{
+  size_t row = (size_t)width * texel;
+  if (stride == row) {
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, GL_UNSIGNED_BYTE, pixels);
+  } else if (surface->row_length && stride % texel == 0) {
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, (GLint)(stride / texel));
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, GL_UNSIGNED_BYTE, pixels);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  } else {
+    for (int y = 0; y < height; ++y) {
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y, width, 1, format, GL_UNSIGNED_BYTE, pixels + y * stride);
+    }
+  }
+  surface->upload_bytes += row * height;
+}
+
+/* copies a CPU frame into the plane textures; the frame must match the surface */
+static bool UploadYUV(yuv_surface_t *surface, const yuv_image_t *image)
+{
+  if (image->format != surface->format || image->width != surface->width || image->height != surface->height) {
+    printf("yuv upload %dx%d into a %dx%d surface FAILED!\n",
+           image->width, image->height, surface->width, surface->height);
+    return false;
+  }
+
+  int count = YUVPlaneCount(surface->format);
+  bool allocate = surface->count == 0 || surface->images[0] != EGL_NO_IMAGE_KHR;
+  if (allocate) {
+    yuv_release(surface);
+    yuv_create_textures(surface, GL_TEXTURE_2D, count);
+    surface->row_length = epoxy_gl_version() >= 30 || epoxy_has_gl_extension("GL_EXT_unpack_subimage");
+    surface->shader = surface->format == YUV_FORMAT_NV12 ? YUV_SHADER_NV12 : YUV_SHADER_I420;
+  }
+
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  for (int i = 0; i < count; ++i) {
+    int w, h, texel;
+    yuv_plane_size(surface->format, i, surface->width, surface->height, &w, &h, &texel);
+    // luminance alpha keeps es2 working, the shader reads chroma from .ra
+    GLenum format = texel == 2 ? GL_LUMINANCE_ALPHA : GL_LUMINANCE;
+
+    glBindTexture(GL_TEXTURE_2D, surface->textures[i]);
+    if (allocate) {
+      glTexImage2D(GL_TEXTURE_2D, 0, format, w, h, 0, format, GL_UNSIGNED_BYTE, NULL);
+    }
+    yuv_upload_plane(surface, format, w, h, texel, image->planes[i], image->strides[i]);
+  }
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  surface->uploads++;
+  return true;
+}
+
+/* attributes for one dmabuf plane, starting at the PLANE<n> names of plane */
+static int yuv_plane_attribs(EGLint *attribs, int n, const yuv_dmabuf_t *buffer, int plane, int slot,
+                             bool modifiers)
+{
+  static const EGLint names[YUV_MAX_PLANES][5] = {
+    { EGL_DMA_BUF_PLANE0_FD_EXT, EGL_DMA_BUF_PLANE0_OFFSET_EXT, EGL_DMA_BUF_PLANE0_PITCH_EXT,
+      EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT },
+    { EGL_DMA_BUF_PLANE1_FD_EXT, EGL_DMA_BUF_PLANE1_OFFSET_EXT, EGL_DMA_BUF_PLANE1_PITCH_EXT,
+      EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT },
+    { EGL_DMA_BUF_PLANE2_FD_EXT, EGL_DMA_BUF_PLANE2_OFFSET_EXT, EGL_DMA_BUF_PLANE2_PITCH_EXT,
+      EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT },
+  };
+  attribs[n++] = names[slot][0];
+  attribs[n++] = buffer->fds[plane];
+  attribs[n++] = names[slot][1];
+  attribs[n++] = (EGLint)buffer->offsets[plane];
+  attribs[n++] = names[slot][2];
+  attribs[n++] = (EGLint)buffer->strides[plane];
+  if (modifiers) {
+    attribs[n++] = names[slot][3];
+    attribs[n++] = (EGLint)(buffer->modifier & 0xffffffff);
+    attribs[n++] = names[slot][4];
+    attribs[n++] = (EGLint)(buffer->modifier >> 32);
+  }
+  return n;
+}
+
+static EGLImageKHR yuv_create_image(EGLDisplay display, const EGLint *attribs)
+{
+  return eglCreateImageKHR(display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, (EGLClientBuffer)NULL, attribs);
+}
+
+static bool yuv_import_planes(yuv_surface_t *surface, const yuv_dmabuf_t *buffer, bool modifiers)
+{
+  int count = YUVPlaneCount(buffer->format);
+  for (int i = 0; i < count; ++i) {
+    int w, h, texel;
+    yuv_plane_size(buffer->format, i, buffer->width, buffer->height, &w, &h, &texel);
+    EGLint attribs[32];
+    int n = 0;
+    attribs[n++] = EGL_WIDTH;
+    attribs[n++] = w;
+    attribs[n++] = EGL_HEIGHT;
+    attribs[n++] = h;
+    attribs[n++] = EGL_LINUX_DRM_FOURCC_EXT;
+    attribs[n++] = texel == 2 ? DRM_FORMAT_GR88 : DRM_FORMAT_R8;
+    n = yuv_plane_attribs(attribs, n, buffer, i, 0, modifiers);
+    attribs[n++] = EGL_NONE;
+
+    surface->images[i] = yuv_create_image(surface->display, attribs);
+    if (surface->images[i] == EGL_NO_IMAGE_KHR) {
+      return false;
+    }
+  }
+
+  yuv_create_textures(surface, GL_TEXTURE_2D, count);
+  for (int i = 0; i < count; ++i) {
+    glBindTexture(GL_TEXTURE_2D, surface->textures[i]);
+    glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, (GLeglImageOES)surface->images[i]);
+  }
+  if (glGetError() != GL_NO_ERROR) {
+    return false;
+  }
+  surface->shader = buffer->format == YUV_FORMAT_NV12 ? YUV_SHADER_NV12_RG : YUV_SHADER_I420;
+  return true;
+}
+
+static bool yuv_import_external(yuv_surface_t *surface, const yuv_dmabuf_t *buffer, bool modifiers)
+{
+  if (!epoxy_has_gl_extension("GL_OES_EGL_image_external")) {
+    return false;
+  }
+
+  EGLint attribs[64];
+  int n = 0;
+  attribs[n++] = EGL_WIDTH;
+  attribs[n++] = buffer->width;
+  attribs[n++] = EGL_HEIGHT;
+  attribs[n++] = buffer->height;
+  attribs[n++] = EGL_LINUX_DRM_FOURCC_EXT;
+  attribs[n++] = buffer->format == YUV_FORMAT_NV12 ? DRM_FORMAT_NV12 : DRM_FORMAT_YUV420;
+  for (int i = 0; i < YUVPlaneCount(buffer->format); ++i) {
+    n = yuv_plane_attribs(attribs, n, buffer, i, i, modifiers);
+  }
+  attribs[n++] = EGL_YUV_COLOR_SPACE_HINT_EXT;
+  attribs[n++] = surface->matrix == YUV_MATRIX_BT709 ? EGL_ITU_REC709_EXT : EGL_ITU_REC601_EXT;
+  attribs[n++] = EGL_SAMPLE_RANGE_HINT_EXT;
+  attribs[n++] = surface->range == YUV_RANGE_FULL ? EGL_YUV_FULL_RANGE_EXT : EGL_YUV_NARROW_RANGE_EXT;
+  attribs[n++] = EGL_NONE;
+
+  surface->images[0] = yuv_create_image(surface->display, attribs);
+  if (surface->images[0] == EGL_NO_IMAGE_KHR) {
+    return false;
+  }
+  yuv_create_textures(surface, GL_TEXTURE_EXTERNAL_OES, 1);
+  glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, (GLeglImageOES)surface->images[0]);
+  if (glGetError() != GL_NO_ERROR) {
+    return false;
+  }
+  surface->shader = YUV_SHADER_EXTERNAL;
+  return true;
+}
+
+/*
+ * binds a dmabuf frame to the surface, replacing the previous frame. an
+ * import costs a few driver calls, not a copy; a producer cycling through a
+ * fixed set of buffers can keep one surface per buffer and import once.
+ */
+static bool ImportYUVDmabuf(yuv_surface_t *surface, EGLDisplay display, const yuv_dmabuf_t *buffer)
+{
+  if (buffer->format != surface->format || buffer->width != surface->width || buffer->height != surface->height) {
+    printf("yuv import %dx%d into a %dx%d surface FAILED!\n",
+           buffer->width, buffer->height, surface->width, surface->height);
+    return false;
+  }
+  if (!epoxy_has_egl_extension(display, "EGL_EXT_image_dma_buf_import") ||
+      !epoxy_has_gl_extension("GL_OES_EGL_image")) {
+    printf("yuv dmabuf import: EGL_EXT_image_dma_buf_import or GL_OES_EGL_image missing\n");
+    return false;
+  }
+  bool modifiers = buffer->modifier != DRM_FORMAT_MOD_INVALID &&
+    epoxy_has_egl_extension(display, "EGL_EXT_image_dma_buf_import_modifiers");
+
+  yuv_release(surface);
+  surface->display = display;
+  while (glGetError() != GL_NO_ERROR) {
+  }
+
+  if (!yuv_import_planes(surface, buffer, modifiers)) {
+    yuv_release(surface);
+    if (!yuv_import_external(surface, buffer, modifiers)) {
+      yuv_release(surface);
+      printf("yuv dmabuf import FAILED!\n");
+      return false;
+    }
+  }
+  surface->imports++;
+  return true;
+}
+
+/*
+ * makes the surface's program current with its planes bound to units 0-2,
+ * for DrawYUVArrays. opacity scales the premultiplied result. NULL when
+ * the surface has no frame yet or its shader failed.
+ */
+static const yuv_program_t *BindYUV(yuv_renderer_t *renderer, const yuv_surface_t *surface,
+                                    const GLfloat mvp[16], float opacity)
+{
+  if (surface->count == 0) {
+    return NULL;
+  }
+  const yuv_program_t *p = yuv_program(renderer, surface->shader);
+  if (!p) {
+    return NULL;
+  }
+
+  glUseProgram(p->program);
+  glUniformMatrix4fv(p->mvp, 1, GL_FALSE, mvp);
+  glUniform1f(p->opacity, opacity);
+  if (surface->shader != YUV_SHADER_EXTERNAL) {
+    float m[9];
+    float offset[3];
+    yuv_coefficients(surface->matrix, surface->range, m, offset);
+    glUniformMatrix3fv(p->matrix, 1, GL_FALSE, m);
+    glUniform3fv(p->offset, 1, offset);
+  }
+  for (int i = 0; i < surface->count; ++i) {
+    glActiveTexture(GL_TEXTURE0 + i);
+    glBindTexture(surface->target, surface->textures[i]);
+  }
+  glActiveTexture(GL_TEXTURE0);
+  return p;
+}
+
+/* each vertex is x, y and, texcoord floats in, u, v with v = 0 the top row. stride in floats */
+static void DrawYUVArrays(const yuv_program_t *p, GLenum mode, const GLfloat *vertices, int stride,
+                          int texcoord, int count)
+{
+  glEnableVertexAttribArray(p->position);
+  glVertexAttribPointer(p->position, 2, GL_FLOAT, GL_FALSE, stride * sizeof(GLfloat), vertices);
+  glEnableVertexAttribArray(p->texcoord);
+  glVertexAttribPointer(p->texcoord, 2, GL_FLOAT, GL_FALSE, stride * sizeof(GLfloat), vertices + texcoord);
+  glDrawArrays(mode, 0, count);
+  // the caller's program may not read these locations, leave nothing pointing at its vertices
+  glDisableVertexAttribArray(p->position);
+  glDisableVertexAttribArray(p->texcoord);
+}
+
+/* draws the surface over the current viewport, rows top down */
+static bool DrawYUV(yuv_renderer_t *renderer, const yuv_surface_t *surface)
+{
+  static const GLfloat identity[16] = {
+    1, 0, 0, 0,
+    0, 1, 0, 0,
+    0, 0, 1, 0,
+    0, 0, 0, 1,
+  };
+  static const GLfloat vertex[] = {
+    -1,  1,  0, 0,
+    -1, -1,  0, 1,
+     1,  1,  1, 0,
+     1, -1,  1, 1,
+  };
+
+  const yuv_program_t *p = BindYUV(renderer, surface, identity, 1.f);
+  if (!p) {
+    return false;
+  }
+  DrawYUVArrays(p, GL_TRIANGLE_STRIP, vertex, 4, 2, 4);
+  return true;
+}
+
+static void DestroyYUVSurface(yuv_surface_t *surface)
+{
+  yuv_release(surface);
+}
+
+static void PrintYUVStats(const yuv_surface_t *surface)
+{
+  static const char *shader_names[YUV_SHADER_COUNT] = { "nv12", "nv12 rg", "i420", "external" };
+  double uploads = surface->uploads ? (double)surface->uploads : 1.0;
+  printf("yuv %dx%d %s: %llu uploads, %.2f MiB/upload, %llu imports\n",
+         surface->width, surface->height, shader_names[surface->shader],
+         (unsigned long long)surface->uploads, surface->upload_bytes / uploads / (1024.0 * 1024.0),
+         (unsigned long long)surface->imports);
+}
+
+/*    raw stream     */
+
+/*
+ * packed frames back to back, as ffmpeg -f rawvideo writes them. a fifo or
+ * pipe is read without blocking and its frames are shown as they come; a
+ * regular file, in /dev/shm or anywhere else, loops at its end.
+ */
+typedef struct
+{
+  int fd;
+  bool loop;                  // regular file, rewound at its end
+  yuv_format_t format;
+  int width;
+  int height;
+  size_t frame_bytes;
+  uint8_t *frame;             // being filled
+  size_t filled;
+
+  uint64_t frames;
+  uint64_t loops;
+} yuv_reader_t;
+
+/* path "-" reads stdin */
+static bool OpenYUVReader(yuv_reader_t *reader, const char *path, yuv_format_t format, int width, int height)
+{
+  memset(reader, 0, sizeof(*reader));
+  reader->fd = strcmp(path, "-") == 0 ? dup(STDIN_FILENO) : open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (reader->fd < 0) {
+    printf("open yuv stream %s FAILED!\n", path);
+    return false;
+  }
+  fcntl(reader->fd, F_SETFL, fcntl(reader->fd, F_GETFL) | O_NONBLOCK);
+
+  struct stat st;
+  reader->loop = fstat(reader->fd, &st) == 0 && S_ISREG(st.st_mode);
+  reader->format = format;
+  reader->width = width;
+  reader->height = height;
+  reader->frame_bytes = YUVFrameBytes(format, width, height);
+  reader->frame = (uint8_t *)malloc(reader->frame_bytes);
+  if (!reader->frame || (reader->loop && (size_t)st.st_size < reader->frame_bytes)) {
+    printf("yuv stream %s holds no %dx%d frame\n", path, width, height);
+    close(reader->fd);
+    free(reader->frame);
+    reader->fd = -1;
+    reader->frame = NULL;
+    return false;
+  }
+  return true;
+}
+
+/*
+ * reads what is available. when a frame is complete it is swapped into
+ * *frame, which may start out NULL, and true is returned; the buffer given
+ * back is filled next. only the newest complete frame is kept.
+ */
+static bool ReadYUVFrame(yuv_reader_t *reader, uint8_t **frame)
+{
+  if (!*frame) {
+    *frame = (uint8_t *)malloc(reader->frame_bytes);
+    if (!*frame) {
+      return false;
+    }
+  }
+
+  bool complete = false;
+  bool rewound = false;
+  for (;;) {
+    ssize_t n = read(reader->fd, reader->frame + reader->filled, reader->frame_bytes - reader->filled);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n == 0 && reader->loop) {
+      // a file truncated below a frame since it was opened would rewind forever
+      if (rewound) {
+        reader->filled = 0;
+        break;
+      }
+      rewound = true;
+      // a partial frame at the end of the file is dropped
+      lseek(reader->fd, 0, SEEK_SET);
+      reader->filled = 0;
+      reader->loops++;
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    reader->filled += (size_t)n;
+    if (reader->filled < reader->frame_bytes) {
+      continue;
+    }
+
+    uint8_t *done = reader->frame;
+    reader->frame = *frame;
+    *frame = done;
+    reader->filled = 0;
+    reader->frames++;
+    complete = true;
+    // a file would be read to its end over and over
+    if (reader->loop) {
+      break;
+    }
+  }
+  return complete;
+}
+
+static void CloseYUVReader(yuv_reader_t *reader)
+{
+  if (reader->fd >= 0) {
+    close(reader->fd);
+  }
+  free(reader->frame);
+  reader->fd = -1;
+  reader->frame = NULL;
+}
+
+#endif